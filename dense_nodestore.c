@@ -0,0 +1,524 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <dense_nodestore.h>
+
+#define DENSE_INDEX_INITIAL     1024    /* power of two */
+#define DENSE_TABLE_INITIAL     64
+#define DENSE_TABLE_MAX         0x10000
+#define DENSE_COPIES            8
+
+typedef struct {
+    UA_Node *node;              /* allocated by the inner nodestore, NULL if free */
+    UA_UInt32 hash;             /* UA_NodeId_hash of the NodeId */
+    UA_UInt32 refCount;
+} dense_slot_t;
+
+typedef struct {
+    dense_slot_t *slots;
+    UA_UInt32 size;
+} dense_table_t;
+
+/* Removed or replaced while still referenced, freed by the last releaseNode */
+typedef struct dense_retired {
+    UA_Node *node;
+    UA_UInt32 refCount;
+    struct dense_retired *next;
+} dense_retired_t;
+
+/* Copies handed out by getNodeCopy; orig is cleared when the original leaves the store */
+typedef struct {
+    const UA_Node *copy;
+    const UA_Node *orig;
+} dense_copy_t;
+
+typedef struct {
+    UA_Nodestore inner;
+    UA_UInt16 namespaceIndex;
+    void *claim;
+    dense_table_t tables[DENSE_NODESTORE_TABLES];
+    UA_UInt32 *index;           /* key + 1 of the slot, 0 if empty; linear probing */
+    UA_UInt32 indexSize;
+    UA_UInt32 count;
+    dense_retired_t *retired;
+    dense_copy_t copies[DENSE_COPIES];
+} dense_nodestore_t;
+
+static dense_slot_t *SlotOfKey(dense_nodestore_t *store, uintptr_t key) {
+    if ((key >> 16) >= DENSE_NODESTORE_TABLES) {
+        return NULL;
+    }
+    dense_table_t *table = &store->tables[key >> 16];
+    UA_UInt32 i = (UA_UInt32)(key & 0xFFFF);
+    return i < table->size ? &table->slots[i] : NULL;
+}
+
+static UA_Boolean IsGatewayNodeId(const dense_nodestore_t *store, const UA_NodeId *nodeId) {
+    return nodeId->namespaceIndex == store->namespaceIndex && nodeId->identifierType == UA_NODEIDTYPE_STRING;
+}
+
+/* Index position of the NodeId, or of the empty entry where it would be inserted */
+static UA_UInt32 IndexFind(dense_nodestore_t *store, const UA_NodeId *nodeId, UA_UInt32 hash) {
+    UA_UInt32 mask = store->indexSize - 1;
+
+    for (UA_UInt32 i = hash & mask;; i = (i + 1) & mask) {
+        if (store->index[i] == 0) {
+            return i;
+        }
+        dense_slot_t *slot = SlotOfKey(store, store->index[i] - 1);
+        if (slot->hash == hash && UA_NodeId_equal(&slot->node->head.nodeId, nodeId)) {
+            return i;
+        }
+    }
+}
+
+static dense_slot_t *Lookup(dense_nodestore_t *store, const UA_NodeId *nodeId, UA_UInt32 *position) {
+    if (store->count == 0 || !IsGatewayNodeId(store, nodeId)) {
+        return NULL;
+    }
+
+    UA_UInt32 i = IndexFind(store, nodeId, UA_NodeId_hash(nodeId));
+    if (store->index[i] == 0) {
+        return NULL;
+    }
+    if (position) {
+        *position = i;
+    }
+    return SlotOfKey(store, store->index[i] - 1);
+}
+
+static UA_StatusCode IndexGrow(dense_nodestore_t *store) {
+    UA_UInt32 size = store->indexSize ? store->indexSize * 2 : DENSE_INDEX_INITIAL;
+    UA_UInt32 *index = calloc(size, sizeof(UA_UInt32));
+
+    if (index == NULL) {
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+
+    for (UA_UInt32 i = 0; i < store->indexSize; i++) {
+        if (store->index[i] == 0) {
+            continue;
+        }
+        UA_UInt32 j = SlotOfKey(store, store->index[i] - 1)->hash & (size - 1);
+        while (index[j] != 0) {
+            j = (j + 1) & (size - 1);
+        }
+        index[j] = store->index[i];
+    }
+
+    free(store->index);
+    store->index = index;
+    store->indexSize = size;
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Backward-shift deletion, keeps every probe sequence free of holes without tombstones */
+static void IndexRemove(dense_nodestore_t *store, UA_UInt32 i) {
+    UA_UInt32 mask = store->indexSize - 1;
+    UA_UInt32 j = i;
+
+    for (;;) {
+        store->index[i] = 0;
+        for (;;) {
+            j = (j + 1) & mask;
+            if (store->index[j] == 0) {
+                return;
+            }
+            UA_UInt32 home = SlotOfKey(store, store->index[j] - 1)->hash & mask;
+            /* The entry at j stays if its home lies cyclically in (i, j] */
+            if (i <= j ? (i < home && home <= j) : (i < home || home <= j)) {
+                continue;
+            }
+            break;
+        }
+        store->index[i] = store->index[j];
+        i = j;
+    }
+}
+
+static dense_slot_t *EnsureSlot(dense_nodestore_t *store, uintptr_t key) {
+    dense_table_t *table = &store->tables[key >> 16];
+    UA_UInt32 i = (UA_UInt32)(key & 0xFFFF);
+
+    if (i >= table->size) {
+        UA_UInt32 size = table->size ? table->size : DENSE_TABLE_INITIAL;
+        while (size <= i) {
+            size *= 2;
+        }
+        if (size > DENSE_TABLE_MAX) {
+            size = DENSE_TABLE_MAX;
+        }
+        dense_slot_t *slots = realloc(table->slots, size * sizeof(dense_slot_t));
+        if (slots == NULL) {
+            return NULL;
+        }
+        memset(slots + table->size, 0, (size - table->size) * sizeof(dense_slot_t));
+        table->slots = slots;
+        table->size = size;
+    }
+    return &table->slots[i];
+}
+
+static dense_copy_t *FindCopy(dense_nodestore_t *store, const UA_Node *copy) {
+    for (int i = 0; i < DENSE_COPIES; i++) {
+        if (store->copies[i].copy == copy) {
+            return &store->copies[i];
+        }
+    }
+    return NULL;
+}
+
+/* Drops a node that left the store, at once or when its last reader releases it */
+static void Retire(dense_nodestore_t *store, UA_Node *node, UA_UInt32 refCount) {
+    for (int i = 0; i < DENSE_COPIES; i++) {
+        if (store->copies[i].orig == node) {
+            store->copies[i].orig = NULL;
+        }
+    }
+
+    if (refCount == 0) {
+        store->inner.deleteNode(store->inner.context, node);
+        return;
+    }
+
+    dense_retired_t *retired = malloc(sizeof(dense_retired_t));
+    if (retired == NULL) {
+        return;     /* leaked rather than freed under a reader */
+    }
+    retired->node = node;
+    retired->refCount = refCount;
+    retired->next = store->retired;
+    store->retired = retired;
+}
+
+static UA_Boolean InnerHas(dense_nodestore_t *store, const UA_NodeId *nodeId) {
+    const UA_Node *node = store->inner.getNode(store->inner.context, nodeId, UA_NODEATTRIBUTESMASK_NONE,
+                                               UA_REFERENCETYPESET_NONE, UA_BROWSEDIRECTION_INVALID);
+    if (node == NULL) {
+        return false;
+    }
+    store->inner.releaseNode(store->inner.context, node);
+    return true;
+}
+
+static UA_StatusCode InsertDense(dense_nodestore_t *store, UA_Node *node, UA_NodeId *addedNodeId) {
+    uintptr_t key = (uintptr_t)node->head.context;
+    const UA_NodeId *nodeId = &node->head.nodeId;
+    UA_StatusCode retval = UA_STATUSCODE_GOOD;
+
+    if (Lookup(store, nodeId, NULL) != NULL || InnerHas(store, nodeId)) {
+        retval = UA_STATUSCODE_BADNODEIDEXISTS;
+    } else if (store->count + 1 > store->indexSize / 2) {
+        retval = IndexGrow(store);
+    }
+
+    dense_slot_t *slot = retval == UA_STATUSCODE_GOOD ? EnsureSlot(store, key) : NULL;
+    if (retval == UA_STATUSCODE_GOOD && slot == NULL) {
+        retval = UA_STATUSCODE_BADOUTOFMEMORY;
+    } else if (slot != NULL && slot->node != NULL) {
+        retval = UA_STATUSCODE_BADNODEIDEXISTS;
+    }
+    if (retval != UA_STATUSCODE_GOOD) {
+        store->inner.deleteNode(store->inner.context, node);
+        return retval;
+    }
+
+    UA_UInt32 hash = UA_NodeId_hash(nodeId);
+    store->index[IndexFind(store, nodeId, hash)] = (UA_UInt32)key + 1;
+    slot->node = node;
+    slot->hash = hash;
+    slot->refCount = 0;
+    store->count++;
+
+    return addedNodeId ? UA_NodeId_copy(nodeId, addedNodeId) : UA_STATUSCODE_GOOD;
+}
+
+static void DenseClear(void *nsCtx) {
+    dense_nodestore_t *store = nsCtx;
+
+    for (int t = 0; t < DENSE_NODESTORE_TABLES; t++) {
+        for (UA_UInt32 i = 0; i < store->tables[t].size; i++) {
+            if (store->tables[t].slots[i].node != NULL) {
+                store->inner.deleteNode(store->inner.context, store->tables[t].slots[i].node);
+            }
+        }
+        free(store->tables[t].slots);
+    }
+    while (store->retired != NULL) {
+        dense_retired_t *next = store->retired->next;
+        store->inner.deleteNode(store->inner.context, store->retired->node);
+        free(store->retired);
+        store->retired = next;
+    }
+    free(store->index);
+
+    store->inner.clear(store->inner.context);
+    free(store);
+}
+
+/* Every node is allocated by the inner store, so any of them can end up in either */
+static UA_Node *DenseNewNode(void *nsCtx, UA_NodeClass nodeClass) {
+    dense_nodestore_t *store = nsCtx;
+    return store->inner.newNode(store->inner.context, nodeClass);
+}
+
+static void DenseDeleteNode(void *nsCtx, UA_Node *node) {
+    dense_nodestore_t *store = nsCtx;
+    dense_copy_t *record = FindCopy(store, node);
+
+    if (record != NULL) {
+        record->copy = NULL;
+    }
+    store->inner.deleteNode(store->inner.context, node);
+}
+
+static const UA_Node *DenseGetNode(void *nsCtx, const UA_NodeId *nodeId, UA_UInt32 attributeMask,
+                                   UA_ReferenceTypeSet references, UA_BrowseDirection referenceDirections) {
+    dense_nodestore_t *store = nsCtx;
+    dense_slot_t *slot = Lookup(store, nodeId, NULL);
+
+    if (slot == NULL) {
+        return store->inner.getNode(store->inner.context, nodeId, attributeMask, references, referenceDirections);
+    }
+    slot->refCount++;
+    return slot->node;
+}
+
+static const UA_Node *DenseGetNodeFromPtr(void *nsCtx, UA_NodePointer ptr, UA_UInt32 attributeMask,
+                                          UA_ReferenceTypeSet references, UA_BrowseDirection referenceDirections) {
+    dense_nodestore_t *store = nsCtx;
+
+    if (UA_NodePointer_isLocal(ptr)) {
+        UA_NodeId nodeId = UA_NodePointer_toNodeId(ptr);
+        dense_slot_t *slot = Lookup(store, &nodeId, NULL);
+        if (slot != NULL) {
+            slot->refCount++;
+            return slot->node;
+        }
+    }
+    return store->inner.getNodeFromPtr(store->inner.context, ptr, attributeMask, references, referenceDirections);
+}
+
+/* Nodes live in RAM, edits are made in place like in the HashMap store */
+static UA_Node *DenseGetEditNode(void *nsCtx, const UA_NodeId *nodeId, UA_UInt32 attributeMask,
+                                 UA_ReferenceTypeSet references, UA_BrowseDirection referenceDirections) {
+    dense_nodestore_t *store = nsCtx;
+    dense_slot_t *slot = Lookup(store, nodeId, NULL);
+
+    if (slot == NULL) {
+        return store->inner.getEditNode(store->inner.context, nodeId, attributeMask, references, referenceDirections);
+    }
+    slot->refCount++;
+    return slot->node;
+}
+
+static UA_Node *DenseGetEditNodeFromPtr(void *nsCtx, UA_NodePointer ptr, UA_UInt32 attributeMask,
+                                        UA_ReferenceTypeSet references, UA_BrowseDirection referenceDirections) {
+    dense_nodestore_t *store = nsCtx;
+
+    if (UA_NodePointer_isLocal(ptr)) {
+        UA_NodeId nodeId = UA_NodePointer_toNodeId(ptr);
+        dense_slot_t *slot = Lookup(store, &nodeId, NULL);
+        if (slot != NULL) {
+            slot->refCount++;
+            return slot->node;
+        }
+    }
+    return store->inner.getEditNodeFromPtr(store->inner.context, ptr, attributeMask, references, referenceDirections);
+}
+
+static void DenseReleaseNode(void *nsCtx, const UA_Node *node) {
+    dense_nodestore_t *store = nsCtx;
+
+    if (node == NULL) {
+        return;
+    }
+
+    if (node->head.nodeClass == UA_NODECLASS_VARIABLE && IsGatewayNodeId(store, &node->head.nodeId)) {
+        /* The context is the slot key unless it was changed after insertion */
+        dense_slot_t *slot = SlotOfKey(store, (uintptr_t)node->head.context);
+        if (slot == NULL || slot->node != node) {
+            slot = Lookup(store, &node->head.nodeId, NULL);
+        }
+        if (slot != NULL && slot->node == node) {
+            if (slot->refCount > 0) {
+                slot->refCount--;
+            }
+            return;
+        }
+
+        for (dense_retired_t **retired = &store->retired; *retired != NULL; retired = &(*retired)->next) {
+            if ((*retired)->node != node) {
+                continue;
+            }
+            if (--(*retired)->refCount == 0) {
+                dense_retired_t *done = *retired;
+                *retired = done->next;
+                store->inner.deleteNode(store->inner.context, done->node);
+                free(done);
+            }
+            return;
+        }
+    }
+
+    store->inner.releaseNode(store->inner.context, node);
+}
+
+static UA_StatusCode DenseGetNodeCopy(void *nsCtx, const UA_NodeId *nodeId, UA_Node **outNode) {
+    dense_nodestore_t *store = nsCtx;
+    dense_slot_t *slot = Lookup(store, nodeId, NULL);
+
+    if (slot == NULL) {
+        return store->inner.getNodeCopy(store->inner.context, nodeId, outNode);
+    }
+
+    UA_Node *copy = store->inner.newNode(store->inner.context, slot->node->head.nodeClass);
+    if (copy == NULL) {
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+    UA_StatusCode retval = UA_Node_copy(slot->node, copy);
+    if (retval != UA_STATUSCODE_GOOD) {
+        store->inner.deleteNode(store->inner.context, copy);
+        return retval;
+    }
+
+    /* Untracked when all records are taken, replaceNode then accepts the copy */
+    dense_copy_t *record = FindCopy(store, NULL);
+    if (record != NULL) {
+        record->copy = copy;
+        record->orig = slot->node;
+    }
+
+    *outNode = copy;
+    return UA_STATUSCODE_GOOD;
+}
+
+static UA_StatusCode DenseInsertNode(void *nsCtx, UA_Node *node, UA_NodeId *addedNodeId) {
+    dense_nodestore_t *store = nsCtx;
+    void *claim = store->claim;
+
+    if (claim != NULL && node->head.context == claim && node->head.nodeClass == UA_NODECLASS_VARIABLE &&
+        IsGatewayNodeId(store, &node->head.nodeId) && (uintptr_t)claim >> 16 < DENSE_NODESTORE_TABLES) {
+        store->claim = NULL;
+        return InsertDense(store, node, addedNodeId);
+    }
+
+    if (Lookup(store, &node->head.nodeId, NULL) != NULL) {
+        store->inner.deleteNode(store->inner.context, node);
+        return UA_STATUSCODE_BADNODEIDEXISTS;
+    }
+    return store->inner.insertNode(store->inner.context, node, addedNodeId);
+}
+
+static UA_StatusCode DenseReplaceNode(void *nsCtx, UA_Node *node) {
+    dense_nodestore_t *store = nsCtx;
+    dense_slot_t *slot = Lookup(store, &node->head.nodeId, NULL);
+
+    if (slot == NULL) {
+        return store->inner.replaceNode(store->inner.context, node);
+    }
+
+    dense_copy_t *record = FindCopy(store, node);
+    if (record != NULL) {
+        UA_Boolean stale = record->orig != slot->node;
+        record->copy = NULL;
+        if (stale) {
+            store->inner.deleteNode(store->inner.context, node);
+            return UA_STATUSCODE_BADINTERNALERROR;
+        }
+    }
+
+    UA_Node *old = slot->node;
+    UA_UInt32 refCount = slot->refCount;
+    slot->node = node;
+    slot->refCount = 0;
+    Retire(store, old, refCount);
+    return UA_STATUSCODE_GOOD;
+}
+
+static UA_StatusCode DenseRemoveNode(void *nsCtx, const UA_NodeId *nodeId) {
+    dense_nodestore_t *store = nsCtx;
+    UA_UInt32 position;
+    dense_slot_t *slot = Lookup(store, nodeId, &position);
+
+    if (slot == NULL) {
+        return store->inner.removeNode(store->inner.context, nodeId);
+    }
+
+    UA_Node *node = slot->node;
+    UA_UInt32 refCount = slot->refCount;
+    IndexRemove(store, position);
+    slot->node = NULL;
+    slot->refCount = 0;
+    store->count--;
+    Retire(store, node, refCount);
+    return UA_STATUSCODE_GOOD;
+}
+
+static const UA_NodeId *DenseGetReferenceTypeId(void *nsCtx, UA_Byte refTypeIndex) {
+    dense_nodestore_t *store = nsCtx;
+    return store->inner.getReferenceTypeId(store->inner.context, refTypeIndex);
+}
+
+static void DenseIterate(void *nsCtx, UA_NodestoreVisitor visitor, void *visitorCtx) {
+    dense_nodestore_t *store = nsCtx;
+
+    for (int t = 0; t < DENSE_NODESTORE_TABLES; t++) {
+        for (UA_UInt32 i = 0; i < store->tables[t].size; i++) {
+            if (store->tables[t].slots[i].node != NULL) {
+                visitor(visitorCtx, store->tables[t].slots[i].node);
+            }
+        }
+    }
+    store->inner.iterate(store->inner.context, visitor, visitorCtx);
+}
+
+UA_StatusCode dense_nodestore_init(UA_Nodestore *ns, const UA_Nodestore *inner, UA_UInt16 namespaceIndex) {
+    dense_nodestore_t *store = calloc(1, sizeof(dense_nodestore_t));
+
+    if (store == NULL) {
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+
+    store->inner = *inner;
+    store->namespaceIndex = namespaceIndex;
+
+    ns->context = store;
+    ns->clear = DenseClear;
+    ns->newNode = DenseNewNode;
+    ns->deleteNode = DenseDeleteNode;
+    ns->getNode = DenseGetNode;
+    ns->getNodeFromPtr = DenseGetNodeFromPtr;
+    ns->getEditNode = DenseGetEditNode;
+    ns->getEditNodeFromPtr = DenseGetEditNodeFromPtr;
+    ns->releaseNode = DenseReleaseNode;
+    ns->getNodeCopy = DenseGetNodeCopy;
+    ns->insertNode = DenseInsertNode;
+    ns->replaceNode = DenseReplaceNode;
+    ns->removeNode = DenseRemoveNode;
+    ns->getReferenceTypeId = DenseGetReferenceTypeId;
+    ns->iterate = DenseIterate;
+    return UA_STATUSCODE_GOOD;
+}
+
+void dense_nodestore_claim(UA_Nodestore *ns, void *context) {
+    if (ns->clear == DenseClear) {
+        ((dense_nodestore_t*)ns->context)->claim = context;
+    }
+}
+
+void dense_nodestore_stats(const UA_Nodestore *ns, dense_nodestore_stats_t *stats) {
+    memset(stats, 0, sizeof(dense_nodestore_stats_t));
+
+    if (ns->clear != DenseClear) {
+        return;
+    }
+
+    const dense_nodestore_t *store = ns->context;
+    stats->nodes = store->count;
+    stats->index_size = store->indexSize;
+    for (int t = 0; t < DENSE_NODESTORE_TABLES; t++) {
+        stats->slots += store->tables[t].size;
+    }
+    stats->bytes = sizeof(dense_nodestore_t) + stats->slots * sizeof(dense_slot_t) + stats->index_size * sizeof(UA_UInt32);
+}
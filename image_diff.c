@@ -0,0 +1,69 @@
+#include <string.h>
+
+#include <image_diff.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define IMAGE_DIFF_KERNEL   "avx2"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define IMAGE_DIFF_KERNEL   "sse2"
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define IMAGE_DIFF_KERNEL   "neon"
+#else
+#define IMAGE_DIFF_KERNEL   "scalar"
+#endif
+
+/* Returns non-zero when the two IMAGE_DIFF_BLOCK byte blocks differ */
+static inline int BlockDiffers(const uint8_t *a, const uint8_t *b) {
+#if defined(__AVX2__)
+    __m256i eq = _mm256_cmpeq_epi8(_mm256_load_si256((const __m256i*)a), _mm256_load_si256((const __m256i*)b));
+    return _mm256_movemask_epi8(eq) != -1;
+#elif defined(__SSE2__)
+    __m128i eq0 = _mm_cmpeq_epi8(_mm_load_si128((const __m128i*)a), _mm_load_si128((const __m128i*)b));
+    __m128i eq1 = _mm_cmpeq_epi8(_mm_load_si128((const __m128i*)(a + 16)), _mm_load_si128((const __m128i*)(b + 16)));
+    return _mm_movemask_epi8(_mm_and_si128(eq0, eq1)) != 0xFFFF;
+#elif defined(__ARM_NEON)
+    uint8x16_t x0 = veorq_u8(vld1q_u8(a), vld1q_u8(b));
+    uint8x16_t x1 = veorq_u8(vld1q_u8(a + 16), vld1q_u8(b + 16));
+    uint64x2_t x = vreinterpretq_u64_u8(vorrq_u8(x0, x1));
+    return (vgetq_lane_u64(x, 0) | vgetq_lane_u64(x, 1)) != 0;
+#else
+    const uint64_t *wa = (const uint64_t*)a;
+    const uint64_t *wb = (const uint64_t*)b;
+    return ((wa[0] ^ wb[0]) | (wa[1] ^ wb[1]) | (wa[2] ^ wb[2]) | (wa[3] ^ wb[3])) != 0;
+#endif
+}
+
+size_t image_diff(const uint8_t *current, const uint8_t *previous, size_t count,
+                  size_t elem_size, uint16_t *changed) {
+    size_t bytes = IMAGE_DIFF_BUFFER_SIZE(count, elem_size);
+    size_t per_block = IMAGE_DIFF_BLOCK / elem_size;
+    size_t changes = 0;
+
+    for (size_t offset = 0; offset < bytes; offset += IMAGE_DIFF_BLOCK) {
+        if (!BlockDiffers(current + offset, previous + offset)) {
+            continue;
+        }
+
+        /* Elements never straddle a block, so each one is reported once */
+        size_t first = offset / elem_size;
+        size_t last = first + per_block;
+        if (last > count) {
+            last = count;
+        }
+
+        for (size_t i = first; i < last; i++) {
+            if (memcmp(current + i * elem_size, previous + i * elem_size, elem_size) != 0) {
+                changed[changes++] = (uint16_t)i;
+            }
+        }
+    }
+
+    return changes;
+}
+
+const char *image_diff_kernel(void) {
+    return IMAGE_DIFF_KERNEL;
+}
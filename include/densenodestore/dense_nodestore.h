@@ -0,0 +1,70 @@
+#ifndef DENSE_NODESTORE_H
+#define DENSE_NODESTORE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <open62541/plugin/nodestore.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Хранилище узлов для пространства имён шлюза. Узлы-переменные тегов лежат
+ * в плотных таблицах, индекс берётся из контекста узла: старшие 16 бит -
+ * номер таблицы (меньше DENSE_NODESTORE_TABLES), младшие - индекс в ней.
+ * Строковый NodeId находится через компактный хэш-индекс на номер слота.
+ * Все остальные узлы (ns0, папки, массивы, структуры) хранит вложенное
+ * хранилище (UA_Nodestore_HashMap или UA_Nodestore_ZipTree).
+ *
+ * Сами узлы не сжимаются: в слоте лежит полный UA_VariableNode со списком
+ * ссылок, выделенный вложенным хранилищем, потому что getNode должен
+ * возвращать узел, который сервер читает напрямую. Экономия - только на
+ * индексе (слот 16 байт и 4 байта хэш-индекса вместо записи хэш-таблицы),
+ * поэтому байты на тег заметно уменьшаются лишь при малых узлах. Реальные
+ * цифры по хранилищам выводит режим -N.
+ */
+#define DENSE_NODESTORE_TABLES      256
+
+typedef struct {
+    uint32_t nodes;             /* узлов в плотных таблицах */
+    uint32_t slots;             /* выделено слотов во всех таблицах */
+    uint32_t index_size;        /* размер хэш-индекса */
+    size_t bytes;               /* память таблиц и индекса без самих узлов */
+} dense_nodestore_stats_t;
+
+/**
+ * @brief Создаёт хранилище поверх вложенного
+ *
+ * Вложенное хранилище переходит во владение нового и очищается вместе с ним.
+ *
+ * @param ns Заполняемое хранилище (UA_ServerConfig.nodestore до UA_Server_newWithConfig)
+ * @param inner Инициализированное вложенное хранилище
+ * @param namespaceIndex Пространство имён тегов шлюза
+ * @return UA_StatusCode
+ */
+UA_StatusCode dense_nodestore_init(UA_Nodestore *ns, const UA_Nodestore *inner, UA_UInt16 namespaceIndex);
+
+/**
+ * @brief Помечает следующий добавляемый узел-переменную с этим контекстом как тег
+ *
+ * Вызывается перед UA_Server_addVariableNode; остальные узлы, в том числе с
+ * тем же контекстом в другом индексном пространстве, уходят во вложенное
+ * хранилище. NULL снимает пометку.
+ *
+ * @param ns Хранилище, созданное dense_nodestore_init
+ * @param context Контекст узла, он же ключ плотной таблицы
+ */
+void dense_nodestore_claim(UA_Nodestore *ns, void *context);
+
+/**
+ * @brief Возвращает статистику плотных таблиц
+ */
+void dense_nodestore_stats(const UA_Nodestore *ns, dense_nodestore_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DENSE_NODESTORE_H */
@@ -0,0 +1,46 @@
+#ifndef IMAGE_DIFF_H
+#define IMAGE_DIFF_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Массивы сравниваются блоками по IMAGE_DIFF_BLOCK байт */
+#define IMAGE_DIFF_BLOCK        32
+
+/**
+ * @brief Размер буфера массива, кратный блоку сравнения
+ */
+#define IMAGE_DIFF_BUFFER_SIZE(count, elem_size) \
+    ((((size_t)(count) * (elem_size)) + IMAGE_DIFF_BLOCK - 1) & ~((size_t)IMAGE_DIFF_BLOCK - 1))
+
+/**
+ * @brief Находит изменившиеся элементы массива по сравнению с предыдущим снимком
+ *
+ * Буферы должны быть выровнены по IMAGE_DIFF_BLOCK, иметь размер
+ * IMAGE_DIFF_BUFFER_SIZE(count, elem_size) и совпадать в хвосте после
+ * последнего элемента. Размер элемента должен делить IMAGE_DIFF_BLOCK.
+ *
+ * @param current Текущий снимок
+ * @param previous Предыдущий снимок
+ * @param count Количество элементов
+ * @param elem_size Размер элемента в байтах
+ * @param changed Буфер индексов изменившихся элементов (не меньше count)
+ * @return size_t Количество изменившихся элементов
+ */
+size_t image_diff(const uint8_t *current, const uint8_t *previous, size_t count,
+                  size_t elem_size, uint16_t *changed);
+
+/**
+ * @brief Возвращает имя реализации сравнения (avx2, sse2, neon, scalar)
+ */
+const char *image_diff_kernel(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* IMAGE_DIFF_H */
@@ -0,0 +1,45 @@
+#ifndef PROCESS_IMAGE_H
+#define PROCESS_IMAGE_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROCESS_IMAGE_MAGIC         0x50494D47u /* "PIMG" */
+
+/*
+ * Образ процесса ПЛК в разделяемой памяти. Писатель (CODESYS или симулятор)
+ * переводит sequence в нечётное значение перед обновлением data и в чётное
+ * после него (sequence lock). Читатель копирует данные между двумя
+ * одинаковыми чётными значениями sequence.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t size;              /* байт в data[] */
+    volatile uint32_t sequence;
+    uint8_t pad[64 - 3 * sizeof(uint32_t)];
+    uint8_t data[];
+} process_image_t;
+
+/**
+ * @brief Начинает обновление образа (sequence становится нечётным)
+ */
+static inline void process_image_write_begin(process_image_t *image) {
+    __atomic_store_n(&image->sequence, image->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Завершает обновление образа (sequence снова чётный)
+ */
+static inline void process_image_write_end(process_image_t *image) {
+    __atomic_store_n(&image->sequence, image->sequence + 1, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PROCESS_IMAGE_H */
@@ -0,0 +1,117 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <semaphore.h>
+#include <time.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SHM_RING_MAGIC          0x53524E47u /* "SRNG" */
+#define SHM_RING_CACHE_LINE     64
+
+/*
+ * Кольцевой буфер с одним производителем и одним потребителем (SPSC),
+ * размещённый в разделяемой памяти. head пишет только производитель,
+ * tail - только потребитель. Семафор используется только когда
+ * потребитель простаивает (consumer_waiting == 1).
+ */
+typedef struct {
+    volatile uint32_t head;
+    uint8_t pad_head[SHM_RING_CACHE_LINE - sizeof(uint32_t)];
+
+    volatile uint32_t tail;
+    volatile uint32_t consumer_waiting;
+    uint8_t pad_tail[SHM_RING_CACHE_LINE - 2 * sizeof(uint32_t)];
+
+    sem_t data_ready;
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t slot_stride;
+    uint32_t data_offset;       /* смещение слотов относительно начала кольца */
+} shm_ring_t;
+
+typedef struct {
+    volatile uint32_t magic;
+    uint32_t size;
+    shm_ring_t codesys_to_opcua;
+    shm_ring_t opcua_to_codesys;
+} shm_segment_t;
+
+typedef struct {
+    int fd;
+    size_t size;
+    shm_segment_t *segment;
+} shm_transport_t;
+
+/**
+ * @brief Создаёт или открывает сегмент разделяемой памяти с двумя кольцами
+ *
+ * @param transport Дескриптор транспорта
+ * @param name Имя сегмента (должно начинаться с /)
+ * @param slots Количество слотов в каждом кольце
+ * @param slot_size Максимальный размер сообщения
+ * @param create 1 - создать и инициализировать сегмент, 0 - открыть существующий
+ * @return int 0 при успехе, -1 при ошибке
+ */
+int shm_transport_open(shm_transport_t *transport, const char *name, uint32_t slots,
+                       uint32_t slot_size, int create);
+
+/**
+ * @brief Отключает сегмент и при необходимости удаляет его из системы
+ *
+ * @param transport Дескриптор транспорта
+ * @param name Имя сегмента или NULL, если удалять не нужно
+ * @return int 0 при успехе, -1 при ошибке
+ */
+int shm_transport_close(shm_transport_t *transport, const char *name);
+
+/**
+ * @brief Помещает сообщение в кольцо (не блокируется)
+ *
+ * @param ring Кольцо
+ * @param msg Указатель на данные сообщения
+ * @param len Длина сообщения
+ * @return int 0 при успехе, -1 при ошибке (errno = EAGAIN если кольцо заполнено)
+ */
+int shm_ring_send(shm_ring_t *ring, const void *msg, size_t len);
+
+/**
+ * @brief Забирает сообщение из кольца (не блокируется)
+ *
+ * @param ring Кольцо
+ * @param msg Буфер для сообщения
+ * @param len Размер буфера
+ * @return ssize_t Длина сообщения или -1 при ошибке (errno = EAGAIN если кольцо пусто)
+ */
+ssize_t shm_ring_receive(shm_ring_t *ring, void *msg, size_t len);
+
+/**
+ * @brief Забирает сообщение из кольца, ожидая его не дольше таймаута
+ *
+ * @param ring Кольцо
+ * @param msg Буфер для сообщения
+ * @param len Размер буфера
+ * @param timeout Абсолютное время окончания ожидания (CLOCK_REALTIME)
+ * @return ssize_t Длина сообщения или -1 при ошибке (errno = ETIMEDOUT)
+ */
+ssize_t shm_ring_receive_timed(shm_ring_t *ring, void *msg, size_t len,
+                               const struct timespec *timeout);
+
+/**
+ * @brief Возвращает количество сообщений в кольце
+ *
+ * @param ring Кольцо
+ * @return uint32_t Количество сообщений
+ */
+uint32_t shm_ring_count(shm_ring_t *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* SHM_RING_H */
@@ -16,17 +16,3624 @@ static void ThreadUnLock(pthread_mutex_t *mutex, pthread_cond_t *cond, volatile
     pthread_mutex_unlock(mutex);
 }
 
-static UA_StatusCode WriteServerVariable(char *buffer) {
+static uint64_t MonotonicNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void LatencyStatsRecord(latency_stats_t *stats, uint64_t latency_ns) {
+    if (stats->count == 0 || latency_ns < stats->min_ns) {
+        stats->min_ns = latency_ns;
+    }
+    if (latency_ns > stats->max_ns) {
+        stats->max_ns = latency_ns;
+    }
+    stats->sum_ns += latency_ns;
+    stats->count++;
+}
+
+#ifdef DEBUG
+static void LatencyStatsPrint(const char *label, const latency_stats_t *stats) {
+    if (stats->count == 0) {
+        printf("[OPC_UA] %s: no samples\n", label);
+        return;
+    }
+    printf("[OPC_UA] %s: count %llu, min %llu ns, avg %llu ns, max %llu ns\n", label,
+           (unsigned long long)stats->count, (unsigned long long)stats->min_ns,
+           (unsigned long long)(stats->sum_ns / stats->count), (unsigned long long)stats->max_ns);
+}
+#endif
+
+static uint32_t HistogramBucket(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (uint32_t)value;
+    }
+    uint32_t msb = 63 - __builtin_clzll(value);
+    return (msb - 2) * HISTOGRAM_SUB_BUCKETS + (uint32_t)((value >> (msb - 3)) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static uint64_t HistogramBucketFloor(uint32_t bucket) {
+    if (bucket < HISTOGRAM_SUB_BUCKETS) {
+        return bucket;
+    }
+    uint32_t msb = bucket / HISTOGRAM_SUB_BUCKETS + 2;
+    return (uint64_t)(HISTOGRAM_SUB_BUCKETS + bucket % HISTOGRAM_SUB_BUCKETS) << (msb - 3);
+}
+
+/* Recorded from the receive and the server thread, counters are relaxed atomics */
+static void HistogramAdd(latency_histogram_t *histogram, uint64_t latency_ns) {
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&histogram->buckets[HistogramBucket(latency_ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    while (latency_ns > max &&
+           !__atomic_compare_exchange_n(&histogram->max_ns, &max, latency_ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static void HistogramRecord(latency_hop_t hop, uint64_t latency_ns) {
+    HistogramAdd(&LatencyHops[hop], latency_ns);
+}
+
+static uint64_t HistogramPercentile(const latency_histogram_t *histogram, double percentile) {
+    uint64_t target = (uint64_t)(histogram->count * percentile / 100.0);
+    uint64_t seen = 0;
+
+    for (uint32_t bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+        seen += histogram->buckets[bucket];
+        if (seen > target) {
+            uint64_t ceiling = HistogramBucketFloor(bucket + 1) - 1;
+            return ceiling < histogram->max_ns ? ceiling : histogram->max_ns;
+        }
+    }
+    return histogram->max_ns;
+}
+
+static void HistogramPrint(const char *label, const latency_histogram_t *histogram) {
+    if (histogram->count == 0) {
+        printf("[OPC_UA] %-26s no samples\n", label);
+        return;
+    }
+    printf("[OPC_UA] %-26s count %llu, p50 %llu ns, p90 %llu ns, p99 %llu ns, p99.9 %llu ns, max %llu ns\n",
+           label, (unsigned long long)histogram->count,
+           (unsigned long long)HistogramPercentile(histogram, 50.0), (unsigned long long)HistogramPercentile(histogram, 90.0),
+           (unsigned long long)HistogramPercentile(histogram, 99.0), (unsigned long long)HistogramPercentile(histogram, 99.9),
+           (unsigned long long)histogram->max_ns);
+}
+
+static uint64_t ThreadCpuNs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void HistogramDump(void) {
+    uint64_t elapsed = MonotonicNs() - ServerCpuStats.start_ns;
+
+    if (ServerCpuStats.iterations > 0 && elapsed > 0) {
+        printf("[OPC_UA] Server iterate CPU: %.1f ms in %.1f s (%.2f%%), %llu iterations\n",
+               ServerCpuStats.cpu_ns / 1e6, elapsed / 1e9, 100.0 * ServerCpuStats.cpu_ns / elapsed,
+               (unsigned long long)ServerCpuStats.iterations);
+    }
+    for (int hop = 0; hop < HOP_COUNT; hop++) {
+        HistogramPrint(LatencyHopNames[hop], &LatencyHops[hop]);
+    }
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        char label[32];
+        printf("[OPC_UA] Lane %s: %llu frames received\n", LaneNames[lane], (unsigned long long)IngressLaneFrames[lane]);
+        snprintf(label, sizeof(label), "%s ingress", LaneNames[lane]);
+        HistogramPrint(label, &LaneLatency[LANE_INGRESS][lane]);
+        snprintf(label, sizeof(label), "%s egress", LaneNames[lane]);
+        HistogramPrint(label, &LaneLatency[LANE_EGRESS][lane]);
+    }
+    fflush(stdout);
+}
+
+static void HistogramDumpSignal(int signo) {
+    histogram_dump_requested = 1;
+}
+
+/* PLC cycle time (CLOCK_REALTIME ns) -> sourceTimestamp, and the first hop */
+static UA_DateTime SourceTimeToDateTime(uint64_t source_time) {
+    struct timespec ts;
+
+    if (source_time == 0) {
+        return 0;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t now = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    if (now >= source_time) {
+        HistogramRecord(HOP_PLC_TO_DECODE, now - source_time);
+    }
+
+    return UA_DATETIME_UNIX_EPOCH + (UA_DateTime)(source_time / 100);
+}
+
+static void WireStatsRecord(wire_stats_t *stats, size_t bytes, uint32_t updates) {
+    uint64_t now = MonotonicNs();
+
+    if (stats->frames == 0) {
+        stats->first_ns = now;
+    }
+    stats->last_ns = now;
+    stats->frames++;
+    stats->bytes += bytes;
+    stats->updates += updates;
+}
+
+#ifdef DEBUG
+static void WireStatsPrint(const char *label, const wire_stats_t *stats) {
+    for (int version = PROTOCOL_VERSION_1; version <= PROTOCOL_VERSION_MAX; version++) {
+        const wire_stats_t *s = &stats[version];
+        if (s->updates == 0) {
+            continue;
+        }
+        double seconds = (s->last_ns - s->first_ns) / 1e9;
+        printf("[OPC_UA] %s v%d: %llu frames, %llu updates, %.1f bytes/update, %.0f msg/s\n", label, version,
+               (unsigned long long)s->frames, (unsigned long long)s->updates, (double)s->bytes / s->updates,
+               seconds > 0 ? s->frames / seconds : 0.0);
+    }
+}
+#endif
+
+/* Encoded size of a value in a v2 write record */
+static size_t ValueSizeV2(uint8_t typeKind, const uint8_t *value) {
+    if (typeKind == UA_DATATYPEKIND_STRING) {
+        return 1 + strnlen((const char*)value, MAX_DATA_SIZE - 1);
+    }
+    return UA_TYPES[typeKind].memSize;
+}
+
+static size_t EncodeValueV2(uint8_t *dst, uint8_t typeKind, const uint8_t *value) {
+    size_t size = ValueSizeV2(typeKind, value);
+
+    if (typeKind == UA_DATATYPEKIND_STRING) {
+        dst[0] = (uint8_t)(size - 1);
+        memcpy(dst + 1, value, size - 1);
+    } else {
+        memcpy(dst, value, size);
+    }
+    return size;
+}
+
+/* Decodes into a zeroed MAX_DATA_SIZE buffer, returns the consumed bytes or 0 on a malformed record */
+static size_t DecodeValueV2(const uint8_t *src, size_t available, uint8_t typeKind, uint8_t *value) {
+    if (typeKind == UA_DATATYPEKIND_STRING) {
+        if (available < 1 || src[0] >= MAX_DATA_SIZE || available < 1 + (size_t)src[0]) {
+            return 0;
+        }
+        memcpy(value, src + 1, src[0]);
+        return 1 + src[0];
+    }
+
+    size_t size = UA_TYPES[typeKind].memSize;
+    if (size > MAX_DATA_SIZE || available < size) {
+        return 0;
+    }
+    memcpy(value, src, size);
+    return size;
+}
+
+static value_store_page_t *ValueStorePage(uint8_t typeKind, uint16_t index) {
+    return OpcUaValueStore[typeKind].pages[index >> VALUE_STORE_PAGE_SHIFT];
+}
+
+static uint8_t *ValueStoreSlot(uint8_t typeKind, uint16_t index) {
+    return ValueStorePage(typeKind, index)->values + (size_t)(index & (VALUE_STORE_PAGE_TAGS - 1)) * UA_TYPES[typeKind].memSize;
+}
+
+static UA_DataValue *ValueStoreDataValue(uint8_t typeKind, uint16_t index) {
+    return &ValueStorePage(typeKind, index)->dataValues[index & (VALUE_STORE_PAGE_TAGS - 1)];
+}
+
+/* Copies a PLC or client value into the store; `length` bounds string values. Strings are
+ * only rewritten on the server thread (IngressWrite marshals them there), scalars are
+ * naturally aligned and stored in one access, so server reads never see a torn value. */
+static void StoreExternalValue(uint8_t typeKind, uint16_t index, const uint8_t *value, size_t length, UA_DateTime sourceTime) {
+    uint8_t *slot = ValueStoreSlot(typeKind, index);
+    UA_DataValue *dataValue = ValueStoreDataValue(typeKind, index);
+
+    if (typeKind == UA_DATATYPEKIND_STRING) {
+        UA_String *str = (UA_String*)slot;
+        char *chars = ValueStorePage(typeKind, index)->strings + (size_t)(index & (VALUE_STORE_PAGE_TAGS - 1)) * MAX_DATA_SIZE;
+        size_t copy_len = strnlen((const char*)value, length < MAX_DATA_SIZE ? length : MAX_DATA_SIZE - 1);
+
+        str->length = 0;
+        memcpy(chars, value, copy_len);
+        chars[copy_len] = '\0';
+        str->data = (UA_Byte*)chars;
+        str->length = copy_len;
+    } else {
+        switch (UA_TYPES[typeKind].memSize) {
+            case 1: {
+                uint8_t v;
+                memcpy(&v, value, sizeof(v));
+                __atomic_store_n((uint8_t*)slot, v, __ATOMIC_RELAXED);
+                break;
+            }
+            case 2: {
+                uint16_t v;
+                memcpy(&v, value, sizeof(v));
+                __atomic_store_n((uint16_t*)slot, v, __ATOMIC_RELAXED);
+                break;
+            }
+            case 4: {
+                uint32_t v;
+                memcpy(&v, value, sizeof(v));
+                __atomic_store_n((uint32_t*)slot, v, __ATOMIC_RELAXED);
+                break;
+            }
+            case 8: {
+                uint64_t v;
+                memcpy(&v, value, sizeof(v));
+                __atomic_store_n((uint64_t*)slot, v, __ATOMIC_RELAXED);
+                break;
+            }
+            default:
+                memcpy(slot, value, UA_TYPES[typeKind].memSize);
+                break;
+        }
+    }
+
+    dataValue->serverTimestamp = UA_DateTime_now();
+    dataValue->hasSourceTimestamp = (sourceTime != 0);
+    dataValue->sourceTimestamp = sourceTime;
+}
+
+static tag_entry_t *LookupTagEntry(uint8_t typeKind, uint16_t index) {
+    if (typeKind >= TAG_TYPE_KIND_COUNT) {
+        return NULL;
+    }
+
+    tag_table_t *table = &OpcUaTagTable[typeKind];
+    if (table->entries == NULL || index >= table->size) {
+        return NULL;
+    }
+
+    return &table->entries[index];
+}
+
+static UA_Boolean IsNumericTypeKind(uint8_t typeKind) {
+    return typeKind >= UA_DATATYPEKIND_SBYTE && typeKind <= UA_DATATYPEKIND_DOUBLE;
+}
+
+static double NumericValue(uint8_t typeKind, const uint8_t *value) {
+    union {
+        UA_SByte sbyte; UA_Byte byte; UA_Int16 int16; UA_UInt16 uint16; UA_Int32 int32; UA_UInt32 uint32;
+        UA_Int64 int64; UA_UInt64 uint64; UA_Float f; UA_Double d;
+    } v;
+
+    memcpy(&v, value, UA_TYPES[typeKind].memSize);
+    switch (typeKind) {
+        case UA_DATATYPEKIND_SBYTE:  return v.sbyte;
+        case UA_DATATYPEKIND_BYTE:   return v.byte;
+        case UA_DATATYPEKIND_INT16:  return v.int16;
+        case UA_DATATYPEKIND_UINT16: return v.uint16;
+        case UA_DATATYPEKIND_INT32:  return v.int32;
+        case UA_DATATYPEKIND_UINT32: return v.uint32;
+        case UA_DATATYPEKIND_INT64:  return (double)v.int64;
+        case UA_DATATYPEKIND_UINT64: return (double)v.uint64;
+        case UA_DATATYPEKIND_FLOAT:  return v.f;
+        default:                     return v.d;
+    }
+}
+
+/* Receive thread, before the write is queued: returns 1 if the value lies within the tag's
+ * deadband of the last value passed on, so it never reaches the server. The reference only
+ * moves in IngressDeadbandAccept, once the write has been taken. */
+static int IngressDeadbandFilter(uint8_t typeKind, uint16_t index, const uint8_t *value) {
+    tag_entry_t *entry = LookupTagEntry(typeKind, index);
+
+    if (entry == NULL || entry->ingress_deadband == UA_DEADBANDTYPE_NONE || !IsNumericTypeKind(typeKind)) {
+        return 0;
+    }
+
+    double current = NumericValue(typeKind, value);
+    double limit = entry->deadband_value;
+    if (entry->ingress_deadband == UA_DEADBANDTYPE_PERCENT) {
+        limit = entry->deadband_value / 100.0 * (entry->eu_range.high - entry->eu_range.low);
+    }
+
+    if (__atomic_load_n(&entry->deadband_valid, __ATOMIC_ACQUIRE)) {
+        double delta = current > entry->deadband_last ? current - entry->deadband_last : entry->deadband_last - current;
+        if (delta <= limit) {
+            __atomic_fetch_add(&DeadbandStats.filtered, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Receive thread: the write was staged, queued or applied, its value becomes the reference */
+static void IngressDeadbandAccept(uint8_t typeKind, uint16_t index, const uint8_t *value) {
+    tag_entry_t *entry = LookupTagEntry(typeKind, index);
+
+    if (entry == NULL || entry->ingress_deadband == UA_DEADBANDTYPE_NONE || !IsNumericTypeKind(typeKind)) {
+        return;
+    }
+
+    entry->deadband_last = NumericValue(typeKind, value);
+    __atomic_store_n(&entry->deadband_valid, 1, __ATOMIC_RELEASE);
+    __atomic_fetch_add(&DeadbandStats.passed, 1, __ATOMIC_RELAXED);
+}
+
+/* sourceTime 0: the server stamps the value itself */
+static UA_StatusCode WriteServerVariableValueAt(uint8_t typeKind, uint16_t index, uint8_t *newValue, UA_DateTime sourceTime) {
+    tag_entry_t *entry = LookupTagEntry(typeKind, index);
+
+    if (!entry || !newValue) {
+        return UA_STATUSCODE_BADINVALIDARGUMENT;
+    }
+
+    /* Tag is being re-registered: keep the newest value and replay it once the node is back */
+    if (entry->state == TAG_STATE_UPDATING) {
+        memcpy(entry->replay_value, newValue, MAX_DATA_SIZE);
+        entry->replay_pending = 1;
+        UpdateStats.buffered++;
+        return UA_STATUSCODE_GOOD;
+    }
+
+    if (entry->state != TAG_STATE_ACTIVE || !entry->type) {
+        return UA_STATUSCODE_BADNODEIDUNKNOWN;
+    }
+
+    UA_StatusCode retval = UA_STATUSCODE_GOOD;
+
+    if (entry->backend == VALUE_BACKEND_IMAGE) {
+        /* The process image is authoritative, pushed values would only shadow it */
+        return UA_STATUSCODE_BADNOTWRITABLE;
+    }
+
+    /* Stamped before the write: a sample right after it must find the stamp */
+    if (__atomic_load_n(&NotifyProbe.monitoredItemId, __ATOMIC_ACQUIRE) != 0 &&
+        typeKind == NotifyProbe.typeKind && index == NotifyProbe.index) {
+        __atomic_store_n(&NotifyProbe.written_ns, MonotonicNs(), __ATOMIC_RELEASE);
+    }
+
+    if (entry->backend == VALUE_BACKEND_EXTERNAL) {
+        /* External backend: the node reads straight from the value store */
+        StoreExternalValue(typeKind, index, newValue, MAX_DATA_SIZE, sourceTime);
+    } else {
+        /* The value is written straight from the message buffer, the server copies it into the node */
+        UA_Variant value;
+        UA_String stringValue;
+
+        if (typeKind == UA_DATATYPEKIND_STRING) {
+            stringValue.length = strnlen((char*)newValue, MAX_DATA_SIZE);
+            stringValue.data = newValue;
+            UA_Variant_setScalar(&value, &stringValue, entry->type);
+        } else {
+            UA_Variant_setScalar(&value, newValue, entry->type);
+        }
+
+        if (sourceTime != 0) {
+            UA_DataValue dataValue;
+            UA_DataValue_init(&dataValue);
+            dataValue.value = value;
+            dataValue.hasValue = true;
+            dataValue.sourceTimestamp = sourceTime;
+            dataValue.hasSourceTimestamp = true;
+            retval = UA_Server_writeDataValue(OpcUaServer, entry->nodeId, dataValue);
+        } else {
+            retval = UA_Server_writeValue(OpcUaServer, entry->nodeId, value);
+        }
+    }
+
+    return retval;
+}
+
+static UA_StatusCode WriteServerVariableValue(uint8_t typeKind, uint16_t index, uint8_t *newValue) {
+    return WriteServerVariableValueAt(typeKind, index, newValue, 0);
+}
+
+/* POSIX queues hand out the highest priority first, mq_receive already drains strictly by lane */
+static lane_t LaneFromPriority(unsigned prio) {
+    if (prio > LanePriority[LANE_NORMAL]) {
+        return LANE_CRITICAL;
+    }
+    return prio < LanePriority[LANE_NORMAL] ? LANE_BULK : LANE_NORMAL;
+}
+
+static void IngressQueueInit(void) {
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        ingress_queue_t *queue = &IngressQueue[lane];
+        for (uint32_t i = 0; i < INGRESS_QUEUE_SIZE; i++) {
+            queue->cells[i].sequence = i;
+        }
+        queue->enqueue_pos = 0;
+        queue->dequeue_pos = 0;
+    }
+}
+
+/* Lock-free, any number of receive threads; returns -1 when the queue is full */
+static int IngressQueuePush(ingress_queue_t *queue, uint8_t typeKind, uint16_t index, const uint8_t *value, UA_DateTime sourceTime,
+                            ingress_bulk_apply_t apply, uint8_t *bulk, uint32_t bulk_length) {
+    uint32_t pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+
+    for (;;) {
+        ingress_cell_t *cell = &queue->cells[pos & (INGRESS_QUEUE_SIZE - 1)];
+        uint32_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+        int32_t diff = (int32_t)(sequence - pos);
+
+        if (diff == 0) {
+            /* On failure `pos` is reloaded with the current enqueue position */
+            if (__atomic_compare_exchange_n(&queue->enqueue_pos, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                cell->typeKind = typeKind;
+                cell->index = index;
+                cell->enqueue_ns = MonotonicNs();
+                cell->sourceTime = sourceTime;
+                cell->apply = apply;
+                cell->bulk = bulk;
+                cell->bulk_length = bulk_length;
+                if (value != NULL) {
+                    memcpy(cell->value, value, MAX_DATA_SIZE);
+                }
+                __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+                return 0;
+            }
+        } else if (diff < 0) {
+            return -1;
+        } else {
+            pos = __atomic_load_n(&queue->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* Server thread: the oldest published cell of a lane, NULL if it has none */
+static ingress_cell_t *IngressQueueHead(ingress_queue_t *queue) {
+    uint32_t pos = queue->dequeue_pos;
+    ingress_cell_t *cell = &queue->cells[pos & (INGRESS_QUEUE_SIZE - 1)];
+
+    return __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) == pos + 1 ? cell : NULL;
+}
+
+static uint32_t IngressQueueDepth(void) {
+    uint32_t depth = 0;
+
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        depth += __atomic_load_n(&IngressQueue[lane].enqueue_pos, __ATOMIC_RELAXED) -
+                 __atomic_load_n(&IngressQueue[lane].dequeue_pos, __ATOMIC_RELAXED);
+    }
+    return depth;
+}
+
+/* Server thread: applies up to INGRESS_DRAIN_BATCH queued writes, always from the most
+ * critical lane that has one, so a bulk backlog never delays a critical write by more
+ * than the write in progress */
+static void IngressDrain(void) {
+    uint64_t start = MonotonicNs();
+    uint16_t drained = 0;
+
+    pthread_mutex_lock(&tag_table_mutex);
+
+    while (drained < INGRESS_DRAIN_BATCH) {
+        ingress_queue_t *queue = NULL;
+        ingress_cell_t *cell = NULL;
+        lane_t lane = LANE_NORMAL;
+
+        for (int i = 0; i < LANE_COUNT && cell == NULL; i++) {
+            lane = LaneDrainOrder[i];
+            queue = &IngressQueue[lane];
+            cell = IngressQueueHead(queue);
+        }
+        if (cell == NULL) {
+            break;
+        }
+
+        uint32_t pos = queue->dequeue_pos;
+        uint64_t now = MonotonicNs();
+        LatencyStatsRecord(&IngressQueueWaitLatency, now - cell->enqueue_ns);
+        if (cell->apply != NULL) {
+            cell->apply(cell->index, cell->bulk, cell->bulk_length);
+            free(cell->bulk);
+        } else {
+            WriteServerVariableValueAt(cell->typeKind, cell->index, cell->value, cell->sourceTime);
+        }
+        uint64_t written = MonotonicNs();
+        LatencyStatsRecord(&IngressWriteLatency, written - now);
+        HistogramRecord(HOP_RECEIVE_TO_WRITE, written - cell->enqueue_ns);
+        HistogramAdd(&LaneLatency[LANE_INGRESS][lane], written - cell->enqueue_ns);
+
+        __atomic_store_n(&cell->sequence, pos + INGRESS_QUEUE_SIZE, __ATOMIC_RELEASE);
+        __atomic_store_n(&queue->dequeue_pos, pos + 1, __ATOMIC_RELEASE);
+        drained++;
+    }
+
+    pthread_mutex_unlock(&tag_table_mutex);
+
+    if (drained > 0) {
+        LatencyStatsRecord(&IngressDrainLatency, MonotonicNs() - start);
+    }
+}
+
+/* Server thread, outside of any service: the config is only read while serving requests */
+static void ApplyProfileQueueLimit(UA_ServerConfig *config) {
+    uint16_t limit = __atomic_load_n(&profile_queue_size_max, __ATOMIC_RELAXED);
+
+    if (limit > config->queueSizeLimits.max) {
+        config->queueSizeLimits.max = limit;
+    }
+}
+
+static void IngressDrainCallback(UA_Server *server, void *data) {
+    IngressDrain();
+}
+
+/* Applies a whole cycle with one tag table lock, on the server thread between iterations */
+static void CycleApply(cycle_buffer_t *buffer) {
+    uint64_t start = MonotonicNs();
+
+    pthread_mutex_lock(&tag_table_mutex);
+    for (uint32_t i = 0; i < buffer->count; i++) {
+        cycle_write_t *write = &buffer->writes[i];
+        if (write->apply != NULL) {
+            write->apply(write->index, write->bulk, write->bulk_length);
+            free(write->bulk);
+        } else {
+            WriteServerVariableValueAt(write->typeKind, write->index, write->value, write->sourceTime);
+        }
+    }
+    pthread_mutex_unlock(&tag_table_mutex);
+
+    uint64_t end = MonotonicNs();
+    for (uint32_t i = 0; i < buffer->count; i++) {
+        HistogramRecord(HOP_RECEIVE_TO_WRITE, end - buffer->writes[i].staged_ns);
+    }
+    LatencyStatsRecord(&CycleStats.apply, end - start);
+    LatencyStatsRecord(&CycleStats.publish, end - buffer->end_ns);
+
+    CycleStats.cycles++;
+    CycleStats.writes += buffer->count;
+    if (buffer->count > CycleStats.max_writes) {
+        CycleStats.max_writes = buffer->count;
+    }
+}
+
+/* Server thread: publishes the cycle handed over by the receive thread, if any */
+static void CyclePublish(void) {
+    cycle_buffer_t *buffer = __atomic_load_n(&cycle_front, __ATOMIC_ACQUIRE);
+
+    if (buffer == NULL) {
+        return;
+    }
+    CycleApply(buffer);
+    __atomic_store_n(&cycle_front, NULL, __ATOMIC_RELEASE);
+}
+
+static void CyclePublishCallback(UA_Server *server, void *data) {
+    CyclePublish();
+}
+
+/* EventLoop ingress decodes frames inside UA_Server_run_iterate, on the server thread */
+static bool OnServerThread(void) {
+    return opcua_server_thread_known && pthread_equal(pthread_self(), opcua_server_thread);
+}
+
+/* The caller may apply server-thread work in place: it is the server thread, or the server
+ * loop has not been released yet and nobody else would ever do it */
+static bool DrivesServer(void) {
+    return OnServerThread() || !__atomic_load_n(&opcua_server_released, __ATOMIC_ACQUIRE);
+}
+
+/* Writes outside a cycle and control frames must not overtake a cycle still being published.
+ * The server thread is the consumer itself, it publishes instead of waiting for itself. */
+static void CycleWaitPublished(void) {
+    struct timespec poll = {0, INGRESS_QUEUE_POLL_NS};
+
+    if (DrivesServer()) {
+        CyclePublish();
+        return;
+    }
+    while (opcua_server_pthread_running && __atomic_load_n(&cycle_front, __ATOMIC_ACQUIRE) != NULL) {
+        nanosleep(&poll, NULL);
+    }
+}
+
+/* Decoding thread: publishes the back buffer and starts staging into the other one */
+static void CycleHandOver(void) {
+    cycle_buffer_t *buffer = cycle_back;
+
+    buffer->end_ns = MonotonicNs();
+
+    if (DrivesServer()) {
+        /* Frames are decoded inside the server's EventLoop, or before the loop runs at all:
+         * publish in place and in order */
+        CyclePublish();
+        CycleApply(buffer);
+    } else {
+        if (__atomic_load_n(&cycle_front, __ATOMIC_ACQUIRE) != NULL) {
+            CycleStats.waits++;
+            CycleWaitPublished();
+        }
+        __atomic_store_n(&cycle_front, buffer, __ATOMIC_RELEASE);
+        cycle_back = buffer == &CycleBuffers[0] ? &CycleBuffers[1] : &CycleBuffers[0];
+    }
+
+    cycle_back->cycle = buffer->cycle;
+    cycle_back->sourceTime = buffer->sourceTime;
+    cycle_back->count = 0;
+}
+
+static UA_StatusCode CycleStage(uint8_t typeKind, uint16_t index, const uint8_t *value, UA_DateTime sourceTime,
+                                ingress_bulk_apply_t apply, uint8_t *bulk, uint32_t bulk_length) {
+    if (cycle_back->count == CYCLE_MAX_WRITES) {
+        CycleStats.split++;
+        CycleHandOver();
+    }
+
+    cycle_write_t *write = &cycle_back->writes[cycle_back->count++];
+    write->typeKind = typeKind;
+    write->index = index;
+    write->staged_ns = MonotonicNs();
+    write->sourceTime = sourceTime != 0 ? sourceTime : cycle_back->sourceTime;
+    write->apply = apply;
+    write->bulk = bulk;
+    write->bulk_length = bulk_length;
+    if (value != NULL) {
+        memcpy(write->value, value, MAX_DATA_SIZE);
+    }
+
+    return UA_STATUSCODE_GOOD;
+}
+
+static void CycleBegin(uint8_t *buffer, ssize_t length) {
+    cycle_marker_t *message = (cycle_marker_t*)buffer;
+
+    if (length != sizeof(message_type_t) && length != sizeof(cycle_marker_t)) {
+        return;
+    }
+
+    /* A missing end marker closes the previous cycle */
+    if (cycle_open) {
+        CycleHandOver();
+    }
+
+    cycle_back->count = 0;
+    cycle_back->cycle = length == sizeof(cycle_marker_t) ? message->cycle : cycle_back->cycle + 1;
+    cycle_back->sourceTime = length == sizeof(cycle_marker_t) ? SourceTimeToDateTime(message->source_time) : 0;
+    cycle_open = true;
+}
+
+static void CycleEnd(uint8_t *buffer, ssize_t length) {
+    cycle_marker_t *message = (cycle_marker_t*)buffer;
+
+    if (!cycle_open || (length != sizeof(message_type_t) && length != sizeof(cycle_marker_t))) {
+        return;
+    }
+
+#ifdef DEBUG
+    if (length == sizeof(cycle_marker_t) && message->cycle != cycle_back->cycle) {
+        printf("[OPC_UA] Cycle end %u does not match cycle begin %u\n", message->cycle, cycle_back->cycle);
+        fflush(stdout);
+    }
+#else
+    (void)message;
+#endif
+
+    cycle_open = false;
+    CycleHandOver();
+}
+
+/* Control frames act on the tag tables directly, earlier writes must be applied first.
+ * Direct mode queues external string writes too, so the queue is checked in both modes. */
+static void IngressQueueWaitDrained(void) {
+    struct timespec poll = {0, INGRESS_QUEUE_POLL_NS};
+
+    CycleWaitPublished();
+
+    if (DrivesServer()) {
+        while (IngressQueueDepth() != 0) {
+            IngressDrain();
+        }
+        return;
+    }
+    while (opcua_server_pthread_running && IngressQueueDepth() != 0) {
+        nanosleep(&poll, NULL);
+    }
+}
+
+/* Entry point of every decoded PLC write, source_time is the PLC cycle time or 0 */
+static UA_StatusCode IngressWrite(uint8_t typeKind, uint16_t index, uint8_t *value, uint64_t source_time) {
+    struct timespec poll = {0, INGRESS_QUEUE_POLL_NS};
+
+    if (typeKind >= TAG_TYPE_KIND_COUNT) {
+        return UA_STATUSCODE_BADINVALIDARGUMENT;
+    }
+
+    tag_entry_t *entry = LookupTagEntry(typeKind, index);
+
+    /* The image is authoritative for tags under change detection, a push would only be
+     * overwritten by the next diff or overwrite a newer image value */
+    if (entry != NULL && entry->image_diff) {
+        return UA_STATUSCODE_BADNOTWRITABLE;
+    }
+
+    UA_DateTime sourceTime = SourceTimeToDateTime(source_time);
+
+    if (IngressDeadbandFilter(typeKind, index, value)) {
+        return UA_STATUSCODE_GOOD;
+    }
+
+    if (cycle_open) {
+        UA_StatusCode retval = CycleStage(typeKind, index, value, sourceTime, NULL, NULL, 0);
+        if (retval == UA_STATUSCODE_GOOD) {
+            IngressDeadbandAccept(typeKind, index, value);
+        }
+        return retval;
+    }
+    CycleWaitPublished();
+
+    /* A string in the value store is rewritten in place while the server may be encoding it,
+     * so in direct mode those writes still go through the queue to the server thread */
+    if (ingress_apply == INGRESS_APPLY_DIRECT &&
+        (DrivesServer() || typeKind != UA_DATATYPEKIND_STRING || entry == NULL || entry->backend != VALUE_BACKEND_EXTERNAL)) {
+        uint64_t start = MonotonicNs();
+        UA_StatusCode retval = WriteServerVariableValueAt(typeKind, index, value, sourceTime);
+        LatencyStatsRecord(&IngressWriteLatency, MonotonicNs() - start);
+        if (retval == UA_STATUSCODE_GOOD) {
+            IngressDeadbandAccept(typeKind, index, value);
+        }
+        return retval;
+    }
+
+    ingress_queue_t *queue = &IngressQueue[entry != NULL ? entry->lane : LANE_NORMAL];
+
+    /* Back-pressure instead of dropping: the server thread drains every iteration */
+    while (IngressQueuePush(queue, typeKind, index, value, sourceTime, NULL, NULL, 0) != 0) {
+        __atomic_fetch_add(&IngressQueueFull, 1, __ATOMIC_RELAXED);
+        if (DrivesServer()) {
+            IngressDrain();
+            continue;
+        }
+        if (!opcua_server_pthread_running) {
+            return UA_STATUSCODE_BADRESOURCEUNAVAILABLE;
+        }
+        nanosleep(&poll, NULL);
+    }
+    IngressDeadbandAccept(typeKind, index, value);
+
+    uint32_t depth = IngressQueueDepth();
+    if (depth > IngressQueueHighWater) {
+        IngressQueueHighWater = depth;
+    }
+
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Entry point of reassembled arrays and structure images, ordered with the scalar writes
+ * like IngressWrite. `bulk` is a heap copy, whoever applies or drops it frees it. */
+static void IngressWriteBulk(ingress_bulk_apply_t apply, uint16_t index, uint8_t *bulk, uint32_t length, uint8_t lane) {
+    struct timespec poll = {0, INGRESS_QUEUE_POLL_NS};
+
+    if (cycle_open) {
+        CycleStage(0, index, NULL, 0, apply, bulk, length);
+        return;
+    }
+    CycleWaitPublished();
+
+    /* Not in the value store, direct mode may write it from here */
+    if (ingress_apply == INGRESS_APPLY_DIRECT) {
+        apply(index, bulk, length);
+        free(bulk);
+        return;
+    }
+
+    ingress_queue_t *queue = &IngressQueue[lane < LANE_COUNT ? lane : LANE_NORMAL];
+
+    while (IngressQueuePush(queue, 0, index, NULL, 0, apply, bulk, length) != 0) {
+        __atomic_fetch_add(&IngressQueueFull, 1, __ATOMIC_RELAXED);
+        if (DrivesServer()) {
+            IngressDrain();
+            continue;
+        }
+        if (!opcua_server_pthread_running) {
+            free(bulk);
+            return;
+        }
+        nanosleep(&poll, NULL);
+    }
+
+    uint32_t depth = IngressQueueDepth();
+    if (depth > IngressQueueHighWater) {
+        IngressQueueHighWater = depth;
+    }
+}
+
+static UA_StatusCode WriteServerVariable(char *buffer, ssize_t length) {
     variable_write_t *message = (variable_write_t*)buffer;
+    uint64_t source_time = 0;
+
+    if (length == sizeof(variable_write_source_t)) {
+        source_time = ((variable_write_source_t*)buffer)->source_time;
+    }
+
+    return IngressWrite(message->typeKind, message->index, message->value, source_time);
+}
+
+static uint16_t WriteServerVariableBatch(uint8_t *buffer, ssize_t length) {
+    variable_batch_header_t *header = (variable_batch_header_t*)buffer;
+
+    if (length < (ssize_t)sizeof(variable_batch_header_t) || header->count > MAX_BATCH_RECORDS ||
+        length != (ssize_t)(sizeof(variable_batch_header_t) + header->count * sizeof(variable_batch_record_t))) {
+        return 0;
+    }
+
+    variable_batch_record_t *records = (variable_batch_record_t*)(buffer + sizeof(variable_batch_header_t));
+    uint16_t applied = 0;
+
+    for (uint16_t i = 0; i < header->count; i++) {
+        if (IngressWrite(records[i].typeKind, records[i].index, records[i].value, 0) == UA_STATUSCODE_GOOD) {
+            applied++;
+        }
+    }
+
+    IngressBatchStats.frames++;
+    IngressBatchStats.records += header->count;
+    IngressBatchStats.last_records = header->count;
+    if (header->count > IngressBatchStats.max_records) {
+        IngressBatchStats.max_records = header->count;
+    }
+
+#ifdef DEBUG
+    printf("[OPC_UA] Write batch: %u records, %u applied (frames: %llu, records: %llu)\n",
+           header->count, applied, (unsigned long long)IngressBatchStats.frames, (unsigned long long)IngressBatchStats.records);
+    fflush(stdout);
+#endif
+
+    return applied;
+}
+
+static uint8_t CheckUaStringLength(UA_String *str) {
+    if (!str || !str->data || str->length == 0) {
+        return UA_STRING_ERROR;
+    }
+
+    size_t length = strnlen((char*)str->data, str->length);
+
+    if (length >= MAX_STRING_VALUE) {
+        str->data[MAX_STRING_VALUE - 1] = '\0';
+        str->length = MAX_STRING_VALUE - 1;
+        return UA_STRING_OVERFLOW;
+    }
+
+    if (length < str->length && str->data[length] != '\0') {
+        str->data[length] = '\0';
+        str->length = length;
+    }
+
+    return UA_STRING_OK;
+}
+
+static uint16_t WriteServerVariableBatchV2(uint8_t *buffer, ssize_t length, uint64_t *enqueue_time) {
+    write_frame_v2_header_t *header = (write_frame_v2_header_t*)buffer;
+    uint8_t *cursor = buffer + sizeof(write_frame_v2_header_t);
+    uint8_t *end = buffer + length;
+    uint16_t applied = 0;
+    uint16_t decoded = 0;
+    uint64_t source_time = 0;
+
+    *enqueue_time = 0;
+
+    if (length < (ssize_t)sizeof(write_frame_v2_header_t)) {
+        return 0;
+    }
+
+    if (header->flags & WRITE_FRAME_V2_TIMESTAMP) {
+        if (end - cursor < (ssize_t)sizeof(uint64_t)) {
+            return 0;
+        }
+        memcpy(enqueue_time, cursor, sizeof(uint64_t));
+        cursor += sizeof(uint64_t);
+    }
+    if (header->flags & WRITE_FRAME_V2_SOURCE_TIME) {
+        if (end - cursor < (ssize_t)sizeof(uint64_t)) {
+            return 0;
+        }
+        memcpy(&source_time, cursor, sizeof(uint64_t));
+        cursor += sizeof(uint64_t);
+    }
+
+    for (uint16_t i = 0; i < header->count; i++) {
+        if (end - cursor < (ssize_t)sizeof(write_record_v2_t)) {
+            break;
+        }
+
+        write_record_v2_t *record = (write_record_v2_t*)cursor;
+        uint8_t typeKind = record->typeKind;
+        uint16_t index = record->index;
+        cursor += sizeof(write_record_v2_t);
+
+        if (typeKind >= TAG_TYPE_KIND_COUNT) {
+            break;
+        }
+
+        /* Aligned, zero-padded copy so the write path sees the same buffer as with v1 */
+        uint8_t value[MAX_DATA_SIZE] = {0};
+        size_t consumed = DecodeValueV2(cursor, end - cursor, typeKind, value);
+        if (consumed == 0) {
+            break;
+        }
+        cursor += consumed;
+        decoded++;
+
+        if (IngressWrite(typeKind, index, value, source_time) == UA_STATUSCODE_GOOD) {
+            applied++;
+        }
+    }
+
+    IngressBatchStats.frames++;
+    IngressBatchStats.records += decoded;
+    IngressBatchStats.last_records = decoded;
+    if (decoded > IngressBatchStats.max_records) {
+        IngressBatchStats.max_records = decoded;
+    }
+    WireStatsRecord(&IngressWireStats[PROTOCOL_VERSION_2], length, decoded);
+
+    return applied;
+}
+
+static uint32_t EgressQueueDepth(void) {
+    if (transport == TRANSPORT_SHM) {
+        return ShmTransport.segment ? shm_ring_count(&ShmTransport.segment->opcua_to_codesys) : 0;
+    }
+
+    long curmsgs = 0;
+    if (mqueue_opcua_to_codesys == -1 || mq_get_attributes(mqueue_opcua_to_codesys, NULL, NULL, NULL, &curmsgs) != 0) {
+        return 0;
+    }
+    return (uint32_t)curmsgs;
+}
+
+/* Sends one frame. With EGRESS_POLICY_BLOCK waits up to egress_block_timeout_ms for room
+ * in the queue, otherwise fails immediately with EAGAIN when the queue is full. */
+static int SendToCodesys(const void *msg, size_t len, unsigned prio) {
+    struct timespec deadline;
+
+    if (egress_policy == EGRESS_POLICY_BLOCK) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (long)egress_block_timeout_ms * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+            deadline.tv_nsec %= 1000000000L;
+        }
+    }
+
+    if (transport == TRANSPORT_SHM) {
+        if (ShmTransport.segment == NULL) {
+            errno = EBADF;
+            return -1;
+        }
+
+        int result = shm_ring_send(&ShmTransport.segment->opcua_to_codesys, msg, len);
+        if (egress_policy == EGRESS_POLICY_BLOCK) {
+            uint64_t limit = MonotonicNs() + (uint64_t)egress_block_timeout_ms * 1000000ULL;
+            while (result == -1 && errno == EAGAIN && MonotonicNs() < limit) {
+                struct timespec pause = { 0, EGRESS_BLOCK_POLL_NS };
+                nanosleep(&pause, NULL);
+                result = shm_ring_send(&ShmTransport.segment->opcua_to_codesys, msg, len);
+            }
+        }
+        return result;
+    }
+
+    if (mqueue_opcua_to_codesys == -1) {
+        errno = EBADF;
+        return -1;
+    }
+
+    if (egress_policy == EGRESS_POLICY_BLOCK) {
+        int result = mq_send_timed(mqueue_opcua_to_codesys, msg, len, prio, &deadline);
+        if (result == -1 && errno == ETIMEDOUT) {
+            errno = EAGAIN;
+        }
+        return result;
+    }
+    return mq_send_msg(mqueue_opcua_to_codesys, msg, len, prio);
+}
+
+static void EgressPendingPop(egress_lane_t *lane, uint16_t count) {
+    for (uint16_t i = 0; i < count; i++) {
+        tag_ref_t *ref = &lane->pending[lane->head];
+        OpcUaTagTable[ref->typeKind].egress[ref->index].pending = 0;
+        lane->head = (lane->head + 1) % EGRESS_PENDING_LIMIT;
+    }
+    lane->count -= count;
+}
+
+#ifdef DEBUG
+static uint32_t EgressPendingTotal(void) {
+    uint32_t total = 0;
+
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        total += EgressLanes[lane].count + EgressLanes[lane].bulk_count;
+    }
+    return total;
+}
+#endif
+
+/* Packs pending values from the head of a lane into one frame of the negotiated
+ * version. Returns the frame length, the number of packed tags goes to *pcount. */
+static size_t EgressBuildFrame(egress_lane_t *lane, uint8_t *buffer, uint16_t *pcount, uint64_t now, uint64_t *oldest) {
+    uint16_t count = 0;
+    size_t length;
+
+    if (egress_protocol_version == PROTOCOL_VERSION_2) {
+        write_frame_v2_header_t *header = (write_frame_v2_header_t*)buffer;
+        header->message_type = MSG_TYPE_WRITE_BATCH;
+        header->flags = WRITE_FRAME_V2_TIMESTAMP;
+        memcpy(buffer + sizeof(write_frame_v2_header_t), &now, sizeof(uint64_t));
+        length = sizeof(write_frame_v2_header_t) + sizeof(uint64_t);
+
+        while (count < lane->count) {
+            tag_ref_t *ref = &lane->pending[(lane->head + count) % EGRESS_PENDING_LIMIT];
+            egress_entry_t *entry = &OpcUaTagTable[ref->typeKind].egress[ref->index];
+
+            if (length + sizeof(write_record_v2_t) + ValueSizeV2(ref->typeKind, entry->value) > MAX_MSG_SIZE) {
+                break;
+            }
+
+            write_record_v2_t *record = (write_record_v2_t*)(buffer + length);
+            record->typeKind = ref->typeKind;
+            record->index = ref->index;
+            length += sizeof(write_record_v2_t);
+            length += EncodeValueV2(buffer + length, ref->typeKind, entry->value);
+
+            if (entry->since < *oldest) {
+                *oldest = entry->since;
+            }
+            count++;
+        }
+
+        header->count = count;
+    } else {
+        variable_batch_header_t *header = (variable_batch_header_t*)buffer;
+        variable_batch_record_t *records = (variable_batch_record_t*)(buffer + sizeof(variable_batch_header_t));
+
+        count = lane->count < MAX_BATCH_RECORDS ? lane->count : MAX_BATCH_RECORDS;
+
+        memset(header, 0, sizeof(variable_batch_header_t));
+        header->message_type = MSG_TYPE_WRITE_BATCH;
+        header->count = count;
+        header->enqueue_time = now;
+
+        for (uint16_t i = 0; i < count; i++) {
+            tag_ref_t *ref = &lane->pending[(lane->head + i) % EGRESS_PENDING_LIMIT];
+            egress_entry_t *entry = &OpcUaTagTable[ref->typeKind].egress[ref->index];
+
+            memcpy(records[i].value, entry->value, MAX_DATA_SIZE);
+            records[i].index = ref->index;
+            records[i].typeKind = ref->typeKind;
+
+            if (entry->since < *oldest) {
+                *oldest = entry->since;
+            }
+        }
+
+        length = sizeof(variable_batch_header_t) + count * sizeof(variable_batch_record_t);
+    }
+
+    *pcount = count;
+    return length;
+}
+
+/* Sends what is left of the value at the head of a bulk FIFO: the remaining chunks of an
+ * array or the image of a structure. A value removed or already sent since it was queued
+ * counts as through. On EAGAIN the value stays pending, any other error drops it. */
+static int EgressBulkSend(const egress_bulk_ref_t *ref, lane_t id) {
+    uint8_t frame[MAX_MSG_SIZE];
+    uint64_t since;
+
+    if (ref->kind == EGRESS_BULK_ARRAY) {
+        if (ref->index >= OpcUaArrayTable.size || !OpcUaArrayTable.entries[ref->index].egress_pending) {
+            return 0;
+        }
+
+        array_entry_t *entry = &OpcUaArrayTable.entries[ref->index];
+        array_chunk_header_t *header = (array_chunk_header_t*)frame;
+        size_t total = (size_t)entry->elements * entry->elem_size;
+
+        while (entry->egress_sent < total) {
+            size_t offset = entry->egress_sent;
+            size_t chunk = total - offset < ARRAY_CHUNK_PAYLOAD ? total - offset : ARRAY_CHUNK_PAYLOAD;
+
+            memset(header, 0, sizeof(array_chunk_header_t));
+            header->message_type = MSG_TYPE_ARRAY_CHUNK;
+            header->index = ref->index;
+            header->update = entry->egress_update;
+            header->offset = offset;
+            header->total = total;
+            header->length = chunk;
+            memcpy(frame + sizeof(array_chunk_header_t), entry->egress + offset, chunk);
+
+            if (SendToCodesys(frame, sizeof(array_chunk_header_t) + chunk, LanePriority[id]) != 0) {
+                if (errno != EAGAIN) {
+                    /* CODESYS discards the partial value, the next change resends it whole */
+                    entry->egress_pending = 0;
+                    ArrayStats.egress_dropped++;
+                }
+                return -1;
+            }
+            entry->egress_sent += chunk;
+        }
+
+        entry->egress_pending = 0;
+        since = entry->egress_since;
+        ArrayStats.egress_updates++;
+    } else {
+        if (ref->index >= OpcUaStructTable.size || !OpcUaStructTable.entries[ref->index].egress_pending) {
+            return 0;
+        }
+
+        struct_entry_t *entry = &OpcUaStructTable.entries[ref->index];
+        struct_write_header_t *header = (struct_write_header_t*)frame;
+
+        memset(header, 0, sizeof(struct_write_header_t));
+        header->message_type = MSG_TYPE_WRITE_STRUCT;
+        header->index = ref->index;
+        header->length = entry->type->image_size;
+        memcpy(frame + sizeof(struct_write_header_t), entry->egress, header->length);
+
+        if (SendToCodesys(frame, sizeof(struct_write_header_t) + header->length, LanePriority[id]) != 0) {
+            if (errno != EAGAIN) {
+                entry->egress_pending = 0;
+                StructStats.egress_dropped++;
+            }
+            return -1;
+        }
+
+        entry->egress_pending = 0;
+        since = entry->egress_since;
+        StructStats.egress_updates++;
+    }
+
+    HistogramAdd(&LaneLatency[LANE_EGRESS][id], MonotonicNs() - since);
+    return 0;
+}
+
+static void EgressBulkPop(egress_lane_t *lane) {
+    lane->bulk_head = (lane->bulk_head + 1) % EGRESS_BULK_LIMIT;
+    lane->bulk_count--;
+}
+
+/* Server thread: applies a version agreed by the decoding thread. The reply goes out
+ * before any frame of the new version; if the queue is full nothing is sent this time. */
+static int EgressNegotiate(void) {
+    uint8_t negotiation = __atomic_exchange_n(&protocol_negotiation, 0, __ATOMIC_ACQUIRE);
+
+    if (negotiation == 0) {
+        return 0;
+    }
+
+    egress_protocol_version = negotiation & ~PROTOCOL_NEGOTIATION_REPLY;
+
+    if (negotiation & PROTOCOL_NEGOTIATION_REPLY) {
+        registration_start_t reply;
+        reply.message_type = MSG_TYPE_START_REGISTRATION;
+        reply.version = egress_protocol_version;
+
+        if (SendToCodesys(&reply, sizeof(reply), 1) != 0 && errno == EAGAIN) {
+            /* A newer negotiation supersedes this one */
+            uint8_t expected = 0;
+            __atomic_compare_exchange_n(&protocol_negotiation, &expected, negotiation, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+            EgressQueueFull++;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Sends the pending values in order of their first change, one full frame at a time.
+ * Values that do not fit into the queue stay pending and are retried on the next flush. */
+static int EgressFlush(void) {
+    uint8_t buffer[MAX_MSG_SIZE];
+
+    if (EgressNegotiate() != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < LANE_COUNT; i++) {
+        lane_t id = LaneDrainOrder[i];
+        egress_lane_t *lane = &EgressLanes[id];
+
+        while (lane->count > 0) {
+            uint16_t count;
+            uint64_t now = MonotonicNs();
+            uint64_t oldest = now;
+            size_t length = EgressBuildFrame(lane, buffer, &count, now, &oldest);
+
+            if (SendToCodesys(buffer, length, LanePriority[id]) != 0) {
+                if (errno == EAGAIN) {
+                    EgressQueueFull++;
+                    return -1;
+                }
+                /* The queue is gone, nothing will ever drain it */
+                EgressDropped += count;
+                EgressPendingPop(lane, count);
+                return -1;
+            }
+
+            uint64_t sent = MonotonicNs();
+            for (uint16_t r = 0; r < count; r++) {
+                tag_ref_t *ref = &lane->pending[(lane->head + r) % EGRESS_PENDING_LIMIT];
+                uint64_t latency = sent - OpcUaTagTable[ref->typeKind].egress[ref->index].since;
+                HistogramRecord(HOP_CALLBACK_TO_SEND, latency);
+                HistogramAdd(&LaneLatency[LANE_EGRESS][id], latency);
+            }
+            EgressPendingPop(lane, count);
+
+            EgressBatchStats.frames++;
+            EgressBatchStats.records += count;
+            EgressBatchStats.last_records = count;
+            if (count > EgressBatchStats.max_records) {
+                EgressBatchStats.max_records = count;
+            }
+            LatencyStatsRecord(&EgressFlushLatency, now - oldest);
+            WireStatsRecord(&EgressWireStats[egress_protocol_version], length, count);
+
+            uint32_t depth = EgressQueueDepth();
+            if (depth > EgressQueueHighWater) {
+                EgressQueueHighWater = depth;
+            }
+        }
+
+        while (lane->bulk_count > 0) {
+            if (EgressBulkSend(&lane->bulk[lane->bulk_head], id) != 0) {
+                if (errno == EAGAIN) {
+                    EgressQueueFull++;
+                    return -1;
+                }
+                EgressBulkPop(lane);
+                return -1;
+            }
+            EgressBulkPop(lane);
+        }
+    }
+
+    return 0;
+}
+
+/* Last value wins: a tag changed again before the flush only updates its pending value */
+static void EgressEnqueue(uint8_t typeKind, uint16_t index, const uint8_t *value) {
+    if (typeKind >= TAG_TYPE_KIND_COUNT) {
+        return;
+    }
+
+    tag_table_t *table = &OpcUaTagTable[typeKind];
+    if (table->egress == NULL || index >= table->size) {
+        return;
+    }
+
+    if (table->entries[index].state != TAG_STATE_ACTIVE) {
+        return;
+    }
+
+    lane_t id = table->entries[index].lane < LANE_COUNT ? (lane_t)table->entries[index].lane : LANE_NORMAL;
+    egress_lane_t *lane = &EgressLanes[id];
+    egress_entry_t *entry = &table->egress[index];
+
+    if (entry->pending) {
+        memcpy(entry->value, value, MAX_DATA_SIZE);
+        EgressCoalesced++;
+        return;
+    }
+
+    if (lane->count >= EGRESS_PENDING_LIMIT) {
+        switch (egress_policy) {
+            case EGRESS_POLICY_DROP_OLDEST:
+                EgressPendingPop(lane, 1);
+                EgressDropped++;
+                break;
+            case EGRESS_POLICY_BLOCK:
+                EgressFlush();
+                if (lane->count < EGRESS_PENDING_LIMIT) {
+                    break;
+                }
+                /* fall through */
+            case EGRESS_POLICY_DROP_NEWEST:
+            default:
+                EgressDropped++;
+                return;
+        }
+    }
+
+    memcpy(entry->value, value, MAX_DATA_SIZE);
+    entry->pending = 1;
+    entry->since = MonotonicNs();
+
+    tag_ref_t *ref = &lane->pending[(lane->head + lane->count) % EGRESS_PENDING_LIMIT];
+    ref->typeKind = typeKind;
+    ref->index = index;
+    lane->count++;
+
+    /* Critical values do not wait for the end of the server iteration */
+    if (id == LANE_CRITICAL || lane->count >= MAX_BATCH_RECORDS) {
+        EgressFlush();
+    }
+}
+
+/* Server thread: queues an array or structure whose egress buffer the caller just filled.
+ * One that is still queued sends the new value from its slot. Fails when the lane's bulk
+ * FIFO is full. */
+static int EgressBulkEnqueue(egress_bulk_kind_t kind, uint16_t index, uint8_t laneId, uint8_t *pending) {
+    lane_t id = laneId < LANE_COUNT ? (lane_t)laneId : LANE_NORMAL;
+    egress_lane_t *lane = &EgressLanes[id];
+
+    if (*pending) {
+        EgressCoalesced++;
+    } else {
+        if (lane->bulk_count >= EGRESS_BULK_LIMIT) {
+            return -1;
+        }
+
+        egress_bulk_ref_t *ref = &lane->bulk[(lane->bulk_head + lane->bulk_count) % EGRESS_BULK_LIMIT];
+        ref->kind = kind;
+        ref->index = index;
+        lane->bulk_count++;
+        *pending = 1;
+    }
+
+    if (id == LANE_CRITICAL) {
+        EgressFlush();
+    }
+    return 0;
+}
+
+/* The gateway's own writes run in the admin session */
+static UA_Boolean IsGatewayWrite(const UA_NodeId *sessionId) {
+    return sessionId == NULL ||
+           (sessionId->namespaceIndex == 0 && sessionId->identifierType == UA_NODEIDTYPE_GUID &&
+            sessionId->identifier.guid.data1 == ADMIN_SESSION_GUID_DATA1 &&
+            sessionId->identifier.guid.data2 == 0 && sessionId->identifier.guid.data3 == 0);
+}
+
+/* Client write time: the client's source timestamp when it sent one, else the server's */
+static void RecordClientWriteLatency(const UA_DataValue *value) {
+    UA_DateTime written = value->hasSourceTimestamp ? value->sourceTimestamp :
+                          value->hasServerTimestamp ? value->serverTimestamp : 0;
+    UA_DateTime now = UA_DateTime_now();
+
+    if (written != 0 && now >= written) {
+        HistogramRecord(HOP_CLIENT_WRITE_TO_CALLBACK, (uint64_t)(now - written) * 100);
+    }
+}
+
+static void ForwardClientWrite(uint8_t typeKind, uint16_t index, const UA_DataValue *value) {
+    if (registration_active == false) {
+
+        uint8_t newValue[MAX_DATA_SIZE] = {0};
+
+        switch(typeKind) {
+            case UA_DATATYPEKIND_BOOLEAN:
+                memcpy(newValue, value->value.data, sizeof(UA_Boolean));
+                break;
+            case UA_DATATYPEKIND_SBYTE:
+                memcpy(newValue, value->value.data, sizeof(UA_SByte));
+                break;
+            case UA_DATATYPEKIND_BYTE:
+                memcpy(newValue, value->value.data, sizeof(UA_Byte));
+                break;
+            case UA_DATATYPEKIND_INT16:
+                memcpy(newValue, value->value.data, sizeof(UA_Int16));
+                break;
+            case UA_DATATYPEKIND_UINT16:
+                memcpy(newValue, value->value.data, sizeof(UA_UInt16));
+                break;
+            case UA_DATATYPEKIND_INT32:
+                memcpy(newValue, value->value.data, sizeof(UA_Int32));
+                break;
+            case UA_DATATYPEKIND_UINT32:
+                memcpy(newValue, value->value.data, sizeof(UA_UInt32));
+                break;
+            case UA_DATATYPEKIND_INT64:
+                memcpy(newValue, value->value.data, sizeof(UA_Int64));
+                break;
+            case UA_DATATYPEKIND_UINT64:
+                memcpy(newValue, value->value.data, sizeof(UA_UInt64));
+                break;
+            case UA_DATATYPEKIND_FLOAT:
+                memcpy(newValue, value->value.data, sizeof(UA_Float));
+                break;
+            case UA_DATATYPEKIND_DOUBLE:
+                memcpy(newValue, value->value.data, sizeof(UA_Double));
+                break;
+            case UA_DATATYPEKIND_STRING: {
+                UA_String *str = (UA_String*)value->value.data;
+                if (str->data && str->length > 0) {
+                    size_t copy_len = (str->length < MAX_DATA_SIZE) ? str->length : MAX_DATA_SIZE - 1;
+                    memcpy(newValue, str->data, copy_len);
+                    newValue[copy_len] = '\0';
+                }
+                break;
+            }
+            default:
+                memcpy(newValue, value->value.data, sizeof(UA_Boolean));
+                break;
+        }
+
+        /* The node now holds the client's value, the next PLC value must reach it */
+        tag_entry_t *entry = LookupTagEntry(typeKind, index);
+        if (entry != NULL) {
+            __atomic_store_n(&entry->deadband_valid, 0, __ATOMIC_RELEASE);
+        }
+
+        RecordClientWriteLatency(value);
+        EgressEnqueue(typeKind, index, newValue);
+    }
+}
+
+/* onWrite of READWRITE tags with the internal backend, called once the Write service applied the value */
+static void ClientWriteCallback(UA_Server *server, const UA_NodeId *sessionId, void *sessionContext, const UA_NodeId *nodeId, void *nodeContext, const UA_NumericRange *range, const UA_DataValue *data) {
+    uint8_t typeKind = TAG_NODE_CONTEXT_TYPEKIND(nodeContext);
+
+    if (IsGatewayWrite(sessionId) || range != NULL || !data || !data->hasValue ||
+        !UA_Variant_isScalar(&data->value) || data->value.type != &UA_TYPES[typeKind]) {
+        return;
+    }
+
+    pthread_mutex_lock(&tag_table_mutex);
+    ForwardClientWrite(typeKind, TAG_NODE_CONTEXT_INDEX(nodeContext), data);
+    pthread_mutex_unlock(&tag_table_mutex);
+}
+
+/* Makes sure the tag table of a type holds at least `size` tags */
+static int EnsureTagTable(uint8_t typeKind, uint16_t size) {
+    if (typeKind >= TAG_TYPE_KIND_COUNT || size == 0) {
+        return -1;
+    }
+
+    tag_table_t *table = &OpcUaTagTable[typeKind];
+    if (table->entries != NULL && size <= table->size) {
+        return 0;
+    }
+
+    uint16_t oldSize = table->entries != NULL ? table->size : 0;
+    int result = 0;
+
+    pthread_mutex_lock(&tag_table_mutex);
+
+    tag_entry_t *entries = realloc(table->entries, size * sizeof(tag_entry_t));
+    if (entries != NULL) {
+        table->entries = entries;
+    }
+    egress_entry_t *egress = realloc(table->egress, size * sizeof(egress_entry_t));
+    if (egress != NULL) {
+        table->egress = egress;
+    }
+
+    if (entries == NULL || egress == NULL) {
+        result = -1;
+    } else {
+        memset(&table->entries[oldSize], 0, (size - oldSize) * sizeof(tag_entry_t));
+        memset(&table->egress[oldSize], 0, (size - oldSize) * sizeof(egress_entry_t));
+        table->size = size;
+    }
+
+    pthread_mutex_unlock(&tag_table_mutex);
+
+    return result;
+}
+
+static void RegisterTagEntry(uint8_t typeKind, uint16_t index, const UA_NodeId *nodeId) {
+    tag_entry_t *entry = LookupTagEntry(typeKind, index);
+    if (entry == NULL) {
+        return;
+    }
+
+    UA_NodeId_clear(&entry->nodeId);
+    if (UA_NodeId_copy(nodeId, &entry->nodeId) != UA_STATUSCODE_GOOD) {
+        entry->type = NULL;
+        return;
+    }
+    entry->type = &UA_TYPES[typeKind];
+
+    /* Tags listed in an update window stay buffered until ActivateTagEntry */
+    if (entry->state != TAG_STATE_UPDATING) {
+        entry->state = TAG_STATE_ACTIVE;
+    }
+}
+
+/* Ends the update window for one tag and replays the newest write buffered meanwhile */
+static void ActivateTagEntry(uint8_t typeKind, uint16_t index) {
+    tag_entry_t *entry = LookupTagEntry(typeKind, index);
+    if (entry == NULL || entry->state != TAG_STATE_UPDATING) {
+        return;
+    }
+
+    if (entry->type == NULL) {
+        entry->state = TAG_STATE_EMPTY;
+        entry->replay_pending = 0;
+        return;
+    }
+
+    entry->state = TAG_STATE_ACTIVE;
+    if (entry->replay_pending) {
+        entry->replay_pending = 0;
+        WriteServerVariableValue(typeKind, index, entry->replay_value);
+        UpdateStats.replayed++;
+    }
+}
+
+static size_t ImageValueSize(uint8_t typeKind) {
+    return typeKind == UA_DATATYPEKIND_STRING ? MAX_DATA_SIZE : UA_TYPES[typeKind].memSize;
+}
+
+static void UnbindImageDiff(uint8_t typeKind, uint16_t index) {
+    image_diff_table_t *table = &ImageDiffTable[typeKind];
+    size_t elem_size = ImageValueSize(typeKind);
+
+    pthread_mutex_lock(&tag_table_mutex);
+    if (index < table->size && table->offsets[index] != IMAGE_UNBOUND) {
+        table->offsets[index] = IMAGE_UNBOUND;
+        table->dirty = 1;
+        /* Both snapshots must agree for tags nobody gathers any more */
+        memset(table->current + (size_t)index * elem_size, 0, elem_size);
+        memset(table->previous + (size_t)index * elem_size, 0, elem_size);
+    }
+    pthread_mutex_unlock(&tag_table_mutex);
+}
+
+/* Deletes the node; the slot can be registered again */
+/* Server thread, on every sample of the probe tag that changed */
+static void NotifyProbeCallback(UA_Server *server, UA_UInt32 monitoredItemId, void *monitoredItemContext, const UA_NodeId *nodeId, void *nodeContext, UA_UInt32 attributeId, const UA_DataValue *value) {
+    uint64_t written = __atomic_exchange_n(&NotifyProbe.written_ns, 0, __ATOMIC_ACQ_REL);
+
+    if (written != 0) {
+        HistogramRecord(HOP_WRITE_TO_SAMPLE, MonotonicNs() - written);
+    }
+}
+
+/* Sampled like a client subscription would be: the tag's interval, else the server minimum */
+static void AttachNotifyProbe(const char *name, uint8_t typeKind, uint16_t index, const tag_entry_t *entry) {
+    if (NotifyProbe.name == NULL || strcmp(name, NotifyProbe.name) != 0) {
+        return;
+    }
+
+    UA_MonitoredItemCreateRequest item;
+    UA_MonitoredItemCreateRequest_init(&item);
+    item.itemToMonitor.nodeId = entry->nodeId;
+    item.itemToMonitor.attributeId = UA_ATTRIBUTEID_VALUE;
+    item.monitoringMode = UA_MONITORINGMODE_REPORTING;
+    item.requestedParameters.samplingInterval = SamplingClassInterval[entry->sampling_class];
+    if (item.requestedParameters.samplingInterval <= 0.0) {
+        item.requestedParameters.samplingInterval = UA_Server_getConfig(OpcUaServer)->samplingIntervalLimits.min;
+    }
+    item.requestedParameters.queueSize = 1;
+    item.requestedParameters.discardOldest = true;
+
+    UA_MonitoredItemCreateResult result = UA_Server_createDataChangeMonitoredItem(OpcUaServer, UA_TIMESTAMPSTORETURN_NEITHER, item, NULL, NotifyProbeCallback);
+    if (result.statusCode == UA_STATUSCODE_GOOD) {
+        NotifyProbe.typeKind = typeKind;
+        NotifyProbe.index = index;
+        __atomic_store_n(&NotifyProbe.written_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&NotifyProbe.monitoredItemId, result.monitoredItemId, __ATOMIC_RELEASE);
+    }
+#ifdef DEBUG
+    printf("[OPC_UA] Notification probe on %s (%.1f ms): %s\n", name,
+           item.requestedParameters.samplingInterval, UA_StatusCode_name(result.statusCode));
+    fflush(stdout);
+#endif
+    UA_MonitoredItemCreateResult_clear(&result);
+}
+
+static void RemoveTagEntry(uint8_t typeKind, uint16_t index) {
+    tag_entry_t *entry = LookupTagEntry(typeKind, index);
+    if (entry == NULL || entry->type == NULL) {
+        return;
+    }
+
+    if (NotifyProbe.monitoredItemId != 0 && typeKind == NotifyProbe.typeKind && index == NotifyProbe.index) {
+        UA_Server_deleteMonitoredItem(OpcUaServer, NotifyProbe.monitoredItemId);
+        __atomic_store_n(&NotifyProbe.monitoredItemId, 0, __ATOMIC_RELEASE);
+    }
+
+    if (image_diff_enabled) {
+        UnbindImageDiff(typeKind, index);
+        entry->image_diff = 0;
+    }
+
+    UA_Server_deleteNode(OpcUaServer, entry->nodeId, true);
+    UA_NodeId_clear(&entry->nodeId);
+    entry->type = NULL;
+    entry->backend = VALUE_BACKEND_INTERNAL;
+
+    if (entry->state == TAG_STATE_ACTIVE) {
+        entry->state = TAG_STATE_EMPTY;
+    }
+}
+
+/* A name registered again under another typeKind or index still owns its NodeId through the
+ * old slot; that slot is removed so the new node can take the name */
+static void RemoveTagNamed(const UA_NodeId *nodeId, uint8_t typeKind, uint16_t index) {
+    void *context = NULL;
+
+    if (UA_Server_getNodeContext(OpcUaServer, *nodeId, &context) != UA_STATUSCODE_GOOD) {
+        return;
+    }
+
+    uint8_t oldTypeKind = TAG_NODE_CONTEXT_TYPEKIND(context);
+    uint16_t oldIndex = TAG_NODE_CONTEXT_INDEX(context);
+    if (oldTypeKind >= TAG_TYPE_KIND_COUNT || (oldTypeKind == typeKind && oldIndex == index)) {
+        return;
+    }
+
+    /* Arrays share the context layout, only a scalar slot holding this very NodeId is ours */
+    tag_entry_t *entry = LookupTagEntry(oldTypeKind, oldIndex);
+    if (entry != NULL && entry->type != NULL && UA_NodeId_equal(&entry->nodeId, nodeId)) {
+        RemoveTagEntry(oldTypeKind, oldIndex);
+    }
+}
+
+static void *AllocateAligned(size_t size) {
+    void *buffer = NULL;
+
+    if (posix_memalign(&buffer, VALUE_STORE_ALIGNMENT, size) != 0) {
+        return NULL;
+    }
+    memset(buffer, 0, size);
+    return buffer;
+}
+
+static void FreeValueStorePage(value_store_page_t *page) {
+    if (page == NULL) {
+        return;
+    }
+    free(page->values);
+    free(page->dataValues);
+    free(page->bindings);
+    free(page->strings);
+    free(page);
+}
+
+/* Makes sure the page holding `index` exists; pages of earlier tags stay where they are */
+static int AllocateValueStore(uint8_t typeKind, uint16_t index) {
+    value_store_page_t **slot = &OpcUaValueStore[typeKind].pages[index >> VALUE_STORE_PAGE_SHIFT];
+
+    if (*slot != NULL) {
+        return 0;
+    }
+
+    value_store_page_t *page = calloc(1, sizeof(value_store_page_t));
+    if (page == NULL) {
+        return -1;
+    }
+
+    page->values = AllocateAligned(VALUE_STORE_PAGE_TAGS * UA_TYPES[typeKind].memSize);
+    page->dataValues = AllocateAligned(VALUE_STORE_PAGE_TAGS * sizeof(UA_DataValue));
+    page->bindings = AllocateAligned(VALUE_STORE_PAGE_TAGS * sizeof(UA_DataValue*));
+    if (typeKind == UA_DATATYPEKIND_STRING) {
+        page->strings = AllocateAligned(VALUE_STORE_PAGE_TAGS * MAX_DATA_SIZE);
+    }
+
+    if (!page->values || !page->dataValues || !page->bindings ||
+        (typeKind == UA_DATATYPEKIND_STRING && !page->strings)) {
+        FreeValueStorePage(page);
+        return -1;
+    }
+
+    *slot = page;
+    return 0;
+}
+
+static void FreeValueStore(void) {
+    for (int typeKind = 0; typeKind <= UA_DATATYPEKIND_STRING; typeKind++) {
+        for (uint32_t page = 0; page < VALUE_STORE_PAGES; page++) {
+            FreeValueStorePage(OpcUaValueStore[typeKind].pages[page]);
+            OpcUaValueStore[typeKind].pages[page] = NULL;
+        }
+    }
+}
+
+static UA_StatusCode ExternalValueUserWrite(UA_Server *server, const UA_NodeId *sessionId, void *sessionContext, const UA_NodeId *nodeId, void *nodeContext, const UA_NumericRange *range, const UA_DataValue *data) {
+    uint8_t typeKind = TAG_NODE_CONTEXT_TYPEKIND(nodeContext);
+    uint16_t index = TAG_NODE_CONTEXT_INDEX(nodeContext);
+
+    if (range != NULL) {
+        return UA_STATUSCODE_BADINDEXRANGEINVALID;
+    }
+    if (!data->hasValue || data->value.type != &UA_TYPES[typeKind] || !UA_Variant_isScalar(&data->value)) {
+        return UA_STATUSCODE_BADTYPEMISMATCH;
+    }
+
+    if (typeKind == UA_DATATYPEKIND_STRING) {
+        const UA_String *str = (const UA_String*)data->value.data;
+        StoreExternalValue(typeKind, index, str->data ? str->data : (const UA_Byte*)"", str->length, 0);
+    } else {
+        StoreExternalValue(typeKind, index, data->value.data, MAX_DATA_SIZE, 0);
+    }
+
+    /* Only the Write service gets here, CODESYS values go to the value store directly */
+    if (!IsGatewayWrite(sessionId)) {
+        pthread_mutex_lock(&tag_table_mutex);
+        ForwardClientWrite(typeKind, index, data);
+        pthread_mutex_unlock(&tag_table_mutex);
+    }
+
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Moves the value of a freshly added node into the value store and points the node at it */
+static void BindExternalValue(uint8_t typeKind, uint16_t index, const UA_NodeId *nodeId, const UA_Variant *initial) {
+    tag_entry_t *entry = LookupTagEntry(typeKind, index);
+
+    if (entry == NULL || AllocateValueStore(typeKind, index) != 0) {
+        return;
+    }
+
+    value_store_page_t *page = ValueStorePage(typeKind, index);
+    UA_DataValue **binding = &page->bindings[index & (VALUE_STORE_PAGE_TAGS - 1)];
+    UA_DataValue *dataValue = ValueStoreDataValue(typeKind, index);
+
+    if (typeKind == UA_DATATYPEKIND_STRING) {
+        const UA_String *str = (const UA_String*)initial->data;
+        StoreExternalValue(typeKind, index, str->data ? str->data : (const UA_Byte*)"", str->length, 0);
+    } else {
+        StoreExternalValue(typeKind, index, initial->data, MAX_DATA_SIZE, 0);
+    }
+
+    UA_Variant_setScalar(&dataValue->value, ValueStoreSlot(typeKind, index), &UA_TYPES[typeKind]);
+    dataValue->value.storageType = UA_VARIANT_DATA_NODELETE;
+    dataValue->hasValue = true;
+    dataValue->hasServerTimestamp = true;
+    *binding = dataValue;
+
+    UA_ValueBackend backend;
+    memset(&backend, 0, sizeof(backend));
+    backend.backendType = UA_VALUEBACKENDTYPE_EXTERNAL;
+    backend.backend.external.value = binding;
+    backend.backend.external.callback.notificationRead = NULL;
+    backend.backend.external.callback.userWrite = ExternalValueUserWrite;
+
+    if (UA_Server_setVariableNode_valueBackend(OpcUaServer, *nodeId, backend) == UA_STATUSCODE_GOOD) {
+        entry->backend = VALUE_BACKEND_EXTERNAL;
+    }
+}
+
+static int OpenProcessImage(void) {
+    if (ProcessImage != NULL) {
+        return 0;
+    }
+    if (process_image_name == NULL) {
+        return -1;
+    }
+
+    int fd = shm_open(process_image_name, O_RDONLY, 0);
+    if (fd == -1) {
+        perror("[OPC_UA] process image shm_open failed");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(process_image_t)) {
+        close(fd);
+        return -1;
+    }
+
+    void *image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED) {
+        perror("[OPC_UA] process image mmap failed");
+        return -1;
+    }
+
+    const process_image_t *header = (const process_image_t*)image;
+    if (header->magic != PROCESS_IMAGE_MAGIC || sizeof(process_image_t) + header->size > (size_t)st.st_size) {
+        munmap(image, st.st_size);
+        return -1;
+    }
+
+    ProcessImage = header;
+    process_image_mapped = st.st_size;
+    return 0;
+}
+
+static void CloseProcessImage(void) {
+    if (ProcessImage != NULL) {
+        munmap((void*)ProcessImage, process_image_mapped);
+        ProcessImage = NULL;
+        process_image_mapped = 0;
+    }
+}
+
+/* Sequence-lock read: retries until the copy was taken between two equal, even sequence values */
+static int ReadProcessImage(uint32_t offset, size_t size, uint8_t *out) {
+    for (int attempt = 0; attempt < PROCESS_IMAGE_READ_RETRIES; attempt++) {
+        uint32_t before = __atomic_load_n(&ProcessImage->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            ProcessImageRetries++;
+            sched_yield();
+            continue;
+        }
+
+        memcpy(out, ProcessImage->data + offset, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&ProcessImage->sequence, __ATOMIC_RELAXED) == before) {
+            return 0;
+        }
+        ProcessImageRetries++;
+    }
+
+    ProcessImageFailedReads++;
+    return -1;
+}
+
+static UA_StatusCode ImageDataSourceRead(UA_Server *server, const UA_NodeId *sessionId, void *sessionContext, const UA_NodeId *nodeId, void *nodeContext, UA_Boolean includeSourceTimeStamp, const UA_NumericRange *range, UA_DataValue *value) {
+    uint8_t typeKind = TAG_NODE_CONTEXT_TYPEKIND(nodeContext);
+    uint16_t index = TAG_NODE_CONTEXT_INDEX(nodeContext);
+    uint8_t buffer[MAX_DATA_SIZE];
+
+    /* The receive thread rebinds and grows the tables, take the offset under the lock */
+    pthread_mutex_lock(&tag_table_mutex);
+    tag_entry_t *entry = LookupTagEntry(typeKind, index);
+    bool bound = entry != NULL && entry->backend == VALUE_BACKEND_IMAGE;
+    uint32_t offset = bound ? entry->image_offset : 0;
+    pthread_mutex_unlock(&tag_table_mutex);
+
+    if (!bound) {
+        value->hasStatus = true;
+        value->status = UA_STATUSCODE_BADNODEIDUNKNOWN;
+        return UA_STATUSCODE_GOOD;
+    }
+
+    if (ReadProcessImage(offset, ImageValueSize(typeKind), buffer) != 0) {
+        value->hasStatus = true;
+        value->status = UA_STATUSCODE_BADRESOURCEUNAVAILABLE;
+        return UA_STATUSCODE_GOOD;
+    }
+
+    UA_StatusCode retval;
+    if (typeKind == UA_DATATYPEKIND_STRING) {
+        UA_String str;
+        str.length = strnlen((char*)buffer, MAX_DATA_SIZE);
+        str.data = buffer;
+        retval = UA_Variant_setScalarCopy(&value->value, &str, &UA_TYPES[UA_TYPES_STRING]);
+    } else {
+        retval = UA_Variant_setScalarCopy(&value->value, buffer, &UA_TYPES[typeKind]);
+    }
+    if (retval != UA_STATUSCODE_GOOD) {
+        return retval;
+    }
+
+    value->hasValue = true;
+    if (includeSourceTimeStamp) {
+        value->hasSourceTimestamp = true;
+        value->sourceTimestamp = UA_DateTime_now();
+    }
+
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Client writes cannot touch the PLC-owned image, they go to CODESYS like any other change */
+static UA_StatusCode ImageDataSourceWrite(UA_Server *server, const UA_NodeId *sessionId, void *sessionContext, const UA_NodeId *nodeId, void *nodeContext, const UA_NumericRange *range, const UA_DataValue *data) {
+    uint8_t typeKind = TAG_NODE_CONTEXT_TYPEKIND(nodeContext);
+    uint16_t index = TAG_NODE_CONTEXT_INDEX(nodeContext);
+    uint8_t newValue[MAX_DATA_SIZE] = {0};
+
+    if (range != NULL) {
+        return UA_STATUSCODE_BADINDEXRANGEINVALID;
+    }
+    if (!data->hasValue || data->value.type != &UA_TYPES[typeKind] || !UA_Variant_isScalar(&data->value)) {
+        return UA_STATUSCODE_BADTYPEMISMATCH;
+    }
+
+    if (typeKind == UA_DATATYPEKIND_STRING) {
+        const UA_String *str = (const UA_String*)data->value.data;
+        size_t copy_len = (str->length < MAX_DATA_SIZE) ? str->length : MAX_DATA_SIZE - 1;
+        if (str->data) {
+            memcpy(newValue, str->data, copy_len);
+        }
+    } else {
+        memcpy(newValue, data->value.data, UA_TYPES[typeKind].memSize);
+    }
+
+    RecordClientWriteLatency(data);
+
+    pthread_mutex_lock(&tag_table_mutex);
+    EgressEnqueue(typeKind, index, newValue);
+    pthread_mutex_unlock(&tag_table_mutex);
+
+    return UA_STATUSCODE_GOOD;
+}
+
+static int EnsureImageDiffTable(uint8_t typeKind, uint16_t size) {
+    image_diff_table_t *table = &ImageDiffTable[typeKind];
+    size_t elem_size = ImageValueSize(typeKind);
+
+    if (size <= table->size) {
+        return 0;
+    }
+
+    uint32_t capacity = (uint32_t)size + VALUE_STORE_SPARE;
+    if (capacity > UINT16_MAX) {
+        capacity = UINT16_MAX;
+    }
+
+    size_t bytes = IMAGE_DIFF_BUFFER_SIZE(capacity, elem_size);
+    uint8_t *current = AllocateAligned(bytes);
+    uint8_t *previous = AllocateAligned(bytes);
+    uint32_t *offsets = malloc(capacity * sizeof(uint32_t));
+    uint16_t *changed = malloc(capacity * sizeof(uint16_t));
+    image_run_t *runs = malloc(capacity * sizeof(image_run_t));
+
+    if (!current || !previous || !offsets || !changed || !runs) {
+        free(current);
+        free(previous);
+        free(offsets);
+        free(changed);
+        free(runs);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < capacity; i++) {
+        offsets[i] = (i < table->size) ? table->offsets[i] : IMAGE_UNBOUND;
+    }
+    if (table->size > 0) {
+        memcpy(current, table->current, (size_t)table->size * elem_size);
+        memcpy(previous, table->previous, (size_t)table->size * elem_size);
+    }
+
+    free(table->current);
+    free(table->previous);
+    free(table->offsets);
+    free(table->changed);
+    free(table->runs);
+
+    table->current = current;
+    table->previous = previous;
+    table->offsets = offsets;
+    table->changed = changed;
+    table->runs = runs;
+    table->size = capacity;
+    table->dirty = 1;
+    return 0;
+}
+
+static void FreeImageDiffTables(void) {
+    for (int typeKind = 0; typeKind < TAG_TYPE_KIND_COUNT; typeKind++) {
+        image_diff_table_t *table = &ImageDiffTable[typeKind];
+        free(table->current);
+        free(table->previous);
+        free(table->offsets);
+        free(table->changed);
+        free(table->runs);
+        memset(table, 0, sizeof(image_diff_table_t));
+    }
+}
+
+/* Binds a tag to the change detection and pushes its current image value to the node */
+static int BindImageDiff(uint8_t typeKind, uint16_t index, uint32_t offset) {
+    size_t elem_size = ImageValueSize(typeKind);
+    uint8_t newValue[MAX_DATA_SIZE] = {0};
+
+    if (ReadProcessImage(offset, elem_size, newValue) != 0) {
+        return -1;
+    }
+
+    pthread_mutex_lock(&tag_table_mutex);
+    if (EnsureImageDiffTable(typeKind, index + 1) != 0) {
+        pthread_mutex_unlock(&tag_table_mutex);
+        return -1;
+    }
+    image_diff_table_t *table = &ImageDiffTable[typeKind];
+    table->offsets[index] = offset;
+    table->dirty = 1;
+    memcpy(table->current + (size_t)index * elem_size, newValue, elem_size);
+    memcpy(table->previous + (size_t)index * elem_size, newValue, elem_size);
+    pthread_mutex_unlock(&tag_table_mutex);
+
+    newValue[MAX_DATA_SIZE - 1] = '\0';
+    WriteServerVariableValue(typeKind, index, newValue);
+    return 0;
+}
+
+static void RebuildImageRuns(image_diff_table_t *table, size_t elem_size) {
+    image_run_t *run = NULL;
+
+    table->run_count = 0;
+    for (uint32_t i = 0; i < table->size; i++) {
+        uint32_t offset = table->offsets[i];
+        if (offset == IMAGE_UNBOUND) {
+            run = NULL;
+            continue;
+        }
+        if (run != NULL && run->offset + (uint32_t)run->count * elem_size == offset) {
+            run->count++;
+            continue;
+        }
+        run = &table->runs[table->run_count++];
+        run->index = i;
+        run->count = 1;
+        run->offset = offset;
+    }
+    table->dirty = 0;
+}
+
+static void SwapImageSnapshots(void) {
+    for (int typeKind = 0; typeKind < TAG_TYPE_KIND_COUNT; typeKind++) {
+        image_diff_table_t *table = &ImageDiffTable[typeKind];
+        uint8_t *swap = table->current;
+        table->current = table->previous;
+        table->previous = swap;
+    }
+}
+
+/* Gathers all runs into the current snapshots under the sequence lock */
+static int GatherProcessImage(uint32_t *sequence) {
+    for (int attempt = 0; attempt < PROCESS_IMAGE_READ_RETRIES; attempt++) {
+        uint32_t before = __atomic_load_n(&ProcessImage->sequence, __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            ProcessImageRetries++;
+            sched_yield();
+            continue;
+        }
+
+        for (int typeKind = 0; typeKind < TAG_TYPE_KIND_COUNT; typeKind++) {
+            image_diff_table_t *table = &ImageDiffTable[typeKind];
+            size_t elem_size = ImageValueSize(typeKind);
+            for (uint16_t r = 0; r < table->run_count; r++) {
+                image_run_t *run = &table->runs[r];
+                memcpy(table->current + (size_t)run->index * elem_size, ProcessImage->data + run->offset,
+                       (size_t)run->count * elem_size);
+            }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&ProcessImage->sequence, __ATOMIC_RELAXED) == before) {
+            *sequence = before;
+            return 0;
+        }
+        ProcessImageRetries++;
+    }
+
+    ProcessImageFailedReads++;
+    return -1;
+}
+
+/* Server thread, once per iteration: only tags that changed since the last published image
+ * reach their nodes and, through them, the monitored items */
+static void ImageDiffCycle(void) {
+    uint8_t newValue[MAX_DATA_SIZE];
+
+    if (!image_diff_enabled || ProcessImage == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&tag_table_mutex);
+
+    if (__atomic_load_n(&ProcessImage->sequence, __ATOMIC_ACQUIRE) == image_diff_sequence) {
+        ImageDiffStats.skipped++;
+        pthread_mutex_unlock(&tag_table_mutex);
+        return;
+    }
+
+    for (int typeKind = 0; typeKind < TAG_TYPE_KIND_COUNT; typeKind++) {
+        if (ImageDiffTable[typeKind].dirty) {
+            RebuildImageRuns(&ImageDiffTable[typeKind], ImageValueSize(typeKind));
+        }
+    }
+
+    SwapImageSnapshots();
+    if (GatherProcessImage(&image_diff_sequence) != 0) {
+        SwapImageSnapshots();
+        pthread_mutex_unlock(&tag_table_mutex);
+        return;
+    }
+
+    for (int typeKind = 0; typeKind < TAG_TYPE_KIND_COUNT; typeKind++) {
+        image_diff_table_t *table = &ImageDiffTable[typeKind];
+        size_t elem_size = ImageValueSize(typeKind);
+
+        if (table->run_count == 0) {
+            continue;
+        }
+
+        uint64_t start = MonotonicNs();
+        size_t changes = image_diff(table->current, table->previous, table->size, elem_size, table->changed);
+        ImageDiffStats.diff_ns += MonotonicNs() - start;
+        ImageDiffStats.bytes += IMAGE_DIFF_BUFFER_SIZE(table->size, elem_size);
+        ImageDiffStats.changed += changes;
+
+        for (size_t i = 0; i < changes; i++) {
+            uint16_t index = table->changed[i];
+            memset(newValue, 0, sizeof(newValue));
+            memcpy(newValue, table->current + (size_t)index * elem_size, elem_size);
+            newValue[MAX_DATA_SIZE - 1] = '\0';
+            WriteServerVariableValue(typeKind, index, newValue);
+        }
+    }
+    ImageDiffStats.cycles++;
+
+    pthread_mutex_unlock(&tag_table_mutex);
+}
+
+/* -D: diff throughput of the compiled kernel on a full table of doubles */
+static void RunImageDiffBenchmark(void) {
+    const size_t count = UINT16_MAX;
+    const size_t elem_size = sizeof(UA_Double);
+    const int iterations = 2000;
+    size_t bytes = IMAGE_DIFF_BUFFER_SIZE(count, elem_size);
+    uint8_t *current = AllocateAligned(bytes);
+    uint8_t *previous = AllocateAligned(bytes);
+    uint16_t *changed = malloc(count * sizeof(uint16_t));
+    size_t changes = 0;
+
+    if (!current || !previous || !changed) {
+        free(current);
+        free(previous);
+        free(changed);
+        return;
+    }
+
+    uint64_t elapsed = 0;
+    for (int i = 0; i < iterations; i++) {
+        /* About 1% of the tags change per cycle */
+        for (size_t k = 0; k < count / 100; k++) {
+            current[((k * 7919 + (size_t)i * 104729) % count) * elem_size]++;
+        }
+        uint64_t start = MonotonicNs();
+        changes += image_diff(current, previous, count, elem_size, changed);
+        elapsed += MonotonicNs() - start;
+        memcpy(previous, current, bytes);
+    }
+
+    printf("[OPC_UA] Image diff (%s): %zu bytes x %d, %.2f GB/s, %.1f changes per cycle\n",
+           image_diff_kernel(), bytes, iterations,
+           elapsed ? (double)bytes * iterations / (double)elapsed : 0.0, (double)changes / iterations);
+    fflush(stdout);
+
+    free(current);
+    free(previous);
+    free(changed);
+}
+
+static void BindImageVariables(uint8_t *buffer, ssize_t length) {
+    tag_list_header_t *header = (tag_list_header_t*)buffer;
+
+    if (length < (ssize_t)sizeof(tag_list_header_t) ||
+        length != (ssize_t)(sizeof(tag_list_header_t) + header->count * sizeof(image_binding_record_t))) {
+        return;
+    }
+    if (OpenProcessImage() != 0) {
+        return;
+    }
+
+    image_binding_record_t *records = (image_binding_record_t*)(buffer + sizeof(tag_list_header_t));
+    UA_DataSource dataSource;
+    dataSource.read = ImageDataSourceRead;
+    dataSource.write = ImageDataSourceWrite;
+
+    for (uint16_t i = 0; i < header->count; i++) {
+        tag_entry_t *entry = LookupTagEntry(records[i].typeKind, records[i].index);
+
+        if (entry == NULL || entry->type == NULL ||
+            (size_t)records[i].offset + ImageValueSize(records[i].typeKind) > ProcessImage->size) {
+            continue;
+        }
+
+        entry->image_offset = records[i].offset;
+        if (image_diff_enabled) {
+            /* Node keeps its value and write callback, ImageDiffCycle writes the changes */
+            if (BindImageDiff(records[i].typeKind, records[i].index, records[i].offset) == 0) {
+                entry->image_diff = 1;
+            }
+            continue;
+        }
+        if (UA_Server_setVariableNode_dataSource(OpcUaServer, entry->nodeId, dataSource) != UA_STATUSCODE_GOOD) {
+            continue;
+        }
+        /* Client writes reach ImageDataSourceWrite from now on */
+        entry->backend = VALUE_BACKEND_IMAGE;
+    }
+
+#ifdef DEBUG
+    printf("[OPC_UA] Process image: %u bindings\n", header->count);
+    fflush(stdout);
+#endif
+}
+
+static uint32_t FolderHash(const char *path, size_t length) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t)path[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static folder_cache_entry_t *FolderCacheSlot(folder_cache_entry_t *entries, uint32_t size, const char *path, size_t length, uint32_t hash) {
+    for (uint32_t i = hash & (size - 1);; i = (i + 1) & (size - 1)) {
+        folder_cache_entry_t *entry = &entries[i];
+        if (!entry->used || (entry->hash == hash && strncmp(entry->path, path, length) == 0 && entry->path[length] == '\0')) {
+            return entry;
+        }
+    }
+}
+
+static int FolderCacheInsert(const char *path, size_t length, uint32_t hash, const UA_NodeId *nodeId) {
+    /* Kept at most half full, so probes stay short and always end on a free slot */
+    if ((FolderCache.count + 1) * 2 > FolderCache.size) {
+        uint32_t size = FolderCache.size ? FolderCache.size * 2 : FOLDER_CACHE_INITIAL;
+        folder_cache_entry_t *entries = calloc(size, sizeof(folder_cache_entry_t));
+        if (entries == NULL) {
+            return -1;
+        }
+        for (uint32_t i = 0; i < FolderCache.size; i++) {
+            folder_cache_entry_t *old = &FolderCache.entries[i];
+            if (old->used) {
+                *FolderCacheSlot(entries, size, old->path, strlen(old->path), old->hash) = *old;
+            }
+        }
+        free(FolderCache.entries);
+        FolderCache.entries = entries;
+        FolderCache.size = size;
+    }
+
+    folder_cache_entry_t *entry = FolderCacheSlot(FolderCache.entries, FolderCache.size, path, length, hash);
+    entry->used = 1;
+    entry->hash = hash;
+    memcpy(entry->path, path, length);
+    entry->path[length] = '\0';
+    entry->nodeId = *nodeId;
+    FolderCache.count++;
+    return 0;
+}
+
+static const UA_NodeId *FolderCacheFind(const char *path, size_t length, uint32_t hash) {
+    if (FolderCache.size == 0) {
+        return NULL;
+    }
+
+    folder_cache_entry_t *entry = FolderCacheSlot(FolderCache.entries, FolderCache.size, path, length, hash);
+    return entry->used ? &entry->nodeId : NULL;
+}
+
+/* The folders belong to the server, only the cache is released */
+static void FreeFolderCache(void) {
+    free(FolderCache.entries);
+    memset(&FolderCache, 0, sizeof(FolderCache));
+}
+
+/* Parent folder of a dotted tag path, created on demand, and the segment used as BrowseName.
+ * Falls back to the Objects folder for flat names, empty segments and the flat layout.
+ * A tag named like an existing folder, or a folder named like an existing tag, is refused. */
+static UA_StatusCode ResolveTagParent(const char *name, UA_NodeId *parent, const char **leaf) {
+    size_t dots[FOLDER_MAX_DEPTH];
+    uint32_t hashes[FOLDER_MAX_DEPTH];
+    int depth = 0;
+
+    *parent = UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER);
+    *leaf = name;
+
+    if (address_layout == ADDRESS_LAYOUT_FLAT) {
+        return UA_STATUSCODE_GOOD;
+    }
+
+    size_t length = strnlen(name, MAX_NAME_LENGTH - 1);
+    if (FolderCacheFind(name, length, FolderHash(name, length)) != NULL) {
+#ifdef DEBUG
+        printf("[OPC_UA] Tag %s collides with the folder of the same path\n", name);
+        fflush(stdout);
+#endif
+        return UA_STATUSCODE_BADBROWSENAMEDUPLICATED;
+    }
+
+    for (size_t i = 0; i < length; i++) {
+        if (name[i] != '.') {
+            continue;
+        }
+        if (i == 0 || name[i - 1] == '.' || i + 1 == length || depth == FOLDER_MAX_DEPTH) {
+            return UA_STATUSCODE_GOOD;
+        }
+        dots[depth++] = i;
+    }
+    if (depth == 0) {
+        return UA_STATUSCODE_GOOD;
+    }
+
+    /* Longest known prefix first: siblings registered together hit on the first probe */
+    const UA_NodeId *known = NULL;
+    int level = depth - 1;
+    for (; level >= 0; level--) {
+        hashes[level] = FolderHash(name, dots[level]);
+        known = FolderCacheFind(name, dots[level], hashes[level]);
+        if (known != NULL) {
+            break;
+        }
+    }
+
+    if (known != NULL) {
+        FolderCache.hits++;
+        *parent = *known;
+    }
+
+    for (level++; level < depth; level++) {
+        size_t start = level == 0 ? 0 : dots[level - 1] + 1;
+        char segment[MAX_NAME_LENGTH];
+        memcpy(segment, name + start, dots[level] - start);
+        segment[dots[level] - start] = '\0';
+
+        /* The tag NodeId is the full path, a tag at this prefix already owns the BrowseName */
+        char prefix[MAX_NAME_LENGTH];
+        UA_NodeClass nodeClass;
+        memcpy(prefix, name, dots[level]);
+        prefix[dots[level]] = '\0';
+        if (UA_Server_readNodeClass(OpcUaServer, UA_NODEID_STRING(1, prefix), &nodeClass) == UA_STATUSCODE_GOOD) {
+#ifdef DEBUG
+            printf("[OPC_UA] Folder %s collides with the tag of the same path\n", prefix);
+            fflush(stdout);
+#endif
+            return UA_STATUSCODE_BADBROWSENAMEDUPLICATED;
+        }
+
+        UA_ObjectAttributes attr = UA_ObjectAttributes_default;
+        attr.displayName = UA_LOCALIZEDTEXT("en-US", segment);
+
+        UA_NodeId folderId;
+        UA_StatusCode retval = UA_Server_addObjectNode(OpcUaServer, UA_NODEID_NUMERIC(1, 0), *parent,
+                                                       UA_NODEID_NUMERIC(0, UA_NS0ID_ORGANIZES), UA_QUALIFIEDNAME(1, segment),
+                                                       UA_NODEID_NUMERIC(0, UA_NS0ID_FOLDERTYPE), attr, NULL, &folderId);
+        if (retval != UA_STATUSCODE_GOOD) {
+#ifdef DEBUG
+            printf("[OPC_UA] Failed to add folder %.*s: %s\n", (int)dots[level], name, UA_StatusCode_name(retval));
+            fflush(stdout);
+#endif
+            return retval;
+        }
+
+        FolderCache.misses++;
+        if (FolderCacheInsert(name, dots[level], hashes[level], &folderId) != 0) {
+            return UA_STATUSCODE_BADOUTOFMEMORY;
+        }
+        *parent = folderId;
+    }
+
+    *leaf = name + dots[depth - 1] + 1;
+    return UA_STATUSCODE_GOOD;
+}
+
+static void AddVariableToOpcUaServer(char *buffer) {
+    variable_registration_t *message = (variable_registration_t*)buffer;
+
+    char *name = message->name;
+    char *description = message->description;
+    uint8_t typeKind = message->typeKind;
+    AccessLevel *pAccessLevel = &message->access_level;
+    uint8_t *pValue = message->value;
+    uint16_t NumberAcceptedParameters = message->NumberAcceptedParameters;
+
+    if (EnsureTagTable(typeKind, NumberAcceptedParameters > message->index ? NumberAcceptedParameters : message->index + 1) != 0) {
+        return;
+    }
+
+    /* Re-registration of a slot during an update window replaces the previous node, a retyped
+     * tag (same name, other typeKind or index) also frees its old slot */
+    RemoveTagEntry(typeKind, message->index);
+    UA_NodeId tagNodeId = UA_NODEID_STRING(1, name);
+    RemoveTagNamed(&tagNodeId, typeKind, message->index);
+
+#ifdef DEBUG
+    printf("[OPC_UA] === AddVariableToOpcUaServer ===\n");
+    printf("[OPC_UA] Name: %s\n", name);
+    printf("[OPC_UA] Description: %s\n", description);
+    printf("[OPC_UA] TypeKind: %d\n", typeKind);
+    printf("[OPC_UA] AccessLevel: %d\n", *pAccessLevel);
+    printf("[OPC_UA] DeadbandValue: %f\n", message->deadbandValue);
+    printf("[OPC_UA] Value pointer: %p\n", pValue);
+    fflush(stdout);
+
+    switch (typeKind) {
+        case UA_DATATYPEKIND_BOOLEAN:
+            printf("[OPC_UA] Value (boolean): %d\n", *(UA_Boolean*)pValue);
+            break;
+        case UA_DATATYPEKIND_SBYTE:
+            printf("[OPC_UA] Value (sbyte): %d\n", *(UA_SByte*)pValue);
+            break;
+        case UA_DATATYPEKIND_BYTE:
+            printf("[OPC_UA] Value (byte): %u\n", *(UA_Byte*)pValue);
+            break;
+        case UA_DATATYPEKIND_INT16:
+            printf("[OPC_UA] Value (int16): %d\n", *(UA_Int16*)pValue);
+            break;
+        case UA_DATATYPEKIND_UINT16:
+            printf("[OPC_UA] Value (uint16): %u\n", *(UA_UInt16*)pValue);
+            break;
+        case UA_DATATYPEKIND_INT32:
+            printf("[OPC_UA] Value (int32): %d\n", *(UA_Int32*)pValue);
+            break;
+        case UA_DATATYPEKIND_UINT32:
+            printf("[OPC_UA] Value (uint32): %u\n", *(UA_UInt32*)pValue);
+            break;
+        case UA_DATATYPEKIND_INT64:
+            printf("[OPC_UA] Value (int64): %lld\n", *(UA_Int64*)pValue);
+            break;
+        case UA_DATATYPEKIND_UINT64:
+            printf("[OPC_UA] Value (uint64): %llu\n", *(UA_UInt64*)pValue);
+            break;
+        case UA_DATATYPEKIND_FLOAT:
+            printf("[OPC_UA] Value (float): %f\n", *(UA_Float*)pValue);
+            break;
+        case UA_DATATYPEKIND_DOUBLE:
+            printf("[OPC_UA] Value (double): %lf\n", *(UA_Double*)pValue);
+            break;
+        case UA_DATATYPEKIND_STRING:
+            printf("[OPC_UA] Value via pValue (string): %s\n", (char*)pValue);
+            printf("[OPC_UA] String length: %zu\n", strlen((char*)pValue));
+            break;
+        default:
+            printf("[OPC_UA] Value (unknown type)\n");
+            break;
+    }
+    printf("[OPC_UA] ===============================\n");
+    fflush(stdout);
+#endif
+
+    UA_VariableAttributes attr = UA_VariableAttributes_default;
+
+    if (typeKind == UA_DATATYPEKIND_STRING) {
+        UA_String srcString = UA_STRING((char *)pValue);
+
+        switch (CheckUaStringLength(&srcString)) {
+            case UA_STRING_ERROR:
+                break;
+            case UA_STRING_OVERFLOW:
+                memcpy(pValue, srcString.data, MAX_STRING_VALUE);
+                break;
+            case UA_STRING_OK:
+                break;
+        }
+
+        UA_Variant_setScalar(&attr.value, &srcString, &UA_TYPES[UA_TYPES_STRING]);
+    } else {
+        UA_Variant_setScalar(&attr.value, pValue, &UA_TYPES[typeKind]);
+    }
+
+    UA_NodeId parentNodeId;
+    const char *leaf;
+    if (ResolveTagParent(name, &parentNodeId, &leaf) != UA_STATUSCODE_GOOD) {
+        return;
+    }
+
+    attr.description = UA_LOCALIZEDTEXT("en-US", description);
+    attr.displayName = UA_LOCALIZEDTEXT("en-US", (char*)leaf);
+    attr.dataType = UA_TYPES[typeKind].typeId;
+    attr.accessLevel = *pAccessLevel;
+
+    /* Profile from MSG_TYPE_TAG_PROFILE, all zero (server defaults) when none was sent */
+    tag_entry_t *entry = LookupTagEntry(typeKind, message->index);
+    if (entry == NULL) {
+        return;
+    }
+
+    /* The ingress deadband comes from the profile only, the node starts from a fresh value */
+    __atomic_store_n(&entry->deadband_valid, 0, __ATOMIC_RELEASE);
+    UA_Boolean analog = IsNumericTypeKind(typeKind) && entry->deadband_type == UA_DEADBANDTYPE_PERCENT;
+    attr.minimumSamplingInterval = SamplingClassInterval[entry->sampling_class];
+
+    UA_NodeId newNodeId = UA_NODEID_STRING(1, name);
+    UA_NodeId parentReferenceNodeId = UA_NODEID_NUMERIC(0, UA_NS0ID_ORGANIZES);
+    UA_QualifiedName browseName = UA_QUALIFIEDNAME(1, (char*)leaf);
+    UA_NodeId typeDefinition = analog ? UA_NODEID_NUMERIC(0, UA_NS0ID_ANALOGITEMTYPE) : UA_NODEID_NULL;
+
+    /* Kept in the dense tables when the dense nodestore is in use, a no-op otherwise */
+    UA_Nodestore *nodestore = &UA_Server_getConfig(OpcUaServer)->nodestore;
+    dense_nodestore_claim(nodestore, TAG_NODE_CONTEXT(typeKind, message->index));
+    UA_StatusCode retval = UA_Server_addVariableNode(OpcUaServer, newNodeId, parentNodeId, parentReferenceNodeId, browseName, typeDefinition, attr, TAG_NODE_CONTEXT(typeKind, message->index), NULL);
+    dense_nodestore_claim(nodestore, NULL);
+
+    if (retval != UA_STATUSCODE_GOOD) {
+#ifdef DEBUG
+        printf("[OPC_UA] Failed to add variable node: %s\n", UA_StatusCode_name(retval));
+        fflush(stdout);
+#endif
+        return;
+    }
+
+    RegistrationStats.tags++;
+    RegisterTagEntry(typeKind, message->index, &newNodeId);
+
+    /* Clients' PercentDeadband filters are resolved against the EURange property */
+    if (analog) {
+        retval = UA_Server_writeObjectProperty_scalar(OpcUaServer, newNodeId, UA_QUALIFIEDNAME(0, "EURange"),
+                                                      &entry->eu_range, &UA_TYPES[UA_TYPES_RANGE]);
+#ifdef DEBUG
+        if (retval != UA_STATUSCODE_GOOD) {
+            printf("[OPC_UA] Failed to set EURange for %s: %s\n", name, UA_StatusCode_name(retval));
+            fflush(stdout);
+        }
+#endif
+    }
+
+    if (value_backend == VALUE_BACKEND_EXTERNAL) {
+        BindExternalValue(typeKind, message->index, &newNodeId, &attr.value);
+    }
+
+    AttachNotifyProbe(name, typeKind, message->index, entry);
+
+    /* Client writes are forwarded from the write path as soon as the Write service applies them */
+    if (*pAccessLevel == READWRITE && entry->backend == VALUE_BACKEND_INTERNAL) {
+        UA_ValueCallback callback = { NULL, ClientWriteCallback };
+        retval = UA_Server_setVariableNode_valueCallback(OpcUaServer, newNodeId, callback);
+#ifdef DEBUG
+        if (retval != UA_STATUSCODE_GOOD) {
+            printf("[OPC_UA] Failed to set write callback for %s: %s\n", name, UA_StatusCode_name(retval));
+        } else {
+            printf("[OPC_UA] Write forwarding enabled for variable: %s\n", name);
+        }
+        fflush(stdout);
+#endif
+    }
+}
+
+static uint16_t AddVariableBatchToOpcUaServer(uint8_t *buffer, ssize_t length) {
+    registration_batch_header_t *header = (registration_batch_header_t*)buffer;
+
+    if (length < (ssize_t)sizeof(registration_batch_header_t)) {
+        return 0;
+    }
+
+    uint8_t *cursor = buffer + sizeof(registration_batch_header_t);
+    uint8_t *end = buffer + length;
+    uint16_t added = 0;
+
+    for (uint16_t i = 0; i < header->count; i++) {
+        if (end - cursor < (ssize_t)sizeof(registration_record_t)) {
+            break;
+        }
+
+        registration_record_t *record = (registration_record_t*)cursor;
+        size_t payload = record->name_length + record->description_length + record->value_length;
+
+        if ((size_t)(end - cursor) < sizeof(registration_record_t) + payload ||
+            record->name_length >= MAX_NAME_LENGTH || record->description_length >= MAX_DESCRIPTION_LENGTH ||
+            record->value_length > MAX_DATA_SIZE) {
+            break;
+        }
+
+        /* Expand into the fixed layout so both frame types share one registration path */
+        variable_registration_t message;
+        memset(&message, 0, sizeof(message));
+
+        uint8_t *data = cursor + sizeof(registration_record_t);
+        message.message_type = MSG_TYPE_VARIABLE_REGISTRATION;
+        message.typeKind = record->typeKind;
+        message.access_level = record->access_level;
+        message.index = record->index;
+        message.NumberAcceptedParameters = record->NumberAcceptedParameters;
+        message.deadbandValue = record->deadbandValue;
+        memcpy(message.name, data, record->name_length);
+        data += record->name_length;
+        memcpy(message.description, data, record->description_length);
+        data += record->description_length;
+        memcpy(message.value, data, record->value_length);
+
+        AddVariableToOpcUaServer((char*)&message);
+        ActivateTagEntry(message.typeKind, message.index);
+        added++;
+
+        cursor += sizeof(registration_record_t) + payload;
+    }
+
+    RegistrationStats.frames++;
+
+#ifdef DEBUG
+    printf("[OPC_UA] Registration batch: %u of %u records decoded\n", added, header->count);
+    fflush(stdout);
+#endif
+
+    return added;
+}
+
+static array_entry_t *LookupArrayEntry(uint16_t index) {
+    if (OpcUaArrayTable.entries == NULL || index >= OpcUaArrayTable.size) {
+        return NULL;
+    }
+    return &OpcUaArrayTable.entries[index];
+}
+
+static int EnsureArrayTable(uint16_t size) {
+    if (OpcUaArrayTable.entries != NULL && size <= OpcUaArrayTable.size) {
+        return 0;
+    }
+
+    uint16_t oldSize = OpcUaArrayTable.entries != NULL ? OpcUaArrayTable.size : 0;
+    int result = 0;
+
+    pthread_mutex_lock(&tag_table_mutex);
+    array_entry_t *entries = realloc(OpcUaArrayTable.entries, size * sizeof(array_entry_t));
+    if (entries == NULL) {
+        result = -1;
+    } else {
+        memset(&entries[oldSize], 0, (size - oldSize) * sizeof(array_entry_t));
+        OpcUaArrayTable.entries = entries;
+        OpcUaArrayTable.size = size;
+    }
+    pthread_mutex_unlock(&tag_table_mutex);
+
+    return result;
+}
+
+static void RemoveArrayEntry(uint16_t index) {
+    array_entry_t *entry = LookupArrayEntry(index);
+    if (entry == NULL || entry->type == NULL) {
+        return;
+    }
+
+    UA_Server_deleteNode(OpcUaServer, entry->nodeId, true);
+    UA_NodeId_clear(&entry->nodeId);
+
+    pthread_mutex_lock(&tag_table_mutex);
+    uint8_t lane = entry->lane;
+    free(entry->assembly);
+    free(entry->egress);
+    memset(entry, 0, sizeof(array_entry_t));
+    entry->lane = lane;
+    pthread_mutex_unlock(&tag_table_mutex);
+}
+
+static void FreeArrayTable(void) {
+    for (uint16_t index = 0; index < OpcUaArrayTable.size; index++) {
+        array_entry_t *entry = &OpcUaArrayTable.entries[index];
+        UA_NodeId_clear(&entry->nodeId);
+        free(entry->assembly);
+        free(entry->egress);
+    }
+    free(OpcUaArrayTable.entries);
+    OpcUaArrayTable.entries = NULL;
+    OpcUaArrayTable.size = 0;
+}
+
+/* Wire layout -> variant without copying numeric data; strings need a UA_String per element */
+static UA_StatusCode ArrayVariant(array_entry_t *entry, uint8_t *data, UA_Variant *value, UA_String **strings) {
+    void *elements = data;
+
+    *strings = NULL;
+    if (entry->typeKind == UA_DATATYPEKIND_STRING) {
+        *strings = calloc(entry->elements, sizeof(UA_String));
+        if (*strings == NULL) {
+            return UA_STATUSCODE_BADOUTOFMEMORY;
+        }
+        for (uint32_t i = 0; i < entry->elements; i++) {
+            char *chars = (char*)data + (size_t)i * MAX_DATA_SIZE;
+            (*strings)[i].length = strnlen(chars, MAX_DATA_SIZE);
+            (*strings)[i].data = (UA_Byte*)chars;
+        }
+        elements = *strings;
+    }
+
+    UA_Variant_setArray(value, elements, entry->elements, entry->type);
+    if (entry->valueRank > 1) {
+        value->arrayDimensionsSize = entry->valueRank;
+        value->arrayDimensions = entry->arrayDimensions;
+    }
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Strings: everything after the terminator is zeroed, no stale characters reach either side */
+static void NormalizeArrayStrings(array_entry_t *entry, uint8_t *data) {
+    if (entry->typeKind != UA_DATATYPEKIND_STRING) {
+        return;
+    }
+    for (uint32_t i = 0; i < entry->elements; i++) {
+        char *chars = (char*)data + (size_t)i * MAX_DATA_SIZE;
+        size_t length = strnlen(chars, MAX_DATA_SIZE - 1);
+        memset(chars + length, 0, MAX_DATA_SIZE - length);
+    }
+}
+
+/* Server thread, or the receive thread in direct mode: one node write per reassembled value */
+static void ApplyArrayValue(uint16_t index, uint8_t *data, uint32_t length) {
+    UA_Variant value;
+    UA_String *strings;
+
+    pthread_mutex_lock(&tag_table_mutex);
+    array_entry_t *entry = LookupArrayEntry(index);
+
+    /* Registered again with another shape since the value was queued */
+    if (entry == NULL || entry->type == NULL || length != entry->elements * entry->elem_size) {
+        ArrayStats.aborted++;
+        pthread_mutex_unlock(&tag_table_mutex);
+        return;
+    }
+
+    NormalizeArrayStrings(entry, data);
+    if (ArrayVariant(entry, data, &value, &strings) == UA_STATUSCODE_GOOD) {
+        UA_Server_writeValue(OpcUaServer, entry->nodeId, value);
+        free(strings);
+        ArrayStats.updates++;
+    }
+    pthread_mutex_unlock(&tag_table_mutex);
+}
+
+static void WriteArrayChunk(uint8_t *buffer, ssize_t length) {
+    array_chunk_header_t *header = (array_chunk_header_t*)buffer;
+
+    if (length < (ssize_t)sizeof(array_chunk_header_t) ||
+        length != (ssize_t)(sizeof(array_chunk_header_t) + header->length)) {
+        return;
+    }
+
+    array_entry_t *entry = LookupArrayEntry(header->index);
+    if (entry == NULL || entry->type == NULL || header->total != entry->elements * entry->elem_size) {
+        return;
+    }
+
+    /* Chunks of a value arrive in order on the queue, anything else abandons the value */
+    if (header->offset == 0) {
+        if (entry->assembling) {
+            ArrayStats.aborted++;
+        }
+        entry->assembling = 1;
+        entry->update = header->update;
+        entry->received = 0;
+    } else if (!entry->assembling || header->update != entry->update || header->offset != entry->received) {
+        if (entry->assembling) {
+            ArrayStats.aborted++;
+        }
+        entry->assembling = 0;
+        return;
+    }
+
+    if ((uint64_t)header->offset + header->length > header->total) {
+        ArrayStats.aborted++;
+        entry->assembling = 0;
+        return;
+    }
+
+    memcpy(entry->assembly + header->offset, buffer + sizeof(array_chunk_header_t), header->length);
+    entry->received += header->length;
+    ArrayStats.chunks++;
+
+    if (entry->received == header->total) {
+        entry->assembling = 0;
+
+        /* The assembly buffer takes the next value while this one waits for the server thread */
+        uint8_t *copy = malloc(header->total);
+        if (copy == NULL) {
+            ArrayStats.aborted++;
+            return;
+        }
+        memcpy(copy, entry->assembly, header->total);
+        IngressWriteBulk(ApplyArrayValue, header->index, copy, header->total, entry->lane);
+    }
+}
+
+/* Server thread: a client wrote the array, queue it for CODESYS as one chunked update */
+static void ForwardArrayChange(uint16_t index, const UA_DataValue *value) {
+    array_entry_t *entry = LookupArrayEntry(index);
+
+    if (registration_active || entry == NULL || entry->type == NULL || entry->egress == NULL ||
+        value->value.type != entry->type || value->value.arrayLength != entry->elements) {
+        return;
+    }
+
+    size_t total = (size_t)entry->elements * entry->elem_size;
+    if (entry->typeKind == UA_DATATYPEKIND_STRING) {
+        const UA_String *strings = (const UA_String*)value->value.data;
+        memset(entry->egress, 0, total);
+        for (uint32_t i = 0; i < entry->elements; i++) {
+            size_t copy_len = strings[i].length < MAX_DATA_SIZE ? strings[i].length : MAX_DATA_SIZE - 1;
+            if (strings[i].data) {
+                memcpy(entry->egress + (size_t)i * MAX_DATA_SIZE, strings[i].data, copy_len);
+            }
+        }
+        NormalizeArrayStrings(entry, entry->egress);
+    } else {
+        memcpy(entry->egress, value->value.data, total);
+    }
+
+    RecordClientWriteLatency(value);
+
+    /* A value still being chunked restarts under the new update, CODESYS drops the partial one */
+    entry->egress_update++;
+    entry->egress_sent = 0;
+    if (!entry->egress_pending) {
+        entry->egress_since = MonotonicNs();
+    }
+    if (EgressBulkEnqueue(EGRESS_BULK_ARRAY, index, entry->lane, &entry->egress_pending) != 0) {
+        ArrayStats.egress_dropped++;
+    }
+}
+
+static void ArrayWriteCallback(UA_Server *server, const UA_NodeId *sessionId, void *sessionContext, const UA_NodeId *nodeId, void *nodeContext, const UA_NumericRange *range, const UA_DataValue *data) {
+    if (IsGatewayWrite(sessionId) || !data || !data->hasValue || UA_Variant_isScalar(&data->value)) {
+        return;
+    }
+
+    pthread_mutex_lock(&tag_table_mutex);
+    /* The callback only sees the written range, CODESYS always gets whole values */
+    if (range != NULL) {
+        ArrayStats.egress_dropped++;
+    } else {
+        ForwardArrayChange(TAG_NODE_CONTEXT_INDEX(nodeContext), data);
+    }
+    pthread_mutex_unlock(&tag_table_mutex);
+}
+
+static void AddArrayVariableToOpcUaServer(uint8_t *buffer, ssize_t length) {
+    array_registration_t *message = (array_registration_t*)buffer;
+    uint64_t elements = 1;
+
+    if (length != sizeof(array_registration_t) || message->typeKind >= TAG_TYPE_KIND_COUNT ||
+        message->valueRank < 1 || message->valueRank > ARRAY_MAX_DIMENSIONS) {
+        return;
+    }
+    for (uint8_t d = 0; d < message->valueRank; d++) {
+        elements *= message->arrayDimensions[d];
+    }
+    if (elements == 0 || elements > ARRAY_MAX_ELEMENTS) {
+        return;
+    }
+
+    if (EnsureArrayTable(message->index + 1) != 0) {
+        return;
+    }
+    RemoveArrayEntry(message->index);
+
+    array_entry_t *entry = LookupArrayEntry(message->index);
+    uint8_t typeKind = message->typeKind;
+    uint32_t elem_size = (typeKind == UA_DATATYPEKIND_STRING) ? MAX_DATA_SIZE : UA_TYPES[typeKind].memSize;
+    size_t total = (size_t)elements * elem_size;
+
+    entry->assembly = calloc(1, total);
+    entry->egress = calloc(1, total);
+    if (entry->assembly == NULL || entry->egress == NULL) {
+        free(entry->assembly);
+        free(entry->egress);
+        entry->assembly = NULL;
+        entry->egress = NULL;
+        return;
+    }
+
+    entry->typeKind = typeKind;
+    entry->type = &UA_TYPES[typeKind];
+    entry->valueRank = message->valueRank;
+    entry->elements = (uint32_t)elements;
+    entry->elem_size = elem_size;
+    for (uint8_t d = 0; d < message->valueRank; d++) {
+        entry->arrayDimensions[d] = message->arrayDimensions[d];
+    }
+
+    char name[MAX_NAME_LENGTH];
+    char description[MAX_DESCRIPTION_LENGTH];
+    strncpy(name, message->name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    strncpy(description, message->description, sizeof(description) - 1);
+    description[sizeof(description) - 1] = '\0';
+
+    UA_VariableAttributes attr = UA_VariableAttributes_default;
+    UA_String *strings;
+    if (ArrayVariant(entry, entry->assembly, &attr.value, &strings) != UA_STATUSCODE_GOOD) {
+        return;
+    }
+    attr.valueRank = entry->valueRank;
+    attr.arrayDimensionsSize = entry->valueRank;
+    attr.arrayDimensions = entry->arrayDimensions;
+
+    UA_NodeId parentNodeId;
+    const char *leaf;
+    UA_StatusCode retval = ResolveTagParent(name, &parentNodeId, &leaf);
+
+    attr.description = UA_LOCALIZEDTEXT("en-US", description);
+    attr.displayName = UA_LOCALIZEDTEXT("en-US", (char*)leaf);
+    attr.dataType = entry->type->typeId;
+    attr.accessLevel = message->access_level;
+
+    UA_NodeId newNodeId = UA_NODEID_STRING(1, name);
+    if (retval == UA_STATUSCODE_GOOD) {
+        retval = UA_Server_addVariableNode(OpcUaServer, newNodeId, parentNodeId,
+                                           UA_NODEID_NUMERIC(0, UA_NS0ID_ORGANIZES), UA_QUALIFIEDNAME(1, (char*)leaf),
+                                           UA_NODEID_NULL, attr, TAG_NODE_CONTEXT(typeKind, message->index), NULL);
+    }
+    free(strings);
+
+    if (retval != UA_STATUSCODE_GOOD || UA_NodeId_copy(&newNodeId, &entry->nodeId) != UA_STATUSCODE_GOOD) {
+#ifdef DEBUG
+        printf("[OPC_UA] Failed to add array node %s: %s\n", name, UA_StatusCode_name(retval));
+        fflush(stdout);
+#endif
+        uint8_t lane = entry->lane;
+        free(entry->assembly);
+        free(entry->egress);
+        memset(entry, 0, sizeof(array_entry_t));
+        entry->lane = lane;
+        return;
+    }
+
+    RegistrationStats.tags++;
+
+    if (message->access_level == READWRITE) {
+        UA_ValueCallback callback = { NULL, ArrayWriteCallback };
+        UA_Server_setVariableNode_valueCallback(OpcUaServer, newNodeId, callback);
+    }
+
+#ifdef DEBUG
+    printf("[OPC_UA] Array %s: type %u, rank %u, %u elements, %zu bytes\n",
+           name, typeKind, entry->valueRank, entry->elements, total);
+    fflush(stdout);
+#endif
+}
+
+static struct_entry_t *LookupStructEntry(uint16_t index) {
+    if (OpcUaStructTable.entries == NULL || index >= OpcUaStructTable.size) {
+        return NULL;
+    }
+    return &OpcUaStructTable.entries[index];
+}
+
+static struct_type_t *LookupStructType(uint16_t type_index) {
+    if (OpcUaStructTable.types == NULL || type_index >= OpcUaStructTable.types_size) {
+        return NULL;
+    }
+    return OpcUaStructTable.types[type_index];
+}
+
+static int EnsureStructTable(uint16_t types_size, uint16_t size) {
+    int result = 0;
+
+    pthread_mutex_lock(&tag_table_mutex);
+    if (types_size > OpcUaStructTable.types_size) {
+        struct_type_t **types = realloc(OpcUaStructTable.types, types_size * sizeof(struct_type_t*));
+        if (types == NULL) {
+            result = -1;
+        } else {
+            memset(&types[OpcUaStructTable.types_size], 0, (types_size - OpcUaStructTable.types_size) * sizeof(struct_type_t*));
+            OpcUaStructTable.types = types;
+            OpcUaStructTable.types_size = types_size;
+        }
+    }
+    if (result == 0 && size > OpcUaStructTable.size) {
+        struct_entry_t *entries = realloc(OpcUaStructTable.entries, size * sizeof(struct_entry_t));
+        if (entries == NULL) {
+            result = -1;
+        } else {
+            memset(&entries[OpcUaStructTable.size], 0, (size - OpcUaStructTable.size) * sizeof(struct_entry_t));
+            OpcUaStructTable.entries = entries;
+            OpcUaStructTable.size = size;
+        }
+    }
+    pthread_mutex_unlock(&tag_table_mutex);
+
+    return result;
+}
+
+static void RemoveStructEntry(uint16_t index) {
+    struct_entry_t *entry = LookupStructEntry(index);
+    if (entry == NULL || entry->type == NULL) {
+        return;
+    }
+
+    UA_Server_deleteNode(OpcUaServer, entry->nodeId, true);
+    UA_NodeId_clear(&entry->nodeId);
+
+    pthread_mutex_lock(&tag_table_mutex);
+    uint8_t lane = entry->lane;
+    free(entry->egress);
+    memset(entry, 0, sizeof(struct_entry_t));
+    entry->lane = lane;
+    pthread_mutex_unlock(&tag_table_mutex);
+}
+
+static void FreeStructTable(void) {
+    for (uint16_t index = 0; index < OpcUaStructTable.size; index++) {
+        UA_NodeId_clear(&OpcUaStructTable.entries[index].nodeId);
+        free(OpcUaStructTable.entries[index].egress);
+    }
+    free(OpcUaStructTable.entries);
+    OpcUaStructTable.entries = NULL;
+    OpcUaStructTable.size = 0;
+}
+
+/* After UA_Server_delete only, the server config links the custom types until then */
+static void FreeStructTypes(void) {
+    for (uint16_t type_index = 0; type_index < OpcUaStructTable.types_size; type_index++) {
+        struct_type_t *type = OpcUaStructTable.types[type_index];
+        if (type != NULL) {
+            free(type->custom);
+            free(type);
+        }
+    }
+    free(OpcUaStructTable.types);
+    OpcUaStructTable.types = NULL;
+    OpcUaStructTable.types_size = 0;
+}
+
+/* PLC image with padding and string tails zeroed, strings are terminated within their slot */
+static void StructCanonicalImage(const struct_type_t *type, const uint8_t *image, uint8_t *canonical) {
+    memset(canonical, 0, type->image_size);
+    for (uint8_t i = 0; i < type->type.membersSize; i++) {
+        const UA_DataType *member = type->members[i].memberType;
+        uint16_t offset = type->image_offset[i];
+
+        if (member->typeKind == UA_DATATYPEKIND_STRING) {
+            memcpy(canonical + offset, image + offset, strnlen((const char*)image + offset, MAX_DATA_SIZE - 1));
+        } else {
+            memcpy(canonical + offset, image + offset, member->memSize);
+        }
+    }
+}
+
+/* Canonical PLC image -> open62541 layout, strings point into the image */
+static void StructDecode(const struct_type_t *type, uint8_t *image, uint8_t *mem) {
+    memset(mem, 0, type->type.memSize);
+    for (uint8_t i = 0; i < type->type.membersSize; i++) {
+        const UA_DataType *member = type->members[i].memberType;
+        uint8_t *field = image + type->image_offset[i];
+
+        if (member->typeKind == UA_DATATYPEKIND_STRING) {
+            UA_String *string = (UA_String*)(mem + type->mem_offset[i]);
+            string->length = strlen((const char*)field);
+            string->data = string->length > 0 ? field : NULL;
+        } else {
+            memcpy(mem + type->mem_offset[i], field, member->memSize);
+        }
+    }
+}
 
-    char *nodeIdStr = message->name;
-    uint8_t *newValue = message->value;
+static void StructEncode(const struct_type_t *type, const uint8_t *mem, uint8_t *image) {
+    memset(image, 0, type->image_size);
+    for (uint8_t i = 0; i < type->type.membersSize; i++) {
+        const UA_DataType *member = type->members[i].memberType;
+        uint8_t *field = image + type->image_offset[i];
 
-    if (!nodeIdStr || !newValue) {
-        return UA_STATUSCODE_BADINVALIDARGUMENT;
+        if (member->typeKind == UA_DATATYPEKIND_STRING) {
+            const UA_String *string = (const UA_String*)(mem + type->mem_offset[i]);
+            size_t copy_len = string->length < MAX_DATA_SIZE ? string->length : MAX_DATA_SIZE - 1;
+            if (string->data) {
+                memcpy(field, string->data, copy_len);
+            }
+        } else {
+            memcpy(field, mem + type->mem_offset[i], member->memSize);
+        }
+    }
+}
+
+static void AddStructTypeToOpcUaServer(uint8_t *buffer, ssize_t length) {
+    struct_type_registration_t *message = (struct_type_registration_t*)buffer;
+
+    if (length != sizeof(struct_type_registration_t) || message->field_count == 0 ||
+        message->field_count > STRUCT_MAX_FIELDS || message->size > STRUCT_MAX_IMAGE_SIZE) {
+        return;
+    }
+    if (EnsureStructTable(message->type_index + 1, 0) != 0) {
+        return;
+    }
+
+    char name[MAX_NAME_LENGTH];
+    strncpy(name, message->name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+
+    /* Nodes and values keep pointers to the type, a layout stays fixed while the server runs */
+    struct_type_t *existing = LookupStructType(message->type_index);
+    if (existing != NULL) {
+#ifdef DEBUG
+        if (strcmp(existing->name, name) != 0) {
+            printf("[OPC_UA] Struct type %u is already registered as %s\n", message->type_index, existing->name);
+            fflush(stdout);
+        }
+#endif
+        return;
+    }
+
+    struct_type_t *type = calloc(1, sizeof(struct_type_t));
+    if (type == NULL) {
+        return;
+    }
+    memcpy(type->name, name, sizeof(name));
+    snprintf(type->type_id, sizeof(type->type_id), "DataType.%s", name);
+    snprintf(type->encoding_id, sizeof(type->encoding_id), "DataType.%s.DefaultBinary", name);
+    type->image_size = message->size;
+
+    /* Natural alignment, the same layout a C compiler gives the equivalent struct */
+    size_t end = 0;
+    size_t max_align = 1;
+    UA_Boolean pointerFree = true;
+    for (uint8_t i = 0; i < message->field_count; i++) {
+        struct_field_t *field = &message->fields[i];
+        if (field->typeKind >= TAG_TYPE_KIND_COUNT) {
+            free(type);
+            return;
+        }
+
+        const UA_DataType *member = &UA_TYPES[field->typeKind];
+        size_t image_size = (field->typeKind == UA_DATATYPEKIND_STRING) ? MAX_DATA_SIZE : member->memSize;
+        size_t align = (field->typeKind == UA_DATATYPEKIND_STRING) ? sizeof(void*) : member->memSize;
+        if ((size_t)field->offset + image_size > message->size) {
+            free(type);
+            return;
+        }
+
+        size_t offset = (end + align - 1) & ~(align - 1);
+        strncpy(type->member_names[i], field->name, MAX_NAME_LENGTH - 1);
+        type->members[i].memberName = type->member_names[i];
+        type->members[i].memberType = member;
+        type->members[i].padding = offset - end;
+        type->image_offset[i] = field->offset;
+        type->mem_offset[i] = offset;
+
+        end = offset + member->memSize;
+        if (align > max_align) {
+            max_align = align;
+        }
+        pointerFree = pointerFree && member->pointerFree;
+    }
+
+    type->type.typeName = type->name;
+    type->type.typeId = UA_NODEID_STRING(1, type->type_id);
+    type->type.binaryEncodingId = UA_NODEID_STRING(1, type->encoding_id);
+    type->type.xmlEncodingId = UA_NODEID_NULL;
+    type->type.memSize = (end + max_align - 1) & ~(max_align - 1);
+    type->type.typeKind = UA_DATATYPEKIND_STRUCTURE;
+    type->type.pointerFree = pointerFree;
+    type->type.overlayable = false;
+    type->type.membersSize = message->field_count;
+    type->type.members = type->members;
+
+    UA_DataTypeAttributes attr = UA_DataTypeAttributes_default;
+    attr.displayName = UA_LOCALIZEDTEXT("en-US", name);
+    UA_StatusCode retval = UA_Server_addDataTypeNode(OpcUaServer, type->type.typeId, UA_NODEID_NUMERIC(0, UA_NS0ID_STRUCTURE),
+                                                     UA_NODEID_NUMERIC(0, UA_NS0ID_HASSUBTYPE), UA_QUALIFIEDNAME(1, name),
+                                                     attr, NULL, NULL);
+
+    /* Clients find the binary encoding through the DataType node */
+    if (retval == UA_STATUSCODE_GOOD) {
+        UA_ObjectAttributes encoding = UA_ObjectAttributes_default;
+        encoding.displayName = UA_LOCALIZEDTEXT("", "Default Binary");
+        retval = UA_Server_addObjectNode(OpcUaServer, type->type.binaryEncodingId, UA_NODEID_NULL, UA_NODEID_NULL,
+                                         UA_QUALIFIEDNAME(0, "Default Binary"), UA_NODEID_NUMERIC(0, UA_NS0ID_DATATYPEENCODINGTYPE),
+                                         encoding, NULL, NULL);
+    }
+    if (retval == UA_STATUSCODE_GOOD) {
+        retval = UA_Server_addReference(OpcUaServer, type->type.typeId, UA_NODEID_NUMERIC(0, UA_NS0ID_HASENCODING),
+                                        UA_EXPANDEDNODEID_NODEID(type->type.binaryEncodingId), true);
+    }
+
+    UA_DataTypeArray custom = {
+        UA_Server_getConfig(OpcUaServer)->customDataTypes, 1, &type->type, false
+    };
+    type->custom = malloc(sizeof(UA_DataTypeArray));
+
+    if (retval != UA_STATUSCODE_GOOD || type->custom == NULL) {
+#ifdef DEBUG
+        printf("[OPC_UA] Failed to add struct type %s: %s\n", name, UA_StatusCode_name(retval));
+        fflush(stdout);
+#endif
+        UA_Server_deleteNode(OpcUaServer, type->type.binaryEncodingId, true);
+        UA_Server_deleteNode(OpcUaServer, type->type.typeId, true);
+        free(type->custom);
+        free(type);
+        return;
+    }
+
+    /* Prepended while the server thread may walk the list, the entry is complete before it is linked */
+    memcpy(type->custom, &custom, sizeof(UA_DataTypeArray));
+    __atomic_store_n(&UA_Server_getConfig(OpcUaServer)->customDataTypes, type->custom, __ATOMIC_RELEASE);
+    OpcUaStructTable.types[message->type_index] = type;
+
+#ifdef DEBUG
+    printf("[OPC_UA] Struct type %s: %u fields, %u bytes in the PLC, %u in memory\n",
+           name, message->field_count, type->image_size, (unsigned)type->type.memSize);
+    fflush(stdout);
+#endif
+}
+
+/* Server thread, or the receive thread in direct mode: the PLC image as one node write */
+static void ApplyStructValue(uint16_t index, uint8_t *data, uint32_t length) {
+    uint8_t canonical[STRUCT_MAX_IMAGE_SIZE];
+    UA_UInt64 mem[STRUCT_MAX_MEM_SIZE / sizeof(UA_UInt64)];
+
+    pthread_mutex_lock(&tag_table_mutex);
+    struct_entry_t *entry = LookupStructEntry(index);
+
+    /* Registered again under another type since the image was queued */
+    if (entry == NULL || entry->type == NULL || length != entry->type->image_size) {
+        StructStats.rejected++;
+        pthread_mutex_unlock(&tag_table_mutex);
+        return;
+    }
+
+    StructCanonicalImage(entry->type, data, canonical);
+    StructDecode(entry->type, canonical, (uint8_t*)mem);
+
+    UA_Variant value;
+    UA_Variant_setScalar(&value, mem, &entry->type->type);
+
+    UA_Server_writeValue(OpcUaServer, entry->nodeId, value);
+
+    StructStats.updates++;
+    pthread_mutex_unlock(&tag_table_mutex);
+}
+
+static void WriteStructValue(uint8_t *buffer, ssize_t length) {
+    struct_write_header_t *header = (struct_write_header_t*)buffer;
+
+    if (length < (ssize_t)sizeof(struct_write_header_t) ||
+        length != (ssize_t)(sizeof(struct_write_header_t) + header->length)) {
+        return;
+    }
+
+    struct_entry_t *entry = LookupStructEntry(header->index);
+    if (entry == NULL || entry->type == NULL || header->length != entry->type->image_size) {
+        StructStats.rejected++;
+        return;
+    }
+
+    uint8_t *copy = malloc(header->length);
+    if (copy == NULL) {
+        StructStats.rejected++;
+        return;
+    }
+    memcpy(copy, buffer + sizeof(struct_write_header_t), header->length);
+    IngressWriteBulk(ApplyStructValue, header->index, copy, header->length, entry->lane);
+}
+
+/* Server thread: a client wrote the structure, queue the whole PLC image for CODESYS */
+static void ForwardStructChange(uint16_t index, const UA_DataValue *value) {
+    struct_entry_t *entry = LookupStructEntry(index);
+
+    if (registration_active || entry == NULL || entry->type == NULL || entry->egress == NULL || !UA_Variant_isScalar(&value->value) ||
+        value->value.type == NULL || !UA_NodeId_equal(&value->value.type->typeId, &entry->type->type.typeId)) {
+        return;
+    }
+
+    StructEncode(entry->type, (const uint8_t*)value->value.data, entry->egress);
+    RecordClientWriteLatency(value);
+
+    if (!entry->egress_pending) {
+        entry->egress_since = MonotonicNs();
+    }
+    if (EgressBulkEnqueue(EGRESS_BULK_STRUCT, index, entry->lane, &entry->egress_pending) != 0) {
+        StructStats.egress_dropped++;
+    }
+}
+
+static void StructWriteCallback(UA_Server *server, const UA_NodeId *sessionId, void *sessionContext, const UA_NodeId *nodeId, void *nodeContext, const UA_NumericRange *range, const UA_DataValue *data) {
+    if (IsGatewayWrite(sessionId) || range != NULL || !data || !data->hasValue) {
+        return;
+    }
+
+    pthread_mutex_lock(&tag_table_mutex);
+    ForwardStructChange(TAG_NODE_CONTEXT_INDEX(nodeContext), data);
+    pthread_mutex_unlock(&tag_table_mutex);
+}
+
+static void AddStructVariableToOpcUaServer(uint8_t *buffer, ssize_t length) {
+    struct_registration_t *message = (struct_registration_t*)buffer;
+
+    if (length != sizeof(struct_registration_t)) {
+        return;
+    }
+
+    struct_type_t *type = LookupStructType(message->type_index);
+    if (type == NULL || EnsureStructTable(0, message->index + 1) != 0) {
+        return;
+    }
+    RemoveStructEntry(message->index);
+
+    char name[MAX_NAME_LENGTH];
+    char description[MAX_DESCRIPTION_LENGTH];
+    strncpy(name, message->name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    strncpy(description, message->description, sizeof(description) - 1);
+    description[sizeof(description) - 1] = '\0';
+
+    uint8_t canonical[STRUCT_MAX_IMAGE_SIZE] = {0};
+    UA_UInt64 mem[STRUCT_MAX_MEM_SIZE / sizeof(UA_UInt64)];
+    StructDecode(type, canonical, (uint8_t*)mem);
+
+    UA_VariableAttributes attr = UA_VariableAttributes_default;
+    UA_Variant_setScalar(&attr.value, mem, &type->type);
+
+    UA_NodeId parentNodeId;
+    const char *leaf;
+    if (ResolveTagParent(name, &parentNodeId, &leaf) != UA_STATUSCODE_GOOD) {
+        return;
+    }
+
+    attr.description = UA_LOCALIZEDTEXT("en-US", description);
+    attr.displayName = UA_LOCALIZEDTEXT("en-US", (char*)leaf);
+    attr.dataType = type->type.typeId;
+    attr.accessLevel = message->access_level;
+
+    struct_entry_t *entry = LookupStructEntry(message->index);
+    uint8_t *egress = calloc(1, type->image_size);
+    if (egress == NULL) {
+        return;
+    }
+
+    UA_NodeId newNodeId = UA_NODEID_STRING(1, name);
+    UA_StatusCode retval = UA_Server_addVariableNode(OpcUaServer, newNodeId, parentNodeId,
+                                                     UA_NODEID_NUMERIC(0, UA_NS0ID_ORGANIZES), UA_QUALIFIEDNAME(1, (char*)leaf),
+                                                     UA_NODEID_NULL, attr, TAG_NODE_CONTEXT(UA_DATATYPEKIND_STRUCTURE, message->index), NULL);
+
+    if (retval != UA_STATUSCODE_GOOD || UA_NodeId_copy(&newNodeId, &entry->nodeId) != UA_STATUSCODE_GOOD) {
+#ifdef DEBUG
+        printf("[OPC_UA] Failed to add struct node %s: %s\n", name, UA_StatusCode_name(retval));
+        fflush(stdout);
+#endif
+        free(egress);
+        return;
+    }
+
+    pthread_mutex_lock(&tag_table_mutex);
+    entry->type = type;
+    entry->egress = egress;
+    pthread_mutex_unlock(&tag_table_mutex);
+    RegistrationStats.tags++;
+
+    if (message->access_level == READWRITE) {
+        UA_ValueCallback callback = { NULL, StructWriteCallback };
+        UA_Server_setVariableNode_valueCallback(OpcUaServer, newNodeId, callback);
+    }
+}
+
+static void ApplyTagProfiles(uint8_t *buffer, ssize_t length) {
+    tag_list_header_t *header = (tag_list_header_t*)buffer;
+
+    if (length < (ssize_t)sizeof(tag_list_header_t) ||
+        length != (ssize_t)(sizeof(tag_list_header_t) + header->count * sizeof(tag_profile_t))) {
+        return;
+    }
+
+    tag_profile_t *records = (tag_profile_t*)(buffer + sizeof(tag_list_header_t));
+
+    for (uint16_t i = 0; i < header->count; i++) {
+        tag_profile_t *profile = &records[i];
+
+        if (profile->typeKind == TAG_PROFILE_ARRAY || profile->typeKind == TAG_PROFILE_STRUCT) {
+            if (profile->criticality >= LANE_COUNT) {
+                continue;
+            }
+            if (profile->typeKind == TAG_PROFILE_ARRAY) {
+                array_entry_t *array = EnsureArrayTable(profile->index + 1) == 0 ? LookupArrayEntry(profile->index) : NULL;
+                if (array != NULL) {
+                    array->lane = profile->criticality;
+                }
+            } else {
+                struct_entry_t *instance = EnsureStructTable(0, profile->index + 1) == 0 ? LookupStructEntry(profile->index) : NULL;
+                if (instance != NULL) {
+                    instance->lane = profile->criticality;
+                }
+            }
+            continue;
+        }
+
+        if (profile->sampling_class >= SAMPLING_CLASS_COUNT || profile->deadband_type > UA_DEADBANDTYPE_PERCENT ||
+            profile->criticality >= LANE_COUNT || profile->ingress_deadband > UA_DEADBANDTYPE_PERCENT ||
+            (profile->deadband_type == UA_DEADBANDTYPE_PERCENT && !(profile->eu_high > profile->eu_low)) ||
+            (profile->ingress_deadband == UA_DEADBANDTYPE_PERCENT && !(profile->eu_high > profile->eu_low)) ||
+            EnsureTagTable(profile->typeKind, profile->index + 1) != 0) {
+            continue;
+        }
+
+        tag_entry_t *entry = LookupTagEntry(profile->typeKind, profile->index);
+        entry->sampling_class = profile->sampling_class;
+        entry->deadband_type = profile->deadband_type;
+        entry->queue_size = profile->queue_size;
+        entry->eu_range.low = profile->eu_low;
+        entry->eu_range.high = profile->eu_high;
+        entry->lane = profile->criticality;
+        entry->ingress_deadband = profile->ingress_deadband;
+        entry->deadband_value = profile->ingress_deadband_value;
+        __atomic_store_n(&entry->deadband_valid, 0, __ATOMIC_RELEASE);
+
+        /* A registered node takes the new interval now, the node type changes on re-registration */
+        if (entry->type != NULL) {
+            UA_Server_writeMinimumSamplingInterval(OpcUaServer, entry->nodeId, SamplingClassInterval[entry->sampling_class]);
+        }
+
+        /* The server negotiates queue sizes per subscription, not per node: raise the limit only */
+        if (profile->queue_size > __atomic_load_n(&profile_queue_size_max, __ATOMIC_RELAXED)) {
+            __atomic_store_n(&profile_queue_size_max, profile->queue_size, __ATOMIC_RELAXED);
+        }
+    }
+
+#ifdef DEBUG
+    printf("[OPC_UA] Tag profiles: %u\n", header->count);
+    fflush(stdout);
+#endif
+}
+
+static void FreeTagTable(void) {
+    for (int typeKind = 0; typeKind < TAG_TYPE_KIND_COUNT; typeKind++) {
+        for (uint16_t index = 0; index < OpcUaTagTable[typeKind].size; index++) {
+            UA_NodeId_clear(&OpcUaTagTable[typeKind].entries[index].nodeId);
+        }
+        free(OpcUaTagTable[typeKind].entries);
+        free(OpcUaTagTable[typeKind].egress);
+        OpcUaTagTable[typeKind].entries = NULL;
+        OpcUaTagTable[typeKind].egress = NULL;
+        OpcUaTagTable[typeKind].size = 0;
+    }
+}
+
+/* Server with the nodestore selected by -n, the rest of the configuration is the default */
+static UA_Server *NewOpcUaServer(void) {
+    UA_ServerConfig config;
+    memset(&config, 0, sizeof(config));
+
+    if (nodestore_kind == NODESTORE_ZIPTREE) {
+        if (UA_Nodestore_ZipTree(&config.nodestore) != UA_STATUSCODE_GOOD) {
+            return NULL;
+        }
+    } else if (nodestore_kind == NODESTORE_DENSE) {
+        UA_Nodestore inner;
+        if (UA_Nodestore_HashMap(&inner) != UA_STATUSCODE_GOOD) {
+            return NULL;
+        }
+        if (dense_nodestore_init(&config.nodestore, &inner, GATEWAY_NAMESPACE) != UA_STATUSCODE_GOOD) {
+            inner.clear(inner.context);
+            return NULL;
+        }
+    }
+
+    /* An empty nodestore is filled with the HashMap default */
+    UA_ServerConfig_setDefault(&config);
+    return UA_Server_newWithConfig(&config);
+}
+
+/* Mean time of a Browse on `nodeId` over all its hierarchical children, and their count */
+static double BrowseLatencyMs(const UA_NodeId *nodeId, size_t *references) {
+    UA_BrowseDescription description;
+    UA_BrowseDescription_init(&description);
+    description.nodeId = *nodeId;
+    description.browseDirection = UA_BROWSEDIRECTION_FORWARD;
+    description.referenceTypeId = UA_NODEID_NUMERIC(0, UA_NS0ID_HIERARCHICALREFERENCES);
+    description.includeSubtypes = true;
+    description.resultMask = UA_BROWSERESULTMASK_ALL;
+
+    uint64_t start = MonotonicNs();
+    for (int i = 0; i < ADDRESS_BENCHMARK_BROWSES; i++) {
+        UA_BrowseResult result = UA_Server_browse(OpcUaServer, 0, &description);
+        *references = result.referencesSize;
+        UA_BrowseResult_clear(&result);
+    }
+    return (MonotonicNs() - start) / 1e6 / ADDRESS_BENCHMARK_BROWSES;
+}
+
+static UA_Server *NewBenchmarkServer(void) {
+    UA_Server *server = NewOpcUaServer();
+
+    if (server) {
+        UA_Server_getConfig(server)->logging->context = (void*)(uintptr_t)UA_LOGLEVEL_FATAL;
+    }
+    return server;
+}
+
+/* Tag i of the benchmarks: lists of 50 motors with 10 variables each */
+static void BenchmarkTagName(uint32_t i, char *name, size_t size) {
+    snprintf(name, size, "App.GVL%03u.M%03u.V%u", i / 500, (i / 10) % 50, i % 10);
+}
+
+/* Registers `count` doubles, ADDRESS_BENCHMARK_TAGS are 100 lists */
+static uint64_t RegisterBenchmarkTags(uint32_t count) {
+    uint64_t start = MonotonicNs();
+
+    for (uint32_t i = 0; i < count; i++) {
+        variable_registration_t message;
+        memset(&message, 0, sizeof(message));
+        message.message_type = MSG_TYPE_VARIABLE_REGISTRATION;
+        message.typeKind = UA_DATATYPEKIND_DOUBLE;
+        BenchmarkTagName(i, message.name, sizeof(message.name));
+        message.access_level = READ;
+        message.index = (uint16_t)i;
+        message.NumberAcceptedParameters = (uint16_t)count;
+        AddVariableToOpcUaServer((char*)&message);
+    }
+    return MonotonicNs() - start;
+}
+
+/* -R: registration time and Browse latency of ADDRESS_BENCHMARK_TAGS dotted tags, flat and as a tree */
+static void RunAddressSpaceBenchmark(void) {
+    static const char *const LayoutNames[] = { "tree", "flat" };
+    const address_layout_t layouts[] = { ADDRESS_LAYOUT_FLAT, ADDRESS_LAYOUT_TREE };
+
+    for (size_t l = 0; l < sizeof(layouts) / sizeof(layouts[0]); l++) {
+        OpcUaServer = NewBenchmarkServer();
+        if (!OpcUaServer) {
+            return;
+        }
+        address_layout = layouts[l];
+
+        uint64_t elapsed = RegisterBenchmarkTags(ADDRESS_BENCHMARK_TAGS);
+
+        size_t objects = 0;
+        size_t leaves = 0;
+        UA_NodeId objectsFolder = UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER);
+        double objectsMs = BrowseLatencyMs(&objectsFolder, &objects);
+        const UA_NodeId *motor = FolderCacheFind("App.GVL000.M000", 15, FolderHash("App.GVL000.M000", 15));
+        double leafMs = motor ? BrowseLatencyMs(motor, &leaves) : 0.0;
+
+        printf("[OPC_UA] Address space (%s): %u tags in %.1f ms (%.0f tags/s), %u folders, "
+               "browse Objects %.3f ms (%zu refs), browse motor %.3f ms (%zu refs)\n",
+               LayoutNames[address_layout], ADDRESS_BENCHMARK_TAGS, elapsed / 1e6,
+               elapsed ? ADDRESS_BENCHMARK_TAGS * 1e9 / elapsed : 0.0, FolderCache.count,
+               objectsMs, objects, leafMs, leaves);
+        fflush(stdout);
+
+        FreeTagTable();
+        FreeFolderCache();
+        UA_Server_delete(OpcUaServer);
+        OpcUaServer = NULL;
+    }
+}
+
+/* Bytes handed out by malloc; mallinfo is deprecated since glibc 2.33 and wraps at 4 GB */
+static size_t HeapInUse(void) {
+#if defined(__GLIBC__)
+#if __GLIBC_PREREQ(2, 33)
+    return mallinfo2().uordblks;
+#else
+    return (size_t)mallinfo().uordblks;
+#endif
+#else
+    return (size_t)mallinfo().uordblks;
+#endif
+}
+
+/* -N: heap per tag and Read/Write throughput of the same tags in each nodestore */
+static void RunNodestoreBenchmark(void) {
+    const uint32_t operations = ADDRESS_BENCHMARK_TAGS * NODESTORE_BENCHMARK_ROUNDS;
+
+    for (int kind = 0; kind < NODESTORE_COUNT; kind++) {
+        nodestore_kind = (nodestore_kind_t)kind;
+        OpcUaServer = NewBenchmarkServer();
+        if (!OpcUaServer) {
+            return;
+        }
+
+        /* Heap in use before and after registration, folders included */
+        size_t before = HeapInUse();
+        uint64_t registration = RegisterBenchmarkTags(ADDRESS_BENCHMARK_TAGS);
+        size_t after = HeapInUse();
+
+        uint64_t start = MonotonicNs();
+        for (uint32_t round = 0; round < NODESTORE_BENCHMARK_ROUNDS; round++) {
+            for (uint32_t i = 0; i < ADDRESS_BENCHMARK_TAGS; i++) {
+                UA_Variant value;
+                if (UA_Server_readValue(OpcUaServer, LookupTagEntry(UA_DATATYPEKIND_DOUBLE, (uint16_t)i)->nodeId, &value) == UA_STATUSCODE_GOOD) {
+                    UA_Variant_clear(&value);
+                }
+            }
+        }
+        uint64_t reads = MonotonicNs() - start;
+
+        start = MonotonicNs();
+        for (uint32_t round = 0; round < NODESTORE_BENCHMARK_ROUNDS; round++) {
+            for (uint32_t i = 0; i < ADDRESS_BENCHMARK_TAGS; i++) {
+                UA_Double number = round + i;
+                UA_Variant value;
+                UA_Variant_setScalar(&value, &number, &UA_TYPES[UA_TYPES_DOUBLE]);
+                UA_Server_writeValue(OpcUaServer, LookupTagEntry(UA_DATATYPEKIND_DOUBLE, (uint16_t)i)->nodeId, value);
+            }
+        }
+        uint64_t writes = MonotonicNs() - start;
+
+        dense_nodestore_stats_t dense;
+        dense_nodestore_stats(&UA_Server_getConfig(OpcUaServer)->nodestore, &dense);
+
+        printf("[OPC_UA] Nodestore (%s): %u tags in %.1f ms, %.0f bytes/tag, read %.0f/s, write %.0f/s",
+               NodestoreNames[kind], ADDRESS_BENCHMARK_TAGS, registration / 1e6,
+               (double)(after - before) / ADDRESS_BENCHMARK_TAGS,
+               reads ? operations * 1e9 / reads : 0.0, writes ? operations * 1e9 / writes : 0.0);
+        if (kind == NODESTORE_DENSE) {
+            printf(", %u dense nodes, %zu bytes of tables", dense.nodes, dense.bytes);
+        }
+        printf("\n");
+        fflush(stdout);
+
+        FreeTagTable();
+        FreeFolderCache();
+        UA_Server_delete(OpcUaServer);
+        OpcUaServer = NULL;
     }
+}
 
-    UA_NodeId nodeId = UA_NODEID_STRING_ALLOC(1, nodeIdStr);
+/* The write path before the tag table: NodeId from the name, a Read for the data type and a
+ * heap copy of the value for every PLC write */
+static UA_StatusCode WriteByName(const char *name, const uint8_t *newValue) {
+    UA_NodeId nodeId = UA_NODEID_STRING_ALLOC(1, name);
 
     UA_Variant currentValue;
     UA_Variant_init(&currentValue);
@@ -42,536 +3649,291 @@ static UA_StatusCode WriteServerVariable(char *buffer) {
     UA_Variant_init(&value);
 
     retval = UA_Variant_setScalarCopy(&value, newValue, currentValue.type);
-    if (retval == UA_STATUSCODE_GOOD) {
-        retval = UA_Server_writeValue(OpcUaServer, nodeId, value);
-    }
-
-    UA_Variant_clear(&value);
-    UA_Variant_clear(&currentValue);
-    UA_NodeId_clear(&nodeId);
-
-    switch(message->typeKind) {
-        case UA_DATATYPEKIND_BOOLEAN:
-            if (OpcUaChangeFlagBuffer.UaBoolean != NULL) {
-                OpcUaChangeFlagBuffer.UaBoolean[message->index] = 1;
-            }
-            break;
-        case UA_DATATYPEKIND_SBYTE:
-            if (OpcUaChangeFlagBuffer.UaSByte != NULL) {
-                OpcUaChangeFlagBuffer.UaSByte[message->index] = 1;
-            }
-            break;
-        case UA_DATATYPEKIND_BYTE:
-            if (OpcUaChangeFlagBuffer.UaByte != NULL) {
-                OpcUaChangeFlagBuffer.UaByte[message->index] = 1;
-            }
-            break;
-        case UA_DATATYPEKIND_INT16:
-            if (OpcUaChangeFlagBuffer.UaInt16 != NULL) {
-                OpcUaChangeFlagBuffer.UaInt16[message->index] = 1;
-            }
-            break;
-        case UA_DATATYPEKIND_UINT16:
-            if (OpcUaChangeFlagBuffer.UaUint16 != NULL) {
-                OpcUaChangeFlagBuffer.UaUint16[message->index] = 1;
-            }
-            break;
-        case UA_DATATYPEKIND_INT32:
-            if (OpcUaChangeFlagBuffer.UaInt32 != NULL) {
-                OpcUaChangeFlagBuffer.UaInt32[message->index] = 1;
-            }
-            break;
-        case UA_DATATYPEKIND_UINT32:
-            if (OpcUaChangeFlagBuffer.UaUint32 != NULL) {
-                OpcUaChangeFlagBuffer.UaUint32[message->index] = 1;
-            }
-            break;
-        case UA_DATATYPEKIND_INT64:
-            if (OpcUaChangeFlagBuffer.UaInt64 != NULL) {
-                OpcUaChangeFlagBuffer.UaInt64[message->index] = 1;
-            }
-            break;
-        case UA_DATATYPEKIND_UINT64:
-            if (OpcUaChangeFlagBuffer.UaUint64 != NULL) {
-                OpcUaChangeFlagBuffer.UaUint64[message->index] = 1;
-            }
-            break;
-        case UA_DATATYPEKIND_FLOAT:
-            if (OpcUaChangeFlagBuffer.UaFloat != NULL) {
-                OpcUaChangeFlagBuffer.UaFloat[message->index] = 1;
-            }
-            break;
-        case UA_DATATYPEKIND_DOUBLE:
-            if (OpcUaChangeFlagBuffer.UaDouble != NULL) {
-                OpcUaChangeFlagBuffer.UaDouble[message->index] = 1;
-            }
-            break;
-        case UA_DATATYPEKIND_STRING: {
-            if (OpcUaChangeFlagBuffer.UaString != NULL) {
-                OpcUaChangeFlagBuffer.UaString[message->index] = 1;
-            }
-            break;
-        }
-        default:
-            break;
+    if (retval == UA_STATUSCODE_GOOD) {
+        retval = UA_Server_writeValue(OpcUaServer, nodeId, value);
     }
 
+    UA_Variant_clear(&value);
+    UA_Variant_clear(&currentValue);
+    UA_NodeId_clear(&nodeId);
     return retval;
 }
 
-static uint8_t CheckUaStringLength(UA_String *str) {
-    if (!str || !str->data || str->length == 0) {
-        return UA_STRING_ERROR;
+/* -W: WRITE_BENCHMARK_TAGS PLC writes by name and through the tag table */
+static void RunWritePathBenchmark(void) {
+    const uint32_t operations = WRITE_BENCHMARK_TAGS * WRITE_BENCHMARK_ROUNDS;
+    static char names[WRITE_BENCHMARK_TAGS][MAX_NAME_LENGTH];
+
+    OpcUaServer = NewBenchmarkServer();
+    if (!OpcUaServer) {
+        return;
     }
+    RegisterBenchmarkTags(WRITE_BENCHMARK_TAGS);
 
-    size_t length = strnlen((char*)str->data, str->length);
+    /* The names arrive with the frame, building them is not part of either path */
+    for (uint32_t i = 0; i < WRITE_BENCHMARK_TAGS; i++) {
+        BenchmarkTagName(i, names[i], sizeof(names[i]));
+    }
 
-    if (length >= MAX_STRING_VALUE) {
-        str->data[MAX_STRING_VALUE - 1] = '\0';
-        str->length = MAX_STRING_VALUE - 1;
-        return UA_STRING_OVERFLOW;
+    uint32_t failed = 0;
+    uint64_t start = MonotonicNs();
+    for (uint32_t round = 0; round < WRITE_BENCHMARK_ROUNDS; round++) {
+        for (uint32_t i = 0; i < WRITE_BENCHMARK_TAGS; i++) {
+            uint8_t value[MAX_DATA_SIZE] = {0};
+            UA_Double number = round + i;
+            memcpy(value, &number, sizeof(number));
+            failed += WriteByName(names[i], value) != UA_STATUSCODE_GOOD;
+        }
     }
+    uint64_t byName = MonotonicNs() - start;
 
-    if (length < str->length && str->data[length] != '\0') {
-        str->data[length] = '\0';
-        str->length = length;
+    start = MonotonicNs();
+    for (uint32_t round = 0; round < WRITE_BENCHMARK_ROUNDS; round++) {
+        for (uint32_t i = 0; i < WRITE_BENCHMARK_TAGS; i++) {
+            uint8_t value[MAX_DATA_SIZE] = {0};
+            UA_Double number = round + i;
+            memcpy(value, &number, sizeof(number));
+            failed += WriteServerVariableValueAt(UA_DATATYPEKIND_DOUBLE, (uint16_t)i, value, 0) != UA_STATUSCODE_GOOD;
+        }
     }
+    uint64_t byTable = MonotonicNs() - start;
 
-    return UA_STRING_OK;
+    printf("[OPC_UA] Write path: %u tags x %d, by name %.0f ns (%.0f/s), tag table %.0f ns (%.0f/s), %.1fx, %u failed\n",
+           WRITE_BENCHMARK_TAGS, WRITE_BENCHMARK_ROUNDS,
+           (double)byName / operations, byName ? operations * 1e9 / byName : 0.0,
+           (double)byTable / operations, byTable ? operations * 1e9 / byTable : 0.0,
+           byTable ? (double)byName / byTable : 0.0, failed);
+    fflush(stdout);
+
+    FreeTagTable();
+    FreeFolderCache();
+    UA_Server_delete(OpcUaServer);
+    OpcUaServer = NULL;
 }
 
-static void GlobalDataChangeCallback(UA_Server *server, UA_UInt32 monitoredItemId, void *monitoredItemContext, const UA_NodeId *nodeId, void *nodeContext, UA_UInt32 attributeId, const UA_DataValue *value) {
-    if (!monitoredItemContext || !value || !value->value.data) {
-        return;
-    }
+/* -V: PLC write and client read throughput of the same tags with the value in the node
+ * (UA_Server_writeValue) and in the value store behind the external backend */
+static void RunValueBackendBenchmark(void) {
+    static const char *const BackendNames[] = { "internal", "external" };
+    const value_backend_t backends[] = { VALUE_BACKEND_INTERNAL, VALUE_BACKEND_EXTERNAL };
+    const uint32_t operations = ADDRESS_BENCHMARK_TAGS * VALUE_BACKEND_BENCHMARK_ROUNDS;
 
-    variable_context_t *ctx = (variable_context_t *)monitoredItemContext;
+    for (size_t b = 0; b < sizeof(backends) / sizeof(backends[0]); b++) {
+        OpcUaServer = NewBenchmarkServer();
+        if (!OpcUaServer) {
+            return;
+        }
+        value_backend = backends[b];
+        RegisterBenchmarkTags(ADDRESS_BENCHMARK_TAGS);
 
-    if (mqueue_opcua_to_codesys && registration_active == false) {
-        variable_write_t msg = {0};
+        uint32_t external = 0;
+        for (uint32_t i = 0; i < ADDRESS_BENCHMARK_TAGS; i++) {
+            external += LookupTagEntry(UA_DATATYPEKIND_DOUBLE, (uint16_t)i)->backend == VALUE_BACKEND_EXTERNAL;
+        }
 
-        msg.message_type = MSG_TYPE_WRITE_VARIABLE;
-        msg.index = ctx->index;
-        msg.typeKind = ctx->typeKind;
+        /* The gateway write path, as IngressDrain applies a PLC value */
+        uint64_t start = MonotonicNs();
+        for (uint32_t round = 0; round < VALUE_BACKEND_BENCHMARK_ROUNDS; round++) {
+            for (uint32_t i = 0; i < ADDRESS_BENCHMARK_TAGS; i++) {
+                uint8_t value[MAX_DATA_SIZE] = {0};
+                UA_Double number = round + i;
+                memcpy(value, &number, sizeof(number));
+                WriteServerVariableValueAt(UA_DATATYPEKIND_DOUBLE, (uint16_t)i, value, 0);
+            }
+        }
+        uint64_t writes = MonotonicNs() - start;
 
-        switch(ctx->typeKind) {
-            case UA_DATATYPEKIND_BOOLEAN:
-                if (OpcUaChangeFlagBuffer.UaBoolean[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaBoolean[ctx->index] = 0;
-                    return;
-                }
-                memcpy(msg.value, value->value.data, sizeof(UA_Boolean));
-                break;
-            case UA_DATATYPEKIND_SBYTE:
-                if (OpcUaChangeFlagBuffer.UaSByte[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaSByte[ctx->index] = 0;
-                    return;
-                }
-                memcpy(msg.value, value->value.data, sizeof(UA_SByte));
-                break;
-            case UA_DATATYPEKIND_BYTE:
-                if (OpcUaChangeFlagBuffer.UaByte[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaByte[ctx->index] = 0;
-                    return;
-                }
-                memcpy(msg.value, value->value.data, sizeof(UA_Byte));
-                break;
-            case UA_DATATYPEKIND_INT16:
-                if (OpcUaChangeFlagBuffer.UaInt16[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaInt16[ctx->index] = 0;
-                    return;
-                }
-                memcpy(msg.value, value->value.data, sizeof(UA_Int16));
-                break;
-            case UA_DATATYPEKIND_UINT16:
-                if (OpcUaChangeFlagBuffer.UaUint16[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaUint16[ctx->index] = 0;
-                    return;
-                }
-                memcpy(msg.value, value->value.data, sizeof(UA_UInt16));
-                break;
-            case UA_DATATYPEKIND_INT32:
-                if (OpcUaChangeFlagBuffer.UaInt32[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaInt32[ctx->index] = 0;
-                    return;
-                }
-                memcpy(msg.value, value->value.data, sizeof(UA_Int32));
-                break;
-            case UA_DATATYPEKIND_UINT32:
-                if (OpcUaChangeFlagBuffer.UaUint32[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaUint32[ctx->index] = 0;
-                    return;
-                }
-                memcpy(msg.value, value->value.data, sizeof(UA_UInt32));
-                break;
-            case UA_DATATYPEKIND_INT64:
-                if (OpcUaChangeFlagBuffer.UaInt64[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaInt64[ctx->index] = 0;
-                    return;
-                }
-                memcpy(msg.value, value->value.data, sizeof(UA_Int64));
-                break;
-            case UA_DATATYPEKIND_UINT64:
-                if (OpcUaChangeFlagBuffer.UaUint64[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaUint64[ctx->index] = 0;
-                    return;
-                }
-                memcpy(msg.value, value->value.data, sizeof(UA_UInt64));
-                break;
-            case UA_DATATYPEKIND_FLOAT:
-                if (OpcUaChangeFlagBuffer.UaFloat[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaFloat[ctx->index] = 0;
-                    return;
-                }
-                memcpy(msg.value, value->value.data, sizeof(UA_Float));
-                break;
-            case UA_DATATYPEKIND_DOUBLE:
-                if (OpcUaChangeFlagBuffer.UaDouble[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaDouble[ctx->index] = 0;
-                    return;
+        start = MonotonicNs();
+        for (uint32_t round = 0; round < VALUE_BACKEND_BENCHMARK_ROUNDS; round++) {
+            for (uint32_t i = 0; i < ADDRESS_BENCHMARK_TAGS; i++) {
+                UA_Variant value;
+                if (UA_Server_readValue(OpcUaServer, LookupTagEntry(UA_DATATYPEKIND_DOUBLE, (uint16_t)i)->nodeId, &value) == UA_STATUSCODE_GOOD) {
+                    UA_Variant_clear(&value);
                 }
-                memcpy(msg.value, value->value.data, sizeof(UA_Double));
-                break;
-            case UA_DATATYPEKIND_STRING: {
-                if (OpcUaChangeFlagBuffer.UaString[ctx->index]) {
-                    OpcUaChangeFlagBuffer.UaString[ctx->index] = 0;
-                    return;
-                }
-                UA_String *str = (UA_String*)value->value.data;
-                if (str->data && str->length > 0) {
-                    size_t copy_len = (str->length < MAX_DATA_SIZE) ? str->length : MAX_DATA_SIZE - 1;
-                    memcpy(msg.value, str->data, copy_len);
-                    msg.value[copy_len] = '\0';
-                }
-                break;
             }
-            default:
-                memcpy(msg.value, value->value.data, sizeof(UA_Boolean));
-                break;
         }
+        uint64_t reads = MonotonicNs() - start;
+
+        printf("[OPC_UA] Value backend (%s): %u tags, %u external, write %.0f/s (%.0f ns), read %.0f/s (%.0f ns)\n",
+               BackendNames[b], ADDRESS_BENCHMARK_TAGS, external,
+               writes ? operations * 1e9 / writes : 0.0, (double)writes / operations,
+               reads ? operations * 1e9 / reads : 0.0, (double)reads / operations);
+        fflush(stdout);
 
-        mq_send_msg(mqueue_opcua_to_codesys, &msg, sizeof(msg), 1);
+        FreeTagTable();
+        FreeFolderCache();
+        FreeValueStore();
+        UA_Server_delete(OpcUaServer);
+        OpcUaServer = NULL;
     }
+    value_backend = VALUE_BACKEND_INTERNAL;
 }
 
-static void AllocateMemory(uint8_t **pbuffer, uint16_t NumberAcceptedParameters) {
-    uint8_t *buffer = *pbuffer;
+static void RecordIngressLatency(uint64_t received_ns, uint64_t enqueue_time) {
+    uint64_t now = MonotonicNs();
 
-    if (!pbuffer || *pbuffer != NULL || NumberAcceptedParameters == 0) {
-        return;
+    LatencyStatsRecord(&IngressHandlerLatency, now - received_ns);
+    /* Queued writes are timed by IngressDrain when they reach the node */
+    if (ingress_apply == INGRESS_APPLY_DIRECT) {
+        HistogramRecord(HOP_RECEIVE_TO_WRITE, now - received_ns);
+    }
+    if (enqueue_time != 0 && enqueue_time <= now) {
+        LatencyStatsRecord(&IngressQueueLatency, now - enqueue_time);
+    }
+
+    if (update_active) {
+        uint64_t since = UpdateStats.last_write_ns > UpdateStats.start_ns ? UpdateStats.last_write_ns : UpdateStats.start_ns;
+        if (now - since > UpdateStats.max_gap_ns) {
+            UpdateStats.max_gap_ns = now - since;
+        }
+        UpdateStats.last_write_ns = now;
+        LatencyStatsRecord(&UpdateStats.latency, now - received_ns);
     }
+}
 
-    size_t TotalSize = NumberAcceptedParameters;
+static tag_ref_t *DecodeTagList(uint8_t *buffer, ssize_t length, uint16_t *count) {
+    tag_list_header_t *header = (tag_list_header_t*)buffer;
 
-    buffer = calloc(1, TotalSize);
-    if (buffer != NULL) {
-        *pbuffer = buffer;
-        return;
+    if (length < (ssize_t)sizeof(tag_list_header_t) ||
+        length != (ssize_t)(sizeof(tag_list_header_t) + header->count * sizeof(tag_ref_t))) {
+        return NULL;
     }
 
-    *pbuffer = NULL;
+    *count = header->count;
+    return (tag_ref_t*)(buffer + sizeof(tag_list_header_t));
 }
 
-static void AddVariableToOpcUaServer(char *buffer) {
-    variable_registration_t *message = (variable_registration_t*)buffer;
+/* Incremental registration: only the listed tags are frozen, writes for the rest keep flowing */
+static void StartUpdateWindow(uint8_t *buffer, ssize_t length) {
+    uint16_t count;
+    tag_ref_t *refs = DecodeTagList(buffer, length, &count);
 
-    char *name = message->name;
-    char *description = message->description;
-    uint8_t typeKind = message->typeKind;
-    AccessLevel *pAccessLevel = &message->access_level;
-    uint8_t *pValue = message->value;
-    double deadbandValue = message->deadbandValue;
-    uint16_t NumberAcceptedParameters = message->NumberAcceptedParameters;
+    if (refs == NULL) {
+        return;
+    }
 
-    if (NumberAcceptedParameters > 0) {
-        switch (typeKind) {
-            case UA_DATATYPEKIND_BOOLEAN:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaBoolean, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaBoolean == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaBoolean[message->index] = 1;
-                break;
-            case UA_DATATYPEKIND_SBYTE:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaSByte, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaSByte == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaSByte[message->index] = 1;
-                break;
-            case UA_DATATYPEKIND_BYTE:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaByte, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaByte == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaByte[message->index] = 1;
-                break;
-            case UA_DATATYPEKIND_INT16:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaInt16, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaInt16 == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaInt16[message->index] = 1;
-                break;
-            case UA_DATATYPEKIND_UINT16:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaUint16, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaUint16 == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaUint16[message->index] = 1;
-                break;
-            case UA_DATATYPEKIND_INT32:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaInt32, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaInt32 == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaInt32[message->index] = 1;
-                break;
-            case UA_DATATYPEKIND_UINT32:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaUint32, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaUint32 == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaUint32[message->index] = 1;
-                break;
-            case UA_DATATYPEKIND_INT64:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaInt64, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaInt64 == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaInt64[message->index] = 1;
-                break;
-            case UA_DATATYPEKIND_UINT64:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaUint64, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaUint64 == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaUint64[message->index] = 1;
-                break;
-            case UA_DATATYPEKIND_FLOAT:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaFloat, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaFloat == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaFloat[message->index] = 1;
-                break;
-            case UA_DATATYPEKIND_DOUBLE:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaDouble, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaDouble == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaDouble[message->index] = 1;
-                break;
-            case UA_DATATYPEKIND_STRING:
-                AllocateMemory(&OpcUaChangeFlagBuffer.UaString, NumberAcceptedParameters);
-                if (OpcUaChangeFlagBuffer.UaString == NULL) {
-                    break;
-                }
-                OpcUaChangeFlagBuffer.UaString[message->index] = 1;
-                break;
-            default:
-                break;
+    for (uint16_t i = 0; i < count; i++) {
+        if (EnsureTagTable(refs[i].typeKind, refs[i].index + 1) != 0) {
+            continue;
         }
+        tag_entry_t *entry = LookupTagEntry(refs[i].typeKind, refs[i].index);
+        entry->state = TAG_STATE_UPDATING;
+        entry->replay_pending = 0;
     }
 
-#ifdef DEBUG
-    printf("[OPC_UA] === AddVariableToOpcUaServer ===\n");
-    printf("[OPC_UA] Name: %s\n", name);
-    printf("[OPC_UA] Description: %s\n", description);
-    printf("[OPC_UA] TypeKind: %d\n", typeKind);
-    printf("[OPC_UA] AccessLevel: %d\n", *pAccessLevel);
-    printf("[OPC_UA] DeadbandValue: %f\n", deadbandValue);
-    printf("[OPC_UA] Value pointer: %p\n", pValue);
-    fflush(stdout);
+    memset(&UpdateStats, 0, sizeof(UpdateStats));
+    UpdateStats.start_ns = MonotonicNs();
+    RegistrationStats.start_ns = UpdateStats.start_ns;
+    RegistrationStats.tags = 0;
+    RegistrationStats.frames = 0;
+    update_active = true;
 
-    switch (typeKind) {
-        case UA_DATATYPEKIND_BOOLEAN:
-            printf("[OPC_UA] Value (boolean): %d\n", *(UA_Boolean*)pValue);
-            break;
-        case UA_DATATYPEKIND_SBYTE:
-            printf("[OPC_UA] Value (sbyte): %d\n", *(UA_SByte*)pValue);
-            break;
-        case UA_DATATYPEKIND_BYTE:
-            printf("[OPC_UA] Value (byte): %u\n", *(UA_Byte*)pValue);
-            break;
-        case UA_DATATYPEKIND_INT16:
-            printf("[OPC_UA] Value (int16): %d\n", *(UA_Int16*)pValue);
-            break;
-        case UA_DATATYPEKIND_UINT16:
-            printf("[OPC_UA] Value (uint16): %u\n", *(UA_UInt16*)pValue);
-            break;
-        case UA_DATATYPEKIND_INT32:
-            printf("[OPC_UA] Value (int32): %d\n", *(UA_Int32*)pValue);
-            break;
-        case UA_DATATYPEKIND_UINT32:
-            printf("[OPC_UA] Value (uint32): %u\n", *(UA_UInt32*)pValue);
-            break;
-        case UA_DATATYPEKIND_INT64:
-            printf("[OPC_UA] Value (int64): %lld\n", *(UA_Int64*)pValue);
-            break;
-        case UA_DATATYPEKIND_UINT64:
-            printf("[OPC_UA] Value (uint64): %llu\n", *(UA_UInt64*)pValue);
-            break;
-        case UA_DATATYPEKIND_FLOAT:
-            printf("[OPC_UA] Value (float): %f\n", *(UA_Float*)pValue);
-            break;
-        case UA_DATATYPEKIND_DOUBLE:
-            printf("[OPC_UA] Value (double): %lf\n", *(UA_Double*)pValue);
-            break;
-        case UA_DATATYPEKIND_STRING:
-            printf("[OPC_UA] Value via pValue (string): %s\n", (char*)pValue);
-            printf("[OPC_UA] String length: %zu\n", strlen((char*)pValue));
-            break;
-        default:
-            printf("[OPC_UA] Value (unknown type)\n");
-            break;
-    }
-    printf("[OPC_UA] ===============================\n");
+#ifdef DEBUG
+    printf("[OPC_UA] Update STARTED for %u tags\n", count);
     fflush(stdout);
 #endif
+}
 
-    UA_VariableAttributes attr = UA_VariableAttributes_default;
-
-    if (typeKind == UA_DATATYPEKIND_STRING) {
-        UA_String srcString = UA_STRING((char *)pValue);
-
-        switch (CheckUaStringLength(&srcString)) {
-            case UA_STRING_ERROR:
-                break;
-            case UA_STRING_OVERFLOW:
-                memcpy(pValue, srcString.data, MAX_STRING_VALUE);
-                break;
-            case UA_STRING_OK:
-                break;
-        }
+static void RemoveVariables(uint8_t *buffer, ssize_t length) {
+    uint16_t count;
+    tag_ref_t *refs = DecodeTagList(buffer, length, &count);
 
-        UA_Variant_setScalar(&attr.value, &srcString, &UA_TYPES[UA_TYPES_STRING]);
-    } else {
-        UA_Variant_setScalar(&attr.value, pValue, &UA_TYPES[typeKind]);
+    if (refs == NULL) {
+        return;
     }
 
-    attr.description = UA_LOCALIZEDTEXT("en-US", description);
-    attr.displayName = UA_LOCALIZEDTEXT("en-US", name);
-    attr.dataType = UA_TYPES[typeKind].typeId;
-    attr.accessLevel = *pAccessLevel;
-
-    UA_NodeId newNodeId = UA_NODEID_STRING(1, name);
-    UA_NodeId parentNodeId = UA_NODEID_NUMERIC(0, UA_NS0ID_OBJECTSFOLDER);
-    UA_NodeId parentReferenceNodeId = UA_NODEID_NUMERIC(0, UA_NS0ID_ORGANIZES);
-    UA_QualifiedName browseName = UA_QUALIFIEDNAME(1, name);
-
-    UA_StatusCode retval = UA_Server_addVariableNode(OpcUaServer, newNodeId, parentNodeId, parentReferenceNodeId, browseName, UA_NODEID_NULL, attr, NULL, NULL);
-
-    if (retval != UA_STATUSCODE_GOOD) {
-#ifdef DEBUG
-        printf("[OPC_UA] Failed to add variable node: %s\n", UA_StatusCode_name(retval));
-        fflush(stdout);
-#endif
-        return;
+    for (uint16_t i = 0; i < count; i++) {
+        RemoveTagEntry(refs[i].typeKind, refs[i].index);
     }
+}
 
-    if (*pAccessLevel == READWRITE) {
-        variable_context_t *ctx = (variable_context_t *)malloc(sizeof(variable_context_t));
-        if (!ctx) {
-#ifdef DEBUG
-            printf("[OPC_UA] Failed to allocate context for variable: %s\n", name);
-            fflush(stdout);
-#endif
-            return;
+static void EndUpdateWindow(void) {
+    /* Listed tags that were not registered again are dropped together with their buffered writes */
+    for (int typeKind = 0; typeKind < TAG_TYPE_KIND_COUNT; typeKind++) {
+        for (uint16_t index = 0; index < OpcUaTagTable[typeKind].size; index++) {
+            ActivateTagEntry(typeKind, index);
         }
+    }
 
-        strncpy(ctx->name, name, sizeof(ctx->name)-1);
-        ctx->typeKind = typeKind;
-        ctx->index = message->index;
-
-        UA_MonitoredItemCreateRequest item;
-        UA_MonitoredItemCreateRequest_init(&item);
+    update_active = false;
 
-        item.itemToMonitor.nodeId = newNodeId;
-        item.itemToMonitor.attributeId = UA_ATTRIBUTEID_VALUE;
-        item.monitoringMode = UA_MONITORINGMODE_REPORTING;
-        item.requestedParameters.samplingInterval = 100.0;
-        item.requestedParameters.discardOldest = UA_TRUE;
-        item.requestedParameters.queueSize = 10;
+#ifdef DEBUG
+    uint64_t elapsed = MonotonicNs() - UpdateStats.start_ns;
+    printf("[OPC_UA] Update FINISHED: %u tags in %.3f ms, %llu writes buffered, %llu replayed, max write gap %.3f ms\n",
+           RegistrationStats.tags, elapsed / 1e6, (unsigned long long)UpdateStats.buffered,
+           (unsigned long long)UpdateStats.replayed, UpdateStats.max_gap_ns / 1e6);
+    LatencyStatsPrint("Write latency during update", &UpdateStats.latency);
+    fflush(stdout);
+#endif
+}
 
-        UA_DataChangeFilter filter;
-        UA_DataChangeFilter_init(&filter);
-        filter.trigger = UA_DATACHANGETRIGGER_STATUSVALUE;
+/* Decoding thread: switches ingress at once, egress and the reply are left to the server
+ * thread, the only writer of the egress ring */
+static void NegotiateProtocolVersion(uint8_t *buffer, ssize_t length) {
+    uint8_t negotiation;
 
-        switch(typeKind) {
-            case UA_DATATYPEKIND_SBYTE:
-            case UA_DATATYPEKIND_BYTE:
-            case UA_DATATYPEKIND_INT16:
-            case UA_DATATYPEKIND_UINT16:
-            case UA_DATATYPEKIND_INT32:
-            case UA_DATATYPEKIND_UINT32:
-            case UA_DATATYPEKIND_INT64:
-            case UA_DATATYPEKIND_UINT64:
-            case UA_DATATYPEKIND_FLOAT:
-            case UA_DATATYPEKIND_DOUBLE:
-                filter.deadbandType = UA_DEADBANDTYPE_ABSOLUTE;
-                filter.deadbandValue = deadbandValue;
-                break;
+    if (length == sizeof(registration_start_t)) {
+        registration_start_t *request = (registration_start_t*)buffer;
 
-            default:
-                filter.deadbandType = UA_DEADBANDTYPE_NONE;
-                filter.deadbandValue = 0;
-                break;
+        protocol_version = request->version < PROTOCOL_VERSION_MAX ? request->version : PROTOCOL_VERSION_MAX;
+        if (protocol_version < PROTOCOL_VERSION_1) {
+            protocol_version = PROTOCOL_VERSION_1;
         }
+        negotiation = protocol_version | PROTOCOL_NEGOTIATION_REPLY;
+    } else {
+        protocol_version = PROTOCOL_VERSION_1;
+        negotiation = protocol_version;
+    }
 
-        UA_ExtensionObject filterExt;
-        filterExt.encoding = UA_EXTENSIONOBJECT_DECODED;
-        filterExt.content.decoded.type = &UA_TYPES[UA_TYPES_DATACHANGEFILTER];
-        filterExt.content.decoded.data = &filter;
-        item.requestedParameters.filter = filterExt;
+    __atomic_store_n(&protocol_negotiation, negotiation, __ATOMIC_RELEASE);
 
-        UA_MonitoredItemCreateResult result = UA_Server_createDataChangeMonitoredItem(OpcUaServer, UA_TIMESTAMPSTORETURN_BOTH, item, ctx, GlobalDataChangeCallback);
+    /* Until END_REGISTRATION releases the server loop this thread is the only sender, the
+     * reply goes out now so a PLC may wait for it before registering */
+    if (DrivesServer()) {
+        EgressNegotiate();
+    }
 
-        if (result.statusCode != UA_STATUSCODE_GOOD) {
 #ifdef DEBUG
-            printf("[OPC_UA] Failed to create monitored item for %s: %s\n", name, UA_StatusCode_name(result.statusCode));
-            fflush(stdout);
-#endif
-            free(ctx);
-        } else {
-#ifdef DEBUG
-            printf("[OPC_UA] Monitoring enabled for variable: %s\n", name);
-            fflush(stdout);
+    printf("[OPC_UA] Protocol version %u\n", protocol_version);
+    fflush(stdout);
 #endif
-        }
-        UA_MonitoredItemCreateResult_clear(&result);
-    }
 }
 
-static void FreeChangeFlagBufferStructs(uint8_t **buffer_ptr) {
-    if (*buffer_ptr != NULL) {
-        free(*buffer_ptr);
-        *buffer_ptr = NULL;
+static void IncomingPacketManager(uint8_t *buffer, ssize_t length, uint64_t received_ns) {
+    if (length < 1) {
+        return;
     }
-}
 
-static void FreeChangeFlagBuffer(void) {
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaBoolean);
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaSByte);
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaByte);
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaInt16);
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaUint16);
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaInt32);
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaUint32);
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaInt64);
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaUint64);
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaFloat);
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaDouble);
-    FreeChangeFlagBufferStructs(&OpcUaChangeFlagBuffer.UaString);
-}
+    /* v2 write frames start with a one-byte message type */
+    if (protocol_version == PROTOCOL_VERSION_2 && (buffer[0] == MSG_TYPE_WRITE_BATCH || buffer[0] == MSG_TYPE_WRITE_VARIABLE)) {
+        if (!registration_active) {
+            uint64_t enqueue_time;
+            if (WriteServerVariableBatchV2(buffer, length, &enqueue_time) > 0) {
+                RecordIngressLatency(received_ns, enqueue_time);
+            }
+        }
+        return;
+    }
+
+    if (length < (ssize_t)sizeof(message_type_t)) {
+        return;
+    }
 
-static void IncomingPacketManager(uint8_t *buffer, ssize_t length) {
     message_type_t header = *(message_type_t*)buffer;
 
+    if (header != MSG_TYPE_WRITE_VARIABLE && header != MSG_TYPE_WRITE_BATCH && header != MSG_TYPE_ARRAY_CHUNK &&
+        header != MSG_TYPE_WRITE_STRUCT && header != MSG_TYPE_CYCLE_END) {
+        IngressQueueWaitDrained();
+    }
+
     switch (header) {
         case MSG_TYPE_START_REGISTRATION:
-            if (length == sizeof(message_type_t)) {
+            if (length == sizeof(message_type_t) || length == sizeof(registration_start_t)) {
+                NegotiateProtocolVersion(buffer, length);
                 registration_active = true;
+                RegistrationStats.start_ns = MonotonicNs();
+                RegistrationStats.tags = 0;
+                RegistrationStats.frames = 0;
 #ifdef DEBUG
                 printf("[OPC_UA] Registration STARTED\n");
                 fflush(stdout);
@@ -580,8 +3942,11 @@ static void IncomingPacketManager(uint8_t *buffer, ssize_t length) {
             break;
 
         case MSG_TYPE_VARIABLE_REGISTRATION:
-            if (registration_active && length == sizeof(variable_registration_t)) {
-                AddVariableToOpcUaServer(buffer);
+            if ((registration_active || update_active) && length == sizeof(variable_registration_t)) {
+                variable_registration_t *message = (variable_registration_t*)buffer;
+                RegistrationStats.frames++;
+                AddVariableToOpcUaServer((char*)buffer);
+                ActivateTagEntry(message->typeKind, message->index);
             } else if (!registration_active) {
 #ifdef DEBUG
                 printf("[OPC_UA] Ignoring variable - registration not active\n");
@@ -590,22 +3955,120 @@ static void IncomingPacketManager(uint8_t *buffer, ssize_t length) {
             }
             break;
 
+        case MSG_TYPE_REGISTRATION_BATCH:
+            if (registration_active || update_active) {
+                AddVariableBatchToOpcUaServer(buffer, length);
+            } else {
+#ifdef DEBUG
+                printf("[OPC_UA] Ignoring registration batch - registration not active\n");
+                fflush(stdout);
+#endif
+            }
+            break;
+
+        case MSG_TYPE_START_UPDATE:
+            if (!registration_active && !update_active) {
+                StartUpdateWindow(buffer, length);
+            }
+            break;
+
+        case MSG_TYPE_ARRAY_REGISTRATION:
+            if (registration_active || update_active) {
+                AddArrayVariableToOpcUaServer(buffer, length);
+            }
+            break;
+
+        case MSG_TYPE_ARRAY_CHUNK:
+            if (!registration_active) {
+                WriteArrayChunk(buffer, length);
+            }
+            break;
+
+        case MSG_TYPE_CYCLE_BEGIN:
+            if (!registration_active) {
+                CycleBegin(buffer, length);
+            }
+            break;
+
+        case MSG_TYPE_CYCLE_END:
+            if (!registration_active) {
+                CycleEnd(buffer, length);
+            }
+            break;
+
+        case MSG_TYPE_TAG_PROFILE:
+            if (registration_active || update_active) {
+                ApplyTagProfiles(buffer, length);
+            }
+            break;
+
+        case MSG_TYPE_STRUCT_TYPE:
+            if (registration_active || update_active) {
+                AddStructTypeToOpcUaServer(buffer, length);
+            }
+            break;
+
+        case MSG_TYPE_STRUCT_REGISTRATION:
+            if (registration_active || update_active) {
+                AddStructVariableToOpcUaServer(buffer, length);
+            }
+            break;
+
+        case MSG_TYPE_WRITE_STRUCT:
+            if (!registration_active) {
+                WriteStructValue(buffer, length);
+            }
+            break;
+
+        case MSG_TYPE_IMAGE_BIND:
+            if (registration_active || update_active) {
+                BindImageVariables(buffer, length);
+            }
+            break;
+
+        case MSG_TYPE_VARIABLE_REMOVE:
+            if (update_active) {
+                RemoveVariables(buffer, length);
+            }
+            break;
+
+        case MSG_TYPE_END_UPDATE:
+            if (update_active && length == sizeof(message_type_t)) {
+                EndUpdateWindow();
+            }
+            break;
+
         case MSG_TYPE_END_REGISTRATION:
             if (length == sizeof(message_type_t)) {
                 registration_active = false;
 
 #ifdef DEBUG
-                printf("[OPC_UA] Registration FINISHED\n");
+                {
+                    uint64_t elapsed = MonotonicNs() - RegistrationStats.start_ns;
+                    printf("[OPC_UA] Registration FINISHED: %u tags in %u frames, %.3f ms, %.0f tags/s\n",
+                           RegistrationStats.tags, RegistrationStats.frames, elapsed / 1e6,
+                           elapsed ? RegistrationStats.tags * 1e9 / elapsed : 0.0);
+                    printf("[OPC_UA] Folders: %u, cache hits: %llu, created: %llu\n", FolderCache.count,
+                           (unsigned long long)FolderCache.hits, (unsigned long long)FolderCache.misses);
+                }
                 fflush(stdout);
 #endif
+                /* Raised before the server thread can start the EventSource, the receive
+                 * loop stops before its next mq_receive */
+                if (ingress_mode == INGRESS_MODE_EVENTLOOP) {
+                    ingress_handed_over = 1;
+                }
+                __atomic_store_n(&opcua_server_released, 1, __ATOMIC_RELEASE);
                 ThreadUnLock(&variable_init_mutex, &variable_init_cond, &variable_init_ready);
             }
             break;
 
         case MSG_TYPE_WRITE_VARIABLE:
             if (!registration_active) {
-                if (length == sizeof(variable_write_t)) {
-                    WriteServerVariable(buffer);
+                if (length == sizeof(variable_write_t) || length == sizeof(variable_write_source_t)) {
+                    WriteServerVariable(buffer, length);
+                    RecordIngressLatency(received_ns, 0);
+                    WireStatsRecord(&IngressWireStats[PROTOCOL_VERSION_1], length, 1);
                 }
             } else {
 #ifdef DEBUG
@@ -615,13 +4078,33 @@ static void IncomingPacketManager(uint8_t *buffer, ssize_t length) {
             }
             break;
 
+        case MSG_TYPE_WRITE_BATCH:
+            if (!registration_active) {
+                if (WriteServerVariableBatch(buffer, length) > 0) {
+                    RecordIngressLatency(received_ns, ((variable_batch_header_t*)buffer)->enqueue_time);
+                    WireStatsRecord(&IngressWireStats[PROTOCOL_VERSION_1], length, ((variable_batch_header_t*)buffer)->count);
+                }
+            } else {
+#ifdef DEBUG
+                printf("[OPC_UA] Ignoring write batch - registration in progress\n");
+                fflush(stdout);
+#endif
+            }
+            break;
+
         case MSG_TYPE_SHUT_DOWN:
 #ifdef DEBUG
             printf("[OPC_UA] MSG_TYPE_SHUT_DOWN\n");
             fflush(stdout);
 #endif
 
-            FreeChangeFlagBuffer();
+            /* An unfinished cycle is dropped; the tables stay until main() has joined the
+             * server thread, which keeps using them until its loop sees the flag below */
+            cycle_open = false;
+            for (uint32_t i = 0; i < cycle_back->count; i++) {
+                free(cycle_back->writes[i].bulk);
+            }
+            cycle_back->count = 0;
 
             ThreadUnLock(&codesys_to_opcua_shutdown_mutex, &codesys_to_opcua_shutdown_cond, &codesys_to_opcua_shutdown);
             ThreadUnLock(&opcua_to_codesys_shutdown_mutex, &opcua_to_codesys_shutdown_cond, &opcua_to_codesys_shutdown);
@@ -643,9 +4126,11 @@ static void CodesysToOpcUaMessageHandler(union sigval sv) {
     ssize_t received;
 
     do {
-        received = mq_receive_msg(mq, buffer, sizeof(buffer), NULL);
+        unsigned prio = 0;
+        received = mq_receive_msg(mq, buffer, sizeof(buffer), &prio);
         if (received > 0) {
-            IncomingPacketManager(&buffer, received);
+            IngressLaneFrames[LaneFromPriority(prio)]++;
+            IncomingPacketManager(buffer, received, MonotonicNs());
         }
     } while (received > 0);
 
@@ -658,55 +4143,276 @@ static void CodesysToOpcUaMessageHandler(union sigval sv) {
     mq_set_notification(mq, &notification);
 }
 
-static void *CodesysToOpcUaPthread(void *arg) {
-    mqueue_codesys_to_opcua = mq_init(QUEUE_NAME_CODESYS_TO_OPCUA, 5, MAX_MSG_SIZE, O_CREAT | O_RDONLY | O_NONBLOCK);
-    if (mqueue_codesys_to_opcua == -1) {
-        perror("mqueue_codesys_to_opcua failed");
-        exit(EXIT_FAILURE);
+static void PinCurrentThread(int cpu) {
+    if (cpu < 0) {
+        return;
     }
 
-    struct sigevent notification;
-    notification.sigev_notify = SIGEV_THREAD;
-    notification.sigev_notify_function = CodesysToOpcUaMessageHandler;
-    notification.sigev_notify_attributes = NULL;
-    notification.sigev_value.sival_ptr = &mqueue_codesys_to_opcua;
+#ifdef __QNX__
+    /* ParseCommandLine keeps cpu below INGRESS_CPU_LIMIT */
+    if (ThreadCtl(_NTO_TCTL_RUNMASK, (void *)(uintptr_t)(1u << cpu)) == -1) {
+        perror("[OPC_UA] ThreadCtl(_NTO_TCTL_RUNMASK) failed");
+    }
+#endif
+}
 
-    if (mq_set_notification(mqueue_codesys_to_opcua, &notification) != 0) {
-        perror("mq_set_notification failed");
-        exit(EXIT_FAILURE);
+static void CodesysToOpcUaReceiveLoop(void) {
+    uint8_t buffer[MAX_MSG_SIZE];
+    ssize_t received;
+    struct timespec timeout;
+
+    PinCurrentThread(ingress_cpu);
+
+    /* MSG_TYPE_SHUT_DOWN is handled on this thread and raises the flag itself. In EventLoop
+     * mode the thread only serves the registration, END_REGISTRATION hands the queue over. */
+    while (!codesys_to_opcua_shutdown && !ingress_handed_over) {
+        clock_gettime(CLOCK_REALTIME, &timeout);
+        timeout.tv_nsec += INGRESS_RECEIVE_TIMEOUT_MS * 1000000L;
+        if (timeout.tv_nsec >= 1000000000L) {
+            timeout.tv_sec += timeout.tv_nsec / 1000000000L;
+            timeout.tv_nsec %= 1000000000L;
+        }
+
+        /* The shared memory ring is FIFO, every frame counts as normal */
+        unsigned prio = LanePriority[LANE_NORMAL];
+        if (transport == TRANSPORT_SHM) {
+            received = shm_ring_receive_timed(&ShmTransport.segment->codesys_to_opcua, buffer, sizeof(buffer), &timeout);
+        } else {
+            received = mq_receive_timed(mqueue_codesys_to_opcua, buffer, sizeof(buffer), &prio, &timeout);
+        }
+        if (received > 0) {
+            IngressLaneFrames[LaneFromPriority(prio)]++;
+            IncomingPacketManager(buffer, received, MonotonicNs());
+        }
+    }
+}
+
+static void *CodesysToOpcUaPthread(void *arg) {
+    if (transport == TRANSPORT_MQUEUE) {
+        int flags = O_CREAT | O_RDONLY;
+
+        if (ingress_mode == INGRESS_MODE_NOTIFY) {
+            flags |= O_NONBLOCK;
+        }
+
+        mqueue_codesys_to_opcua = mq_init(QUEUE_NAME_CODESYS_TO_OPCUA, 5, MAX_MSG_SIZE, flags);
+        if (mqueue_codesys_to_opcua == -1) {
+            perror("mqueue_codesys_to_opcua failed");
+            exit(EXIT_FAILURE);
+        }
     }
 
-    ThreadUnLock(&codesys_to_opcua_ready_mutex, &codesys_to_opcua_ready_cond, &codesys_to_opcua_ready);
+    /* The shared memory rings have no notification mechanism, always receive in a loop */
+    if (transport == TRANSPORT_SHM || ingress_mode == INGRESS_MODE_BLOCKING) {
+        ThreadUnLock(&codesys_to_opcua_ready_mutex, &codesys_to_opcua_ready_cond, &codesys_to_opcua_ready);
+
+        CodesysToOpcUaReceiveLoop();
+    } else if (ingress_mode == INGRESS_MODE_EVENTLOOP) {
+        ThreadUnLock(&codesys_to_opcua_ready_mutex, &codesys_to_opcua_ready_cond, &codesys_to_opcua_ready);
+
+        CodesysToOpcUaReceiveLoop();
+
+        /* SHUT_DOWN is decoded inside the EventLoop, which may still drain and re-arm the
+         * queue; it is closed only after UA_Server_run_shutdown has stopped the EventSource */
+        ThreadLock(&codesys_to_opcua_shutdown_mutex, &codesys_to_opcua_shutdown_cond, &codesys_to_opcua_shutdown);
+        if (ingress_handed_over) {
+            ThreadLock(&opcua_server_stopped_mutex, &opcua_server_stopped_cond, &opcua_server_stopped);
+        }
+    } else {
+        struct sigevent notification;
+        notification.sigev_notify = SIGEV_THREAD;
+        notification.sigev_notify_function = CodesysToOpcUaMessageHandler;
+        notification.sigev_notify_attributes = NULL;
+        notification.sigev_value.sival_ptr = &mqueue_codesys_to_opcua;
+
+        if (mq_set_notification(mqueue_codesys_to_opcua, &notification) != 0) {
+            perror("mq_set_notification failed");
+            exit(EXIT_FAILURE);
+        }
 
-    ThreadLock(&codesys_to_opcua_shutdown_mutex, &codesys_to_opcua_shutdown_cond, &codesys_to_opcua_shutdown);
+        ThreadUnLock(&codesys_to_opcua_ready_mutex, &codesys_to_opcua_ready_cond, &codesys_to_opcua_ready);
 
-    mq_set_notification(mqueue_codesys_to_opcua, NULL);
-    mq_close_queue(mqueue_codesys_to_opcua);
-    mq_unlink_queue(QUEUE_NAME_CODESYS_TO_OPCUA);
-    mqueue_codesys_to_opcua = -1;
+        ThreadLock(&codesys_to_opcua_shutdown_mutex, &codesys_to_opcua_shutdown_cond, &codesys_to_opcua_shutdown);
+
+        mq_set_notification(mqueue_codesys_to_opcua, NULL);
+    }
+
+    if (transport == TRANSPORT_MQUEUE) {
+        mq_close_queue(mqueue_codesys_to_opcua);
+        mq_unlink_queue(QUEUE_NAME_CODESYS_TO_OPCUA);
+        mqueue_codesys_to_opcua = -1;
+    }
 
 #ifdef DEBUG
-    printf("[OPC_UA] CodesysToOpcUaPthread shutdown.\n");
+    printf("[OPC_UA] CodesysToOpcUaPthread shutdown (%s ingress).\n",
+           transport == TRANSPORT_SHM ? "shm" : (ingress_mode == INGRESS_MODE_BLOCKING ? "blocking" :
+           (ingress_mode == INGRESS_MODE_EVENTLOOP ? "eventloop" : "notify")));
+    LatencyStatsPrint("Ingress enqueue -> handled", &IngressQueueLatency);
+    LatencyStatsPrint("Ingress receive -> handled", &IngressHandlerLatency);
+    WireStatsPrint("Ingress", IngressWireStats);
     fflush(stdout);
 #endif
 
     return NULL;
 }
 
+static void CodesysEventSourceDrain(codesys_event_source_t *source) {
+    uint8_t buffer[MAX_MSG_SIZE];
+    ssize_t received;
+
+    do {
+        unsigned prio = 0;
+        received = mq_receive_msg(source->mqdes, buffer, sizeof(buffer), &prio);
+        if (received > 0) {
+            IngressLaneFrames[LaneFromPriority(prio)]++;
+            IncomingPacketManager(buffer, received, MonotonicNs());
+        }
+    } while (received > 0 && opcua_server_pthread_running);
+}
+
+/* mq_notify fires only on an empty -> non-empty transition: drain, re-arm, drain again */
+static void CodesysEventSourceArm(codesys_event_source_t *source) {
+    struct sigevent notification;
+
+    CodesysEventSourceDrain(source);
+
+    memset(&notification, 0, sizeof(notification));
+    notification.sigev_notify = SIGEV_SIGNAL;
+    notification.sigev_signo = source->signo;
+    notification.sigev_value.sival_ptr = source;
+    mq_set_notification(source->mqdes, &notification);
+
+    CodesysEventSourceDrain(source);
+}
+
+static void CodesysEventSourceInterrupt(UA_InterruptManager *im, uintptr_t interruptHandle, void *interruptContext, const UA_KeyValueMap *instanceInfos) {
+    codesys_event_source_t *source = (codesys_event_source_t*)interruptContext;
+
+    if (source->im.eventSource.state != UA_EVENTSOURCESTATE_STARTED) {
+        return;
+    }
+    CodesysEventSourceArm(source);
+}
+
+static UA_StatusCode CodesysEventSourceRegisterInterrupt(UA_InterruptManager *im, uintptr_t interruptHandle, const UA_KeyValueMap *params, UA_InterruptCallback callback, void *interruptContext) {
+    codesys_event_source_t *source = (codesys_event_source_t*)im;
+    return source->signals->registerInterrupt(source->signals, interruptHandle, params, callback, interruptContext);
+}
+
+static void CodesysEventSourceDeregisterInterrupt(UA_InterruptManager *im, uintptr_t interruptHandle) {
+    codesys_event_source_t *source = (codesys_event_source_t*)im;
+    source->signals->deregisterInterrupt(source->signals, interruptHandle);
+}
+
+static UA_StatusCode CodesysEventSourceStart(UA_EventSource *es) {
+    codesys_event_source_t *source = (codesys_event_source_t*)es;
+
+    source->mqdes = mqueue_codesys_to_opcua;
+    if (source->mqdes == -1) {
+        return UA_STATUSCODE_BADINTERNALERROR;
+    }
+
+    /* The registration thread received blocking, the EventLoop must never block */
+    if (mq_set_attributes(source->mqdes, O_NONBLOCK) != 0) {
+        return UA_STATUSCODE_BADINTERNALERROR;
+    }
+
+    UA_StatusCode retval = source->signals->registerInterrupt(source->signals, (uintptr_t)source->signo,
+                                                              &UA_KEYVALUEMAP_NULL, CodesysEventSourceInterrupt, source);
+    if (retval != UA_STATUSCODE_GOOD) {
+        return retval;
+    }
+
+    es->state = UA_EVENTSOURCESTATE_STARTED;
+
+    /* Frames that arrived during the handover have not raised a notification */
+    CodesysEventSourceArm(source);
+
+    return UA_STATUSCODE_GOOD;
+}
+
+static void CodesysEventSourceStop(UA_EventSource *es) {
+    codesys_event_source_t *source = (codesys_event_source_t*)es;
+
+    if (source->mqdes != -1) {
+        mq_set_notification(source->mqdes, NULL);
+    }
+    source->signals->deregisterInterrupt(source->signals, (uintptr_t)source->signo);
+    es->state = UA_EVENTSOURCESTATE_STOPPED;
+}
+
+static UA_StatusCode CodesysEventSourceFree(UA_EventSource *es) {
+    UA_String_clear(&es->name);
+    UA_KeyValueMap_clear(&es->params);
+    free(es);
+    return UA_STATUSCODE_GOOD;
+}
+
+/* Registers the CODESYS queue with the server's EventLoop, reusing its signal manager if any */
+static UA_StatusCode AddCodesysEventSource(UA_EventLoop *el) {
+    UA_InterruptManager *signals = NULL;
+
+    for (UA_EventSource *es = el->eventSources; es != NULL; es = es->next) {
+        if (es->eventSourceType == UA_EVENTSOURCETYPE_INTERRUPTMANAGER) {
+            signals = (UA_InterruptManager*)es;
+            break;
+        }
+    }
+    if (signals == NULL) {
+        signals = UA_InterruptManager_new_POSIX(UA_STRING("interrupt-posix"));
+        if (signals == NULL || el->registerEventSource(el, &signals->eventSource) != UA_STATUSCODE_GOOD) {
+            return UA_STATUSCODE_BADINTERNALERROR;
+        }
+    }
+
+    codesys_event_source_t *source = calloc(1, sizeof(codesys_event_source_t));
+    if (source == NULL) {
+        return UA_STATUSCODE_BADOUTOFMEMORY;
+    }
+
+    source->im.eventSource.eventSourceType = UA_EVENTSOURCETYPE_INTERRUPTMANAGER;
+    source->im.eventSource.name = UA_STRING_ALLOC("codesys-mqueue");
+    source->im.eventSource.start = CodesysEventSourceStart;
+    source->im.eventSource.stop = CodesysEventSourceStop;
+    source->im.eventSource.free = CodesysEventSourceFree;
+    source->im.registerInterrupt = CodesysEventSourceRegisterInterrupt;
+    source->im.deregisterInterrupt = CodesysEventSourceDeregisterInterrupt;
+    source->signals = signals;
+    source->signo = INGRESS_EVENTLOOP_SIGNAL;
+    source->mqdes = -1;
+
+    UA_StatusCode retval = el->registerEventSource(el, &source->im.eventSource);
+    if (retval != UA_STATUSCODE_GOOD) {
+        CodesysEventSourceFree(&source->im.eventSource);
+    }
+    return retval;
+}
+
 static void *OpcUaToCodesysPthread(void *arg) {
-    mqueue_opcua_to_codesys = mq_init(QUEUE_NAME_OPCUA_TO_CODESYS, 5, MAX_MSG_SIZE, O_CREAT | O_WRONLY | O_NONBLOCK);
-    if (mqueue_opcua_to_codesys == -1) {
-        perror("mqueue_opcua_to_codesys failed");
-        exit(EXIT_FAILURE);
+    if (transport == TRANSPORT_MQUEUE) {
+        int flags = O_CREAT | O_WRONLY;
+
+        /* Blocking sends go through mq_send_timed and need a blocking descriptor */
+        if (egress_policy != EGRESS_POLICY_BLOCK) {
+            flags |= O_NONBLOCK;
+        }
+
+        mqueue_opcua_to_codesys = mq_init(QUEUE_NAME_OPCUA_TO_CODESYS, 5, MAX_MSG_SIZE, flags);
+        if (mqueue_opcua_to_codesys == -1) {
+            perror("mqueue_opcua_to_codesys failed");
+            exit(EXIT_FAILURE);
+        }
     }
 
     ThreadUnLock(&opcua_to_codesys_ready_mutex, &opcua_to_codesys_ready_cond, &opcua_to_codesys_ready);
 
     ThreadLock(&opcua_to_codesys_shutdown_mutex, &opcua_to_codesys_shutdown_cond, &opcua_to_codesys_shutdown);
 
-    mq_close_queue(mqueue_opcua_to_codesys);
-    mq_unlink_queue(QUEUE_NAME_OPCUA_TO_CODESYS);
-    mqueue_opcua_to_codesys = -1;
+    if (transport == TRANSPORT_MQUEUE) {
+        mq_close_queue(mqueue_opcua_to_codesys);
+        mq_unlink_queue(QUEUE_NAME_OPCUA_TO_CODESYS);
+        mqueue_opcua_to_codesys = -1;
+    }
 
 #ifdef DEBUG
     printf("[OPC_UA] OpcUaToCodesysPthread shutdown.\n");
@@ -717,14 +4423,16 @@ static void *OpcUaToCodesysPthread(void *arg) {
 }
 
 static void *OpcUaServerPthread(void *arg) {
-    OpcUaServer = UA_Server_new();
+    opcua_server_thread = pthread_self();
+    opcua_server_thread_known = 1;
+
+    OpcUaServer = NewOpcUaServer();
 
     if (!OpcUaServer) {
         perror("[OPC_UA] OpcUaServerPthread channel create()");
         exit(EXIT_FAILURE);
     }
 
-    UA_ServerConfig_setDefault(UA_Server_getConfig(OpcUaServer));
     UA_ServerConfig* config = UA_Server_getConfig(OpcUaServer);
     config->verifyRequestTimestamp = UA_RULEHANDLING_ACCEPT;
 
@@ -753,11 +4461,91 @@ static void *OpcUaServerPthread(void *arg) {
 
     opcua_server_pthread_running = true;
 
-    UA_Server_run(OpcUaServer, &opcua_server_pthread_running);
+    /* Iterate manually so that coalesced egress changes are flushed once per iteration.
+     * The queue is drained in direct mode too, it carries the external string writes. */
+    UA_Server_addRepeatedCallback(OpcUaServer, IngressDrainCallback, NULL, INGRESS_DRAIN_INTERVAL_MS, NULL);
+    UA_Server_addRepeatedCallback(OpcUaServer, CyclePublishCallback, NULL, INGRESS_DRAIN_INTERVAL_MS, NULL);
+
+    if (ingress_mode == INGRESS_MODE_EVENTLOOP && transport == TRANSPORT_MQUEUE &&
+        AddCodesysEventSource(config->eventLoop) != UA_STATUSCODE_GOOD) {
+        perror("[OPC_UA] AddCodesysEventSource failed");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Profiles of the first registration, later ones are picked up between iterations */
+    ApplyProfileQueueLimit(config);
+
+    if (UA_Server_run_startup(OpcUaServer) == UA_STATUSCODE_GOOD) {
+        ServerCpuStats.start_ns = MonotonicNs();
+        while (opcua_server_pthread_running) {
+            uint64_t cpu = ThreadCpuNs();
+            UA_Server_run_iterate(OpcUaServer, true);
+            ServerCpuStats.cpu_ns += ThreadCpuNs() - cpu;
+            ServerCpuStats.iterations++;
+            ApplyProfileQueueLimit(config);
+            CyclePublish();
+            IngressDrain();
+            ImageDiffCycle();
+            pthread_mutex_lock(&tag_table_mutex);
+            EgressFlush();
+            pthread_mutex_unlock(&tag_table_mutex);
+            if (histogram_dump_requested) {
+                histogram_dump_requested = 0;
+                HistogramDump();
+            }
+        }
+    }
 
     UA_Server_run_shutdown(OpcUaServer);
+    ThreadUnLock(&opcua_server_stopped_mutex, &opcua_server_stopped_cond, &opcua_server_stopped);
+
+#ifdef DEBUG
+    printf("[OPC_UA] Egress flushes: %llu, records: %llu, max per flush: %u, coalesced: %llu\n",
+           (unsigned long long)EgressBatchStats.frames, (unsigned long long)EgressBatchStats.records,
+           EgressBatchStats.max_records, (unsigned long long)EgressCoalesced);
+    printf("[OPC_UA] Egress pending: %u, dropped: %llu, queue full: %llu, queue high-water: %u\n",
+           EgressPendingTotal(), (unsigned long long)EgressDropped, (unsigned long long)EgressQueueFull, EgressQueueHighWater);
+    LatencyStatsPrint("Egress change -> flush", &EgressFlushLatency);
+    WireStatsPrint("Egress", EgressWireStats);
+    LatencyStatsPrint("Ingress WriteServerVariableValue", &IngressWriteLatency);
+    /* Direct mode still queues external string writes */
+    if (ingress_apply == INGRESS_APPLY_QUEUE || IngressQueueWaitLatency.count > 0) {
+        LatencyStatsPrint("Ingress queue push -> apply", &IngressQueueWaitLatency);
+        LatencyStatsPrint("Ingress drain batch", &IngressDrainLatency);
+        printf("[OPC_UA] Ingress queue full: %llu, high-water: %u\n",
+               (unsigned long long)IngressQueueFull, IngressQueueHighWater);
+    }
+    HistogramDump();
+    printf("[OPC_UA] Arrays: %llu updates from %llu chunks, %llu aborted, %llu sent, %llu send failures\n",
+           (unsigned long long)ArrayStats.updates, (unsigned long long)ArrayStats.chunks, (unsigned long long)ArrayStats.aborted,
+           (unsigned long long)ArrayStats.egress_updates, (unsigned long long)ArrayStats.egress_dropped);
+    printf("[OPC_UA] Ingress deadband: passed %llu, filtered %llu\n",
+           (unsigned long long)DeadbandStats.passed, (unsigned long long)DeadbandStats.filtered);
+    if (CycleStats.cycles > 0) {
+        printf("[OPC_UA] Cycles: %llu, writes: %llu, max per cycle: %u, split: %llu, hand-over waits: %llu\n",
+               (unsigned long long)CycleStats.cycles, (unsigned long long)CycleStats.writes, CycleStats.max_writes,
+               (unsigned long long)CycleStats.split, (unsigned long long)CycleStats.waits);
+        LatencyStatsPrint("Cycle end -> published", &CycleStats.publish);
+        LatencyStatsPrint("Cycle apply", &CycleStats.apply);
+    }
+    printf("[OPC_UA] Structs: %llu updates, %llu rejected, %llu sent, %llu send failures\n",
+           (unsigned long long)StructStats.updates, (unsigned long long)StructStats.rejected,
+           (unsigned long long)StructStats.egress_updates, (unsigned long long)StructStats.egress_dropped);
+    if (process_image_name != NULL) {
+        printf("[OPC_UA] Process image: retries: %llu, failed reads: %llu\n",
+               (unsigned long long)ProcessImageRetries, (unsigned long long)ProcessImageFailedReads);
+    }
+    if (image_diff_enabled) {
+        printf("[OPC_UA] Image diff (%s): cycles: %llu, skipped: %llu, changed: %llu, %.2f GB/s\n",
+               image_diff_kernel(), (unsigned long long)ImageDiffStats.cycles, (unsigned long long)ImageDiffStats.skipped,
+               (unsigned long long)ImageDiffStats.changed,
+               ImageDiffStats.diff_ns ? (double)ImageDiffStats.bytes / (double)ImageDiffStats.diff_ns : 0.0);
+    }
+    fflush(stdout);
+#endif
 
     UA_Server_delete(OpcUaServer);
+    FreeStructTypes();
 
 #ifdef DEBUG
     printf("[OPC_UA] OpcUaServerPthread shutdown. \n");
@@ -778,6 +4566,10 @@ static int InitializeSyncPrimitives(void) {
         perror("Failed to initialize opcua_server_ready_mutex");
         result = -1;
     }
+    if (pthread_mutex_init(&opcua_server_stopped_mutex, NULL) != 0) {
+        perror("Failed to initialize opcua_server_stopped_mutex");
+        result = -1;
+    }
     if (pthread_mutex_init(&codesys_to_opcua_ready_mutex, NULL) != 0) {
         perror("Failed to initialize codesys_to_opcua_ready_mutex");
         result = -1;
@@ -794,6 +4586,15 @@ static int InitializeSyncPrimitives(void) {
         perror("Failed to initialize opcua_to_codesys_shutdown_mutex");
         result = -1;
     }
+    /* Recursive: ImageDiffCycle writes nodes while holding it and the node write
+     * callbacks take it again on the same thread */
+    pthread_mutexattr_t recursive;
+    pthread_mutexattr_init(&recursive);
+    pthread_mutexattr_settype(&recursive, PTHREAD_MUTEX_RECURSIVE);
+    if (pthread_mutex_init(&tag_table_mutex, &recursive) != 0) {
+        perror("Failed to initialize tag_table_mutex");
+        result = -1;
+    }
 
     if (pthread_cond_init(&variable_init_cond, NULL) != 0) {
         perror("Failed to initialize variable_init_cond");
@@ -803,6 +4604,10 @@ static int InitializeSyncPrimitives(void) {
         perror("Failed to initialize opcua_server_ready_cond");
         result = -1;
     }
+    if (pthread_cond_init(&opcua_server_stopped_cond, NULL) != 0) {
+        perror("Failed to initialize opcua_server_stopped_cond");
+        result = -1;
+    }
     if (pthread_cond_init(&codesys_to_opcua_ready_cond, NULL) != 0) {
         perror("Failed to initialize codesys_to_opcua_ready_cond");
         result = -1;
@@ -822,6 +4627,7 @@ static int InitializeSyncPrimitives(void) {
 
     variable_init_ready = 0;
     opcua_server_ready = 0;
+    opcua_server_stopped = 0;
     codesys_to_opcua_ready = 0;
     codesys_to_opcua_shutdown = 0;
     opcua_to_codesys_ready = 0;
@@ -839,10 +4645,201 @@ static int InitializeSyncPrimitives(void) {
     return result;
 }
 
+static void PrintUsage(const char *program) {
+    fprintf(stderr, "Usage: %s [-t mqueue|shm] [-i notify|blocking|eventloop] [-c cpu] [-e drop-oldest|drop-newest|block] [-w ms] [-b internal|external] [-p image [-d]] [-D] [-a queue|direct] [-l flat|tree] [-R] [-n hashmap|ziptree|dense] [-N] [-P tag]\n", program);
+    fprintf(stderr, "  -t  CODESYS<->OPC UA transport (default: mqueue)\n");
+    fprintf(stderr, "  -i  CODESYS->OPC UA ingress mode (default: notify, shm always receives in a loop,\n"
+                    "      eventloop serves the mqueue from the server EventLoop after registration)\n");
+    fprintf(stderr, "  -c  pin the blocking ingress thread to this CPU\n");
+    fprintf(stderr, "  -e  OPC UA->CODESYS policy when the pending store is full (default: drop-oldest)\n");
+    fprintf(stderr, "  -w  send timeout for the block policy in ms (default: %d)\n", EGRESS_BLOCK_TIMEOUT_MS);
+    fprintf(stderr, "  -b  value backend of the PLC tags (default: internal)\n");
+    fprintf(stderr, "  -p  shared memory name of the CODESYS process image, enables MSG_TYPE_IMAGE_BIND\n");
+    fprintf(stderr, "  -d  poll the process image and write only changed tags instead of a DataSource\n");
+    fprintf(stderr, "  -D  run the change detection benchmark and exit\n");
+    fprintf(stderr, "  -a  where PLC writes are applied: queue (server thread, default) or direct (receive thread)\n");
+    fprintf(stderr, "  -l  address space layout: flat (default) or tree (folders from dotted names)\n");
+    fprintf(stderr, "  -R  run the address space benchmark (%d tags) and exit\n", ADDRESS_BENCHMARK_TAGS);
+    fprintf(stderr, "  -n  nodestore (default: hashmap, dense keeps scalar tags in tables indexed by tag)\n");
+    fprintf(stderr, "  -N  run the nodestore benchmark (%d tags) and exit\n", ADDRESS_BENCHMARK_TAGS);
+    fprintf(stderr, "  -W  run the write path benchmark (%d tags) and exit\n", WRITE_BENCHMARK_TAGS);
+    fprintf(stderr, "  -V  run the value backend benchmark (%d tags) and exit\n", ADDRESS_BENCHMARK_TAGS);
+    fprintf(stderr, "  -P  sample this tag (full NodeId name) to measure PLC write -> sampled\n");
+    fprintf(stderr, "SIGUSR1 prints the per-hop latency histograms\n");
+}
+
+static int ParseCommandLine(int argc, char* argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:i:c:e:w:b:p:dDa:l:Rn:NVWP:")) != -1) {
+        switch (opt) {
+            case 't':
+                if (strcmp(optarg, "mqueue") == 0) {
+                    transport = TRANSPORT_MQUEUE;
+                } else if (strcmp(optarg, "shm") == 0) {
+                    transport = TRANSPORT_SHM;
+                } else {
+                    PrintUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'i':
+                if (strcmp(optarg, "notify") == 0) {
+                    ingress_mode = INGRESS_MODE_NOTIFY;
+                } else if (strcmp(optarg, "blocking") == 0) {
+                    ingress_mode = INGRESS_MODE_BLOCKING;
+                } else if (strcmp(optarg, "eventloop") == 0) {
+                    ingress_mode = INGRESS_MODE_EVENTLOOP;
+                } else {
+                    PrintUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'c': {
+                char *end = NULL;
+                long cpu = strtol(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || cpu < 0 || cpu >= INGRESS_CPU_LIMIT) {
+                    fprintf(stderr, "-c expects a CPU from 0 to %d\n", INGRESS_CPU_LIMIT - 1);
+                    PrintUsage(argv[0]);
+                    return -1;
+                }
+                ingress_cpu = (int)cpu;
+                break;
+            }
+            case 'e':
+                if (strcmp(optarg, "drop-oldest") == 0) {
+                    egress_policy = EGRESS_POLICY_DROP_OLDEST;
+                } else if (strcmp(optarg, "drop-newest") == 0) {
+                    egress_policy = EGRESS_POLICY_DROP_NEWEST;
+                } else if (strcmp(optarg, "block") == 0) {
+                    egress_policy = EGRESS_POLICY_BLOCK;
+                } else {
+                    PrintUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'w':
+                egress_block_timeout_ms = atoi(optarg);
+                break;
+            case 'p':
+                process_image_name = optarg;
+                break;
+            case 'P':
+                NotifyProbe.name = optarg;
+                break;
+            case 'd':
+                image_diff_enabled = 1;
+                break;
+            case 'a':
+                if (strcmp(optarg, "queue") == 0) {
+                    ingress_apply = INGRESS_APPLY_QUEUE;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    ingress_apply = INGRESS_APPLY_DIRECT;
+                } else {
+                    PrintUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'D':
+                RunImageDiffBenchmark();
+                exit(EXIT_SUCCESS);
+            case 'l':
+                if (strcmp(optarg, "tree") == 0) {
+                    address_layout = ADDRESS_LAYOUT_TREE;
+                } else if (strcmp(optarg, "flat") == 0) {
+                    address_layout = ADDRESS_LAYOUT_FLAT;
+                } else {
+                    PrintUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'R':
+                address_benchmark = 1;
+                break;
+            case 'n':
+                if (strcmp(optarg, "hashmap") == 0) {
+                    nodestore_kind = NODESTORE_HASHMAP;
+                } else if (strcmp(optarg, "ziptree") == 0) {
+                    nodestore_kind = NODESTORE_ZIPTREE;
+                } else if (strcmp(optarg, "dense") == 0) {
+                    nodestore_kind = NODESTORE_DENSE;
+                } else {
+                    PrintUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'N':
+                nodestore_benchmark = 1;
+                break;
+            case 'V':
+                value_backend_benchmark = 1;
+                break;
+            case 'W':
+                write_benchmark = 1;
+                break;
+            case 'b':
+                if (strcmp(optarg, "internal") == 0) {
+                    value_backend = VALUE_BACKEND_INTERNAL;
+                } else if (strcmp(optarg, "external") == 0) {
+                    value_backend = VALUE_BACKEND_EXTERNAL;
+                } else {
+                    PrintUsage(argv[0]);
+                    return -1;
+                }
+                break;
+            default:
+                PrintUsage(argv[0]);
+                return -1;
+        }
+    }
+
+    /* Writes decoded inside the EventLoop are already on the server thread */
+    if (ingress_mode == INGRESS_MODE_EVENTLOOP) {
+        ingress_apply = INGRESS_APPLY_DIRECT;
+    }
+
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
-    memset(&OpcUaChangeFlagBuffer, 0, sizeof(OpcUaChangeFlagBuffer));
+    if (ParseCommandLine(argc, argv) != 0) {
+        return EXIT_FAILURE;
+    }
 
     InitializeSyncPrimitives();
+    IngressQueueInit();
+
+    /* Need the tag table lock, so they run after the primitives exist */
+    if (address_benchmark) {
+        RunAddressSpaceBenchmark();
+        return EXIT_SUCCESS;
+    }
+    if (nodestore_benchmark) {
+        RunNodestoreBenchmark();
+        return EXIT_SUCCESS;
+    }
+    if (value_backend_benchmark) {
+        RunValueBackendBenchmark();
+        return EXIT_SUCCESS;
+    }
+    if (write_benchmark) {
+        RunWritePathBenchmark();
+        return EXIT_SUCCESS;
+    }
+
+    struct sigaction dump;
+    memset(&dump, 0, sizeof(dump));
+    dump.sa_handler = HistogramDumpSignal;
+    sigemptyset(&dump.sa_mask);
+    dump.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &dump, NULL);
+
+    if (transport == TRANSPORT_SHM) {
+        if (shm_transport_open(&ShmTransport, SHM_NAME_CODESYS_OPCUA, SHM_RING_SLOTS, MAX_MSG_SIZE, 1) != 0) {
+            perror("[OPC_UA] shm_transport_open failed");
+            return EXIT_FAILURE;
+        }
+    }
 
     /*******************************************************************/
 
@@ -907,5 +4904,18 @@ int main(int argc, char* argv[]) {
     pthread_join(OPCUA_TO_CODESYS_THREAD, NULL);
     pthread_join(OPCUA_SERVER_THREAD, NULL);
 
+    if (transport == TRANSPORT_SHM) {
+        shm_transport_close(&ShmTransport, SHM_NAME_CODESYS_OPCUA);
+    }
+
+    /* Every thread that looks up tags is gone */
+    FreeTagTable();
+    FreeFolderCache();
+    FreeArrayTable();
+    FreeStructTable();
+    FreeValueStore();
+    CloseProcessImage();
+    FreeImageDiffTables();
+
     return EXIT_SUCCESS;
 }
@@ -9,13 +9,23 @@
 #include <confname.h>
 #include <sys/stat.h>
 #include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <malloc.h>
 
 #include <mqueue.h>
 #include <mqueue_lib.h>
+#include <shm_ring.h>
+#include <image_diff.h>
+#include <dense_nodestore.h>
+#include <process_image.h>
 #include <open62541/server.h>
 #include <open62541/plugin/log_stdout.h>
 #include <open62541/server_config_default.h>
+#include <open62541/plugin/nodestore_default.h>
+#include <open62541/plugin/eventloop.h>
 #include <signal.h>
+#include <time.h>
 
 /* MQUEUE */
 
@@ -26,12 +36,59 @@
 static int mqueue_codesys_to_opcua = -1;
 static int mqueue_opcua_to_codesys = -1;
 
+#define INGRESS_RECEIVE_TIMEOUT_MS  100
+
+typedef enum {
+    INGRESS_MODE_NOTIFY = 0,    /* SIGEV_THREAD notification, drain and re-arm */
+    INGRESS_MODE_BLOCKING = 1,  /* long-lived thread looping on mq_receive_timed */
+    INGRESS_MODE_EVENTLOOP = 2, /* after registration, the queue is served by the server's EventLoop */
+} ingress_mode_t;
+
+static ingress_mode_t ingress_mode = INGRESS_MODE_NOTIFY;
+static volatile int ingress_handed_over = 0;   /* END_REGISTRATION passed the queue to the EventLoop */
+static int ingress_cpu = -1;
+#define INGRESS_CPU_LIMIT           32  /* _NTO_TCTL_RUNMASK takes a single 32-bit mask */
+
+/* EventLoop ingress: the queue notification is a realtime signal, delivered inside the
+ * server's UA_EventLoop by a POSIX InterruptManager, so PLC frames are decoded and applied
+ * in the same loop iteration as the network I/O. The EventSource is an InterruptManager
+ * facade (registerInterrupt is forwarded) because the EventLoop casts by eventSourceType. */
+#define INGRESS_EVENTLOOP_SIGNAL    (SIGRTMIN + 1)
+
+typedef struct {
+    UA_InterruptManager im;
+    UA_InterruptManager *signals;
+    int signo;
+    int mqdes;
+} codesys_event_source_t;
+
+/* SHM */
+
+#define SHM_NAME_CODESYS_OPCUA "/codesys_opcua_shm"
+#define SHM_RING_SLOTS 64
+
+typedef enum {
+    TRANSPORT_MQUEUE = 0,       /* POSIX mqueues via mqueue_lib.a */
+    TRANSPORT_SHM = 1,          /* shared memory SPSC rings via shm_ring.c */
+} transport_t;
+
+static transport_t transport = TRANSPORT_MQUEUE;
+static shm_transport_t ShmTransport = { -1, 0, NULL };
+
 /* OPC UA */
 
 UA_Server *OpcUaServer = NULL;
 
 volatile UA_Boolean opcua_server_pthread_running = true;
 
+/* Set by OpcUaServerPthread before the server exists */
+static pthread_t opcua_server_thread;
+static volatile int opcua_server_thread_known = 0;
+
+/* Raised by the receive thread when END_REGISTRATION releases the server loop. Until then
+ * it is the only thread driving the server and the egress ring. */
+static volatile int opcua_server_released = 0;
+
     /*******************************************************************/
 
 pthread_mutex_t variable_init_mutex;
@@ -44,6 +101,11 @@ pthread_mutex_t opcua_server_ready_mutex;
 pthread_cond_t opcua_server_ready_cond;
 volatile int opcua_server_ready = 0;
 
+/* Raised after UA_Server_run_shutdown, the EventLoop no longer touches the CODESYS queue */
+pthread_mutex_t opcua_server_stopped_mutex;
+pthread_cond_t opcua_server_stopped_cond;
+volatile int opcua_server_stopped = 0;
+
     /*******************************************************************/
 
 pthread_mutex_t codesys_to_opcua_ready_mutex;
@@ -83,6 +145,20 @@ enum {
 };
 
 typedef enum {
+    MSG_TYPE_CYCLE_BEGIN = 0xEC,
+    MSG_TYPE_CYCLE_END = 0xED,
+    MSG_TYPE_TAG_PROFILE = 0xEE,
+    MSG_TYPE_STRUCT_TYPE = 0xEF,
+    MSG_TYPE_STRUCT_REGISTRATION = 0xF0,
+    MSG_TYPE_WRITE_STRUCT = 0xF1,
+    MSG_TYPE_ARRAY_CHUNK = 0xF2,
+    MSG_TYPE_ARRAY_REGISTRATION = 0xF3,
+    MSG_TYPE_IMAGE_BIND = 0xF4,
+    MSG_TYPE_VARIABLE_REMOVE = 0xF5,
+    MSG_TYPE_END_UPDATE = 0xF6,
+    MSG_TYPE_START_UPDATE = 0xF7,
+    MSG_TYPE_REGISTRATION_BATCH = 0xF8,
+    MSG_TYPE_WRITE_BATCH = 0xF9,
     MSG_TYPE_START_REGISTRATION = 0xFA,
     MSG_TYPE_VARIABLE_REGISTRATION = 0xFB,
     MSG_TYPE_END_REGISTRATION = 0xFC,
@@ -93,22 +169,163 @@ typedef enum {
 static bool registration_active = false;
 typedef void*   RTS_HANDLE;
 
+#define TAG_TYPE_KIND_COUNT         (UA_DATATYPEKIND_STRING + 1)
+
+typedef enum {
+    TAG_STATE_EMPTY = 0,
+    TAG_STATE_ACTIVE = 1,
+    TAG_STATE_UPDATING = 2,     /* listed in MSG_TYPE_START_UPDATE, writes are buffered for replay */
+} tag_state_t;
+
+typedef struct {
+    UA_NodeId nodeId;
+    const UA_DataType *type;
+    uint8_t state;
+    uint8_t replay_pending;
+    uint8_t replay_value[MAX_DATA_SIZE];
+    uint8_t backend;            /* value_backend_t the node is bound to */
+    uint32_t image_offset;      /* VALUE_BACKEND_IMAGE: offset of the value in the process image */
+    uint8_t image_diff;         /* -d: ImageDiffCycle owns the value, PLC pushes are rejected */
+    uint8_t sampling_class;     /* sampling_class_t from MSG_TYPE_TAG_PROFILE */
+    uint8_t deadband_type;      /* UA_DeadbandType, PERCENT makes a numeric node an AnalogItemType */
+    uint16_t queue_size;
+    UA_Range eu_range;
+    uint8_t lane;               /* lane_t from MSG_TYPE_TAG_PROFILE */
+    uint8_t ingress_deadband;   /* UA_DeadbandType applied to PLC writes (profile, opt-in), numeric tags only */
+    uint8_t deadband_valid;     /* deadband_last holds a value, cleared when a client writes the tag */
+    double deadband_value;      /* profile ingress_deadband_value: absolute, or percent of eu_range */
+    double deadband_last;       /* last PLC value passed on to the server */
+} tag_entry_t;
+
+/* Newest unsent OPC UA -> CODESYS value of a tag */
+typedef struct {
+    uint8_t value[MAX_DATA_SIZE];
+    uint64_t since;             /* CLOCK_MONOTONIC ns of the first change since the last flush */
+    uint8_t pending;
+} egress_entry_t;
+
+/* Client writes are forwarded to CODESYS from the node write path (value callback, external
+ * backend or DataSource write) as soon as the Write service applies them. The gateway's own
+ * UA_Server_write* calls run in the admin session and are never forwarded back. */
+#define ADMIN_SESSION_GUID_DATA1    1
+
+/* PLC writes of deadband tags: filtered before they are queued, passed once taken */
 typedef struct {
-    uint8_t *UaBoolean;
-    uint8_t *UaSByte;
-    uint8_t *UaByte;
-    uint8_t *UaInt16;
-    uint8_t *UaUint16;
-    uint8_t *UaInt32;
-    uint8_t *UaUint32;
-    uint8_t *UaInt64;
-    uint8_t *UaUint64;
-    uint8_t *UaFloat;
-    uint8_t *UaDouble;
-    uint8_t *UaString;
-} change_flag_buffer;
+    uint64_t passed;
+    uint64_t filtered;
+} deadband_stats_t;
 
-change_flag_buffer OpcUaChangeFlagBuffer = {0};
+deadband_stats_t DeadbandStats = {0};
+
+typedef struct {
+    tag_entry_t *entries;
+    egress_entry_t *egress;
+    uint16_t size;
+} tag_table_t;
+
+typedef struct {
+    uint8_t typeKind;
+    uint16_t index;
+} tag_ref_t;
+
+/* Node context of a gateway variable: its (typeKind, index) packed into the pointer */
+#define TAG_NODE_CONTEXT(typeKind, index)   ((void *)(uintptr_t)(((uint32_t)(typeKind) << 16) | (index)))
+#define TAG_NODE_CONTEXT_TYPEKIND(context)  ((uint8_t)((uintptr_t)(context) >> 16))
+#define TAG_NODE_CONTEXT_INDEX(context)     ((uint16_t)((uintptr_t)(context) & 0xFFFF))
+
+typedef enum {
+    VALUE_BACKEND_INTERNAL = 0,     /* value stored in the node, PLC writes via UA_Server_writeValue */
+    VALUE_BACKEND_EXTERNAL = 1,     /* value stored in OpcUaValueStore, PLC writes are a memcpy */
+    VALUE_BACKEND_IMAGE = 2,        /* DataSource reading the shared PLC process image */
+} value_backend_t;
+
+static value_backend_t value_backend = VALUE_BACKEND_INTERNAL;
+static uint8_t value_backend_benchmark = 0;    /* -V */
+#define VALUE_BACKEND_BENCHMARK_ROUNDS  20
+
+#define VALUE_STORE_ALIGNMENT       64
+#define VALUE_STORE_SPARE           64  /* extra slots for tags added in update windows */
+#define VALUE_STORE_PAGE_SHIFT      8
+#define VALUE_STORE_PAGE_TAGS       (1u << VALUE_STORE_PAGE_SHIFT)
+#define VALUE_STORE_PAGES           ((UINT16_MAX + 1) >> VALUE_STORE_PAGE_SHIFT)
+
+/* Structure of arrays per UA_DataTypeKind: the scalar values packed by index, and a
+ * DataValue per tag whose variant borrows its slot. The nodes point into the arrays, so
+ * they are split into pages of VALUE_STORE_PAGE_TAGS tags that are allocated when the
+ * first tag of the page is bound and never move. */
+typedef struct {
+    uint8_t *values;            /* memSize per tag (UA_String for strings) */
+    char *strings;              /* MAX_DATA_SIZE characters per tag, strings only */
+    UA_DataValue *dataValues;
+    UA_DataValue **bindings;    /* referenced by the external backend of each node */
+} value_store_page_t;
+
+typedef struct {
+    value_store_page_t *pages[VALUE_STORE_PAGES];
+} value_store_t;
+
+value_store_t OpcUaValueStore[UA_DATATYPEKIND_STRING + 1] = {{{0}}};
+
+/* Process image: CODESYS exposes its variable area as a shared memory segment and bumps
+ * `sequence` to odd before and to even after every update (sequence lock, process_image.h).
+ * Tags are bound to offsets in `data` with MSG_TYPE_IMAGE_BIND and read through a DataSource,
+ * strings are MAX_DATA_SIZE zero-terminated characters. plc_sim plays the PLC side on a host. */
+#define PROCESS_IMAGE_READ_RETRIES  1000
+
+typedef struct {
+    uint32_t offset;
+    uint16_t index;
+    uint8_t typeKind;
+} image_binding_record_t;
+
+static const char *process_image_name = NULL;
+static const process_image_t *ProcessImage = NULL;
+static size_t process_image_mapped = 0;
+
+uint64_t ProcessImageRetries = 0;
+uint64_t ProcessImageFailedReads = 0;
+
+/* Change detection (-d): instead of a DataSource, the server thread gathers every bound tag
+ * into a dense per-type snapshot once per iteration, diffs it against the previous one and
+ * writes only the changed tags to their nodes. `runs` are bindings whose consecutive
+ * indices are consecutive in the image, so a PLC array of one type is a single memcpy. */
+#define IMAGE_UNBOUND               UINT32_MAX
+
+typedef struct {
+    uint16_t index;
+    uint16_t count;
+    uint32_t offset;
+} image_run_t;
+
+typedef struct {
+    uint8_t *current;
+    uint8_t *previous;
+    uint32_t *offsets;          /* image offset per tag index, IMAGE_UNBOUND if not bound */
+    uint16_t *changed;
+    image_run_t *runs;
+    uint16_t run_count;
+    uint16_t size;
+    uint8_t dirty;              /* bindings changed, runs must be rebuilt */
+} image_diff_table_t;
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t skipped;           /* sequence unchanged since the previous cycle */
+    uint64_t bytes;
+    uint64_t diff_ns;
+    uint64_t changed;
+} image_diff_stats_t;
+
+static uint8_t image_diff_enabled = 0;
+static uint32_t image_diff_sequence = 1;    /* odd, never matches a published image */
+image_diff_table_t ImageDiffTable[TAG_TYPE_KIND_COUNT] = {{0}};
+image_diff_stats_t ImageDiffStats = {0};
+
+/* Resolved NodeId and data type of every registered tag, addressed by (typeKind, index).
+ * The tables only grow during an update window; tag_table_mutex guards the reallocation
+ * against the server thread, which reaches the egress entries from its callbacks. */
+tag_table_t OpcUaTagTable[TAG_TYPE_KIND_COUNT] = {{0}};
+pthread_mutex_t tag_table_mutex;
 
 typedef struct {
     message_type_t message_type;
@@ -130,8 +347,608 @@ typedef struct {
     UA_DataTypeKind typeKind;
 } variable_write_t;
 
+/* MSG_TYPE_WRITE_VARIABLE may carry the PLC cycle time (CLOCK_REALTIME ns since the Unix
+ * epoch), it becomes the sourceTimestamp of the written value */
+typedef struct {
+    variable_write_t write;
+    uint64_t source_time;
+} variable_write_source_t;
+
+/* Array tags: registered with MSG_TYPE_ARRAY_REGISTRATION in an index space of their own,
+ * values travel in both directions as MSG_TYPE_ARRAY_CHUNK frames and are reassembled into
+ * one node write (one notification). Elements are packed in row-major order, strings take
+ * MAX_DATA_SIZE zero-terminated characters each. */
+#define ARRAY_MAX_DIMENSIONS        3
+#define ARRAY_MAX_ELEMENTS          65536
+
+typedef struct {
+    message_type_t message_type;
+    uint16_t index;
+    uint8_t typeKind;
+    uint8_t access_level;
+    uint8_t valueRank;          /* number of dimensions, 1..ARRAY_MAX_DIMENSIONS */
+    uint32_t arrayDimensions[ARRAY_MAX_DIMENSIONS];
+    char name[MAX_NAME_LENGTH];
+    char description[MAX_DESCRIPTION_LENGTH];
+} array_registration_t;
+
+typedef struct {
+    message_type_t message_type;
+    uint16_t index;
+    uint16_t update;            /* chunks of one value share it, the next value increments it */
+    uint32_t offset;            /* byte offset of the payload in the value */
+    uint32_t total;             /* byte size of the whole value */
+    uint16_t length;            /* payload bytes following the header */
+} array_chunk_header_t;
+
+#define ARRAY_CHUNK_PAYLOAD         (MAX_MSG_SIZE - sizeof(array_chunk_header_t))
+
+typedef struct {
+    UA_NodeId nodeId;
+    const UA_DataType *type;
+    uint8_t typeKind;
+    uint8_t valueRank;
+    UA_UInt32 arrayDimensions[ARRAY_MAX_DIMENSIONS];
+    uint32_t elements;
+    uint32_t elem_size;         /* bytes per element on the wire */
+    uint8_t *assembly;          /* ingress value being reassembled */
+    uint8_t *egress;            /* client value being chunked to CODESYS */
+    uint32_t received;
+    uint32_t egress_sent;       /* bytes of the egress value already in the queue */
+    uint64_t egress_since;      /* CLOCK_MONOTONIC ns of the client write */
+    uint16_t update;
+    uint16_t egress_update;
+    uint8_t assembling;
+    uint8_t egress_pending;
+    uint8_t lane;               /* lane_t from a TAG_PROFILE_ARRAY profile, kept across re-registration */
+} array_entry_t;
+
+typedef struct {
+    array_entry_t *entries;
+    uint16_t size;
+} array_table_t;
+
+typedef struct {
+    uint64_t chunks;
+    uint64_t updates;
+    uint64_t aborted;           /* chunk out of order or a new value before the previous completed */
+    uint64_t egress_updates;
+    uint64_t egress_dropped;
+} array_stats_t;
+
+array_table_t OpcUaArrayTable = {0};
+array_stats_t ArrayStats = {0};
+
+/* Structure tags: MSG_TYPE_STRUCT_TYPE describes a CODESYS STRUCT layout once (field type and
+ * byte offset in the PLC image), the server gets a custom UA_DataType and a DataType node for
+ * it. MSG_TYPE_STRUCT_REGISTRATION creates instances of a type in an index space of their own,
+ * MSG_TYPE_WRITE_STRUCT carries the whole PLC image of an instance in both directions and is
+ * applied as one node write. Strings are MAX_DATA_SIZE zero-terminated characters. */
+#define STRUCT_MAX_FIELDS           24
+
 typedef struct {
     uint8_t typeKind;
+    uint16_t offset;            /* byte offset in the PLC image */
+    char name[MAX_NAME_LENGTH];
+} struct_field_t;
+
+typedef struct {
+    message_type_t message_type;
+    uint16_t type_index;
+    uint16_t size;              /* byte size of the PLC image */
+    uint8_t field_count;
+    char name[MAX_NAME_LENGTH];
+    struct_field_t fields[STRUCT_MAX_FIELDS];
+} struct_type_registration_t;
+
+typedef struct {
+    message_type_t message_type;
+    uint16_t index;
+    uint16_t type_index;
+    uint8_t access_level;
+    char name[MAX_NAME_LENGTH];
+    char description[MAX_DESCRIPTION_LENGTH];
+} struct_registration_t;
+
+typedef struct {
+    message_type_t message_type;
+    uint16_t index;
+    uint16_t length;            /* PLC image bytes following the header */
+} struct_write_header_t;
+
+#define STRUCT_MAX_IMAGE_SIZE       (MAX_MSG_SIZE - sizeof(struct_write_header_t))
+#define STRUCT_MAX_MEM_SIZE         (STRUCT_MAX_FIELDS * 2 * sizeof(UA_String))
+
+/* Allocated once and never moved or freed while the server runs, the server keeps pointers
+ * to `type` and `members` */
+typedef struct {
+    UA_DataType type;
+    UA_DataTypeMember members[STRUCT_MAX_FIELDS];
+    UA_DataTypeArray *custom;
+    uint16_t image_size;
+    uint16_t image_offset[STRUCT_MAX_FIELDS];
+    uint16_t mem_offset[STRUCT_MAX_FIELDS];
     char name[MAX_NAME_LENGTH];
+    char type_id[MAX_NAME_LENGTH + 16];
+    char encoding_id[MAX_NAME_LENGTH + 32];
+    char member_names[STRUCT_MAX_FIELDS][MAX_NAME_LENGTH];
+} struct_type_t;
+
+typedef struct {
+    UA_NodeId nodeId;
+    struct_type_t *type;
+    uint8_t *egress;            /* PLC image of the client value waiting for the queue */
+    uint64_t egress_since;
+    uint8_t egress_pending;
+    uint8_t lane;               /* lane_t from a TAG_PROFILE_STRUCT profile, kept across re-registration */
+} struct_entry_t;
+
+typedef struct {
+    struct_type_t **types;
+    uint16_t types_size;
+    struct_entry_t *entries;
+    uint16_t size;
+} struct_table_t;
+
+typedef struct {
+    uint64_t updates;
+    uint64_t rejected;          /* unknown instance or image size mismatch */
+    uint64_t egress_updates;
+    uint64_t egress_dropped;
+} struct_stats_t;
+
+struct_table_t OpcUaStructTable = {0};
+struct_stats_t StructStats = {0};
+
+/* MSG_TYPE_WRITE_BATCH: header followed by `count` records */
+typedef struct {
+    message_type_t message_type;
+    uint16_t count;
+    uint64_t enqueue_time;      /* CLOCK_MONOTONIC ns at mq_send on the PLC side, 0 if not stamped */
+} variable_batch_header_t;
+
+typedef struct {
+    uint8_t value[MAX_DATA_SIZE];
     uint16_t index;
-} variable_context_t;
+    uint8_t typeKind;
+} variable_batch_record_t;
+
+#define MAX_BATCH_RECORDS ((MAX_MSG_SIZE - sizeof(variable_batch_header_t)) / sizeof(variable_batch_record_t))
+
+typedef struct {
+    uint64_t frames;
+    uint64_t records;
+    uint16_t last_records;
+    uint16_t max_records;
+} batch_stats_t;
+
+batch_stats_t IngressBatchStats = {0};
+
+/* MSG_TYPE_REGISTRATION_BATCH: header followed by `count` variable-length records,
+ * each a fixed part followed by name, description and value bytes (no terminators) */
+typedef struct {
+    message_type_t message_type;
+    uint16_t count;
+} registration_batch_header_t;
+
+typedef struct __attribute__((packed)) {
+    uint8_t typeKind;
+    AccessLevel access_level;
+    uint16_t index;
+    uint16_t NumberAcceptedParameters;
+    uint8_t name_length;
+    uint8_t description_length;
+    uint8_t value_length;
+    double deadbandValue;
+} registration_record_t;
+
+typedef struct {
+    uint64_t start_ns;
+    uint32_t tags;
+    uint32_t frames;
+} registration_stats_t;
+
+/* Wire protocol versions. v1 sends the raw structs above. v2 is negotiated with an extended
+ * MSG_TYPE_START_REGISTRATION and replaces both write frames with a packed frame of
+ * (typeKind, index, value) records, each value carried at its natural size. Control and
+ * registration frames keep their v1 layout. */
+#define PROTOCOL_VERSION_1          1
+#define PROTOCOL_VERSION_2          2
+#define PROTOCOL_VERSION_MAX        PROTOCOL_VERSION_2
+
+static uint8_t protocol_version = PROTOCOL_VERSION_1;          /* decoding thread */
+static uint8_t egress_protocol_version = PROTOCOL_VERSION_1;   /* server thread */
+
+/* Agreed version handed from the decoding thread to the server thread, which owns the
+ * egress ring: it switches egress_protocol_version and, with the flag, sends the reply
+ * before the next frame. 0 when nothing is pending. */
+#define PROTOCOL_NEGOTIATION_REPLY  0x80
+static uint8_t protocol_negotiation = 0;
+
+typedef struct __attribute__((packed)) {
+    message_type_t message_type;
+    uint8_t version;            /* highest version the sender supports, the reply carries the agreed one */
+} registration_start_t;
+
+#define WRITE_FRAME_V2_TIMESTAMP    0x01    /* header is followed by a uint64_t enqueue time */
+#define WRITE_FRAME_V2_SOURCE_TIME  0x02    /* then a uint64_t PLC cycle time for all records */
+
+typedef struct __attribute__((packed)) {
+    uint8_t message_type;
+    uint8_t flags;
+    uint16_t count;
+} write_frame_v2_header_t;
+
+/* Followed by the value: memSize bytes for numeric kinds, a length byte and the characters for strings */
+typedef struct __attribute__((packed)) {
+    uint8_t typeKind;
+    uint16_t index;
+} write_record_v2_t;
+
+typedef struct {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t updates;
+    uint64_t first_ns;
+    uint64_t last_ns;
+} wire_stats_t;
+
+wire_stats_t IngressWireStats[PROTOCOL_VERSION_MAX + 1] = {{0}};
+wire_stats_t EgressWireStats[PROTOCOL_VERSION_MAX + 1] = {{0}};
+
+registration_stats_t RegistrationStats = {0};
+
+/* Address space layout: with -l tree, dotted CODESYS paths (Application.GVL_Motors.M1.Speed)
+ * become folder objects created on demand. A tag keeps its full path as NodeId and the last
+ * segment as BrowseName. Folders get numeric NodeIds from the server and are found through an
+ * open-addressing cache keyed by path prefix, so registration stays linear in the tags.
+ * A path that is both a tag and a folder ("A.B" next to "A.B.C") would give two children of
+ * one parent the same BrowseName; whichever registers second is rejected. Folders stay until
+ * shutdown: one emptied by MSG_TYPE_VARIABLE_REMOVE is kept and reused by the next tag under
+ * its path. The flat layout is the default, clients see the NodeIds they always saw. */
+typedef enum {
+    ADDRESS_LAYOUT_TREE = 0,    /* one folder per path segment */
+    ADDRESS_LAYOUT_FLAT = 1,    /* every tag directly under the Objects folder */
+} address_layout_t;
+
+static address_layout_t address_layout = ADDRESS_LAYOUT_FLAT;
+
+#define FOLDER_CACHE_INITIAL        256     /* power of two */
+#define FOLDER_MAX_DEPTH            (MAX_NAME_LENGTH / 2)
+
+typedef struct {
+    uint32_t hash;
+    uint8_t used;
+    char path[MAX_NAME_LENGTH];
+    UA_NodeId nodeId;           /* numeric, nothing to free */
+} folder_cache_entry_t;
+
+typedef struct {
+    folder_cache_entry_t *entries;
+    uint32_t size;
+    uint32_t count;
+    uint64_t hits;
+    uint64_t misses;
+} folder_cache_t;
+
+folder_cache_t FolderCache = {0};
+
+/* -R: tags registered and browsed by the address space benchmark */
+#define ADDRESS_BENCHMARK_TAGS      50000
+#define ADDRESS_BENCHMARK_BROWSES   20
+
+static uint8_t address_benchmark = 0;
+
+/* -W: PLC writes through the tag table against the former lookup by string NodeId */
+#define WRITE_BENCHMARK_TAGS        10000
+#define WRITE_BENCHMARK_ROUNDS      10
+
+static uint8_t write_benchmark = 0;
+
+/* Nodestore of the server. The dense store keeps scalar tags of the gateway namespace in
+ * tables indexed by TAG_NODE_CONTEXT and hands every other node to a HashMap store. */
+#define GATEWAY_NAMESPACE           1
+#define NODESTORE_BENCHMARK_ROUNDS  10
+
+typedef enum {
+    NODESTORE_HASHMAP = 0,
+    NODESTORE_ZIPTREE = 1,
+    NODESTORE_DENSE = 2,
+    NODESTORE_COUNT
+} nodestore_kind_t;
+
+static nodestore_kind_t nodestore_kind = NODESTORE_HASHMAP;
+static const char *const NodestoreNames[NODESTORE_COUNT] = { "hashmap", "ziptree", "dense" };
+static uint8_t nodestore_benchmark = 0;
+
+/* MSG_TYPE_START_UPDATE and MSG_TYPE_VARIABLE_REMOVE: header followed by `count` tag_ref_t,
+ * MSG_TYPE_IMAGE_BIND: the same header followed by `count` image_binding_record_t */
+typedef struct {
+    message_type_t message_type;
+    uint16_t count;
+} tag_list_header_t;
+
+static bool update_active = false;
+
+/* MSG_TYPE_TAG_PROFILE: tag_list_header_t followed by `count` tag_profile_t. Sent after
+ * MSG_TYPE_START_REGISTRATION or MSG_TYPE_START_UPDATE and before the tags it describes, a
+ * profile shapes the node created by the next registration of the tag. The sampling class
+ * becomes the node's MinimumSamplingInterval, so client subscriptions are revised to it.
+ * The ingress deadband is opt-in here: PLC writes within it never reach the node. The
+ * registration's deadbandValue keeps its own meaning. */
+typedef enum {
+    SAMPLING_CLASS_DEFAULT = 0, /* no minimum, only the server limits apply */
+    SAMPLING_CLASS_FAST = 1,
+    SAMPLING_CLASS_NORMAL = 2,
+    SAMPLING_CLASS_SLOW = 3,
+    SAMPLING_CLASS_COUNT
+} sampling_class_t;
+
+static const UA_Double SamplingClassInterval[SAMPLING_CLASS_COUNT] = { 0.0, 50.0, 250.0, 1000.0 };
+
+/* Profile typeKind for the array and structure index spaces, only the criticality applies */
+#define TAG_PROFILE_ARRAY           0xFE
+#define TAG_PROFILE_STRUCT          0xFF
+
+/* Largest profile queue_size, a server-wide limit the server thread applies to its config */
+static uint16_t profile_queue_size_max = 0;
+
+typedef struct __attribute__((packed)) {
+    uint8_t typeKind;
+    uint16_t index;
+    uint8_t sampling_class;
+    uint16_t queue_size;        /* largest monitored item queue clients may request, 0 keeps the server limit */
+    uint8_t deadband_type;      /* UA_DEADBANDTYPE_NONE, _ABSOLUTE or _PERCENT */
+    double eu_low;              /* EURange for percent deadband */
+    double eu_high;
+    uint8_t criticality;        /* lane_t */
+    uint8_t ingress_deadband;   /* UA_DEADBANDTYPE_NONE, or drop PLC writes within ingress_deadband_value */
+    double ingress_deadband_value;  /* absolute, or percent of the EURange above */
+} tag_profile_t;
+
+/* CPU time of the server thread spent in UA_Server_run_iterate, where all sampling happens */
+typedef struct {
+    uint64_t start_ns;
+    uint64_t cpu_ns;
+    uint64_t iterations;
+} server_cpu_stats_t;
+
+server_cpu_stats_t ServerCpuStats = {0};
+
+typedef struct {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+} latency_stats_t;
+
+/* Per-hop latency histograms, log2 buckets split into HISTOGRAM_SUB_BUCKETS linear steps
+ * (about 12% resolution over the whole range). Dumped on SIGUSR1. */
+#define HISTOGRAM_SUB_BUCKETS       8
+#define HISTOGRAM_BUCKETS           ((64 - 2) * HISTOGRAM_SUB_BUCKETS)
+
+typedef enum {
+    HOP_PLC_TO_DECODE = 0,      /* PLC cycle time -> frame decoded by the gateway */
+    HOP_RECEIVE_TO_WRITE,       /* frame received -> value written to the node */
+    HOP_CLIENT_WRITE_TO_CALLBACK, /* client write (source timestamp, else server timestamp) -> write callback */
+    HOP_CALLBACK_TO_SEND,       /* write callback -> frame sent to CODESYS */
+    HOP_WRITE_TO_SAMPLE,        /* PLC value written -> sampled, -P probe tag only */
+    HOP_COUNT
+} latency_hop_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t max_ns;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+} latency_histogram_t;
+
+static const char *const LatencyHopNames[HOP_COUNT] = {
+    "PLC cycle -> decode",
+    "receive -> server write",
+    "client write -> callback",
+    "callback -> CODESYS send",
+    "server write -> sampled",
+};
+
+latency_histogram_t LatencyHops[HOP_COUNT];
+
+/* -P: clients only see a PLC value once the server samples the node, which no write path
+ * observes. A local monitored item on the probe tag, sampled at the tag's interval, feeds
+ * HOP_WRITE_TO_SAMPLE with the time from the newest write to the sample that carries it. */
+typedef struct {
+    const char *name;           /* tag NodeId, NULL without -P */
+    uint8_t typeKind;
+    uint16_t index;
+    UA_UInt32 monitoredItemId;  /* 0 while the probe tag is not registered */
+    uint64_t written_ns;        /* newest write not sampled yet, 0 if none */
+} notify_probe_t;
+
+static notify_probe_t NotifyProbe = {0};
+static volatile sig_atomic_t histogram_dump_requested = 0;
+
+/* Enqueue (PLC stamp) -> frame handled, and receive -> frame handled. Handled is written to
+ * the node in direct mode, but only queued or staged in a cycle otherwise: the rest of the
+ * way is IngressQueueWaitLatency and the HOP_RECEIVE_TO_WRITE histogram. */
+latency_stats_t IngressQueueLatency = {0};
+latency_stats_t IngressHandlerLatency = {0};
+
+/* Writes applied while an update window is open, and the longest pause between two of them */
+typedef struct {
+    uint64_t start_ns;
+    uint64_t last_write_ns;
+    uint64_t max_gap_ns;
+    uint64_t buffered;
+    uint64_t replayed;
+    latency_stats_t latency;
+} update_stats_t;
+
+update_stats_t UpdateStats = {0};
+
+/* Criticality lanes. Each tag belongs to one (MSG_TYPE_TAG_PROFILE, normal by default).
+ * Frames to CODESYS carry the lane's mq priority and POSIX queues deliver the highest
+ * priority first, so CODESYS is expected to send with the same mapping. Inside the gateway
+ * the ingress queue and the egress store keep one FIFO per lane and always drain the most
+ * critical non-empty one first. */
+typedef enum {
+    LANE_NORMAL = 0,
+    LANE_CRITICAL = 1,
+    LANE_BULK = 2,
+    LANE_COUNT
+} lane_t;
+
+static const lane_t LaneDrainOrder[LANE_COUNT] = { LANE_CRITICAL, LANE_NORMAL, LANE_BULK };
+static const unsigned LanePriority[LANE_COUNT] = { 1, 2, 0 };
+static const char *const LaneNames[LANE_COUNT] = { "normal", "critical", "bulk" };
+
+typedef enum {
+    LANE_INGRESS = 0,           /* frame received -> value written to the node */
+    LANE_EGRESS = 1,            /* write callback -> frame sent to CODESYS */
+    LANE_DIRECTION_COUNT
+} lane_direction_t;
+
+latency_histogram_t LaneLatency[LANE_DIRECTION_COUNT][LANE_COUNT];
+uint64_t IngressLaneFrames[LANE_COUNT] = {0};
+
+/* Ingress write queue: the receive threads only decode and push, the server thread applies
+ * the writes in batches from a repeated callback, so UA_Server_writeValue never contends
+ * for the server lock. Bounded multi-producer/single-consumer ring per lane, each cell
+ * carries a sequence number (free when sequence == position, full when sequence == position + 1). */
+#define INGRESS_QUEUE_SIZE          4096    /* power of two */
+#define INGRESS_DRAIN_INTERVAL_MS   5.0
+#define INGRESS_DRAIN_BATCH         512
+#define INGRESS_QUEUE_POLL_NS       50000L
+
+typedef enum {
+    INGRESS_APPLY_QUEUE = 0,    /* marshal writes onto the server thread */
+    INGRESS_APPLY_DIRECT = 1,   /* write from the receive thread, contends for the server lock */
+} ingress_apply_t;
+
+static ingress_apply_t ingress_apply = INGRESS_APPLY_QUEUE;
+
+/* Reassembled arrays and structure images travel as a heap copy of the PLC data owned by the
+ * cell or staged write; the server thread hands it to the apply function, then frees it */
+typedef void (*ingress_bulk_apply_t)(uint16_t index, uint8_t *data, uint32_t length);
+
+typedef struct {
+    volatile uint32_t sequence;
+    uint8_t typeKind;
+    uint16_t index;
+    uint64_t enqueue_ns;
+    UA_DateTime sourceTime;     /* 0 if the PLC sent no cycle time */
+    uint8_t value[MAX_DATA_SIZE];
+    ingress_bulk_apply_t apply; /* NULL for a scalar write */
+    uint8_t *bulk;
+    uint32_t bulk_length;
+} ingress_cell_t;
+
+typedef struct {
+    ingress_cell_t cells[INGRESS_QUEUE_SIZE];
+    volatile uint32_t enqueue_pos __attribute__((aligned(64)));
+    volatile uint32_t dequeue_pos __attribute__((aligned(64)));
+} ingress_queue_t;
+
+static ingress_queue_t IngressQueue[LANE_COUNT];
+
+/* Time spent in WriteServerVariableValue per write (includes waiting for the server lock in
+ * direct mode), per drained batch, and from push to apply */
+latency_stats_t IngressWriteLatency = {0};
+latency_stats_t IngressDrainLatency = {0};
+latency_stats_t IngressQueueWaitLatency = {0};
+uint64_t IngressQueueFull = 0;
+uint32_t IngressQueueHighWater = 0;
+
+/* Cycle-consistent snapshots: writes between MSG_TYPE_CYCLE_BEGIN and MSG_TYPE_CYCLE_END are
+ * staged in the back buffer by the receive thread. At cycle end the buffer is handed to the
+ * server thread, which applies the whole cycle between two iterations under one tag table
+ * lock, so clients never read or sample a half-written cycle. Two buffers: the PLC stages
+ * the next cycle while the previous one is published. */
+#define CYCLE_MAX_WRITES            INGRESS_QUEUE_SIZE
+
+typedef struct __attribute__((packed)) {
+    message_type_t message_type;
+    uint32_t cycle;
+    uint64_t source_time;       /* PLC cycle time for writes without their own, 0 if none */
+} cycle_marker_t;
+
+typedef struct {
+    uint8_t typeKind;
+    uint16_t index;
+    uint64_t staged_ns;
+    UA_DateTime sourceTime;
+    uint8_t value[MAX_DATA_SIZE];
+    ingress_bulk_apply_t apply;
+    uint8_t *bulk;
+    uint32_t bulk_length;
+} cycle_write_t;
+
+typedef struct {
+    uint32_t cycle;
+    uint32_t count;
+    UA_DateTime sourceTime;
+    uint64_t end_ns;
+    cycle_write_t writes[CYCLE_MAX_WRITES];
+} cycle_buffer_t;
+
+static cycle_buffer_t CycleBuffers[2];
+static cycle_buffer_t *cycle_back = &CycleBuffers[0];
+static cycle_buffer_t *cycle_front = NULL;  /* handed over, waiting for the server thread */
+static bool cycle_open = false;
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t writes;
+    uint32_t max_writes;
+    uint64_t split;             /* back buffer full, the cycle was published in parts */
+    uint64_t waits;             /* hand-over waited for the previous cycle */
+    latency_stats_t publish;    /* cycle end -> last write applied */
+    latency_stats_t apply;      /* whole cycle under the lock */
+} cycle_stats_t;
+
+cycle_stats_t CycleStats = {0};
+
+/* Egress pending store: per lane, tags with an unsent value in order of their first change */
+#define EGRESS_PENDING_LIMIT        4096
+#define EGRESS_BLOCK_TIMEOUT_MS     10
+#define EGRESS_BLOCK_POLL_NS        100000L
+
+typedef enum {
+    EGRESS_POLICY_DROP_OLDEST = 0,  /* evict the oldest pending tag */
+    EGRESS_POLICY_DROP_NEWEST = 1,  /* reject the incoming change */
+    EGRESS_POLICY_BLOCK = 2,        /* wait up to egress_block_timeout_ms for the queue, then drop newest */
+} egress_policy_t;
+
+static egress_policy_t egress_policy = EGRESS_POLICY_DROP_OLDEST;
+static int egress_block_timeout_ms = EGRESS_BLOCK_TIMEOUT_MS;
+
+/* Array and structure values go out in frames of their own. They wait in a lane FIFO of
+ * their own, after the lane's scalars; a chunked array that meets a full queue resumes at
+ * the next chunk on the next flush. A newer client value restarts it under a new update. */
+#define EGRESS_BULK_LIMIT           256
+
+typedef enum {
+    EGRESS_BULK_ARRAY = 0,
+    EGRESS_BULK_STRUCT = 1,
+} egress_bulk_kind_t;
+
+typedef struct {
+    uint8_t kind;               /* egress_bulk_kind_t */
+    uint16_t index;
+} egress_bulk_ref_t;
+
+typedef struct {
+    tag_ref_t pending[EGRESS_PENDING_LIMIT];
+    uint16_t head;
+    uint16_t count;
+    egress_bulk_ref_t bulk[EGRESS_BULK_LIMIT];
+    uint16_t bulk_head;
+    uint16_t bulk_count;
+} egress_lane_t;
+
+static egress_lane_t EgressLanes[LANE_COUNT];
+
+batch_stats_t EgressBatchStats = {0};
+latency_stats_t EgressFlushLatency = {0};
+uint64_t EgressCoalesced = 0;
+uint64_t EgressDropped = 0;
+uint64_t EgressQueueFull = 0;
+uint32_t EgressQueueHighWater = 0;
@@ -0,0 +1,308 @@
+/* Stand-in for the CODESYS side on a development host. Image mode owns the shared process
+ * image and rewrites it every cycle under the sequence lock, like the PLC task would.
+ * Shm mode (-t) is the producer of the gateway's shared memory transport: it registers the
+ * tags, writes a share of them every cycle and consumes whatever the gateway sends back. */
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <process_image.h>
+#include <shm_ring.h>
+
+#define PLC_SIM_IMAGE_NAME      "/codesys_process_image"
+#define PLC_SIM_TAGS            1000
+#define PLC_SIM_CYCLE_US        1000
+#define PLC_SIM_CHANGE_PERCENT  10
+#define PLC_SIM_SEND_POLL_NS    50000
+
+/* Wire layout of the v1 frames in main.h; message_type_t and UA_DataTypeKind are enums */
+#define SHM_NAME_CODESYS_OPCUA  "/codesys_opcua_shm"
+#define MAX_MSG_SIZE            1024
+#define MAX_NAME_LENGTH         32
+#define MAX_DATA_SIZE           MAX_NAME_LENGTH
+#define MAX_DESCRIPTION_LENGTH  64
+#define READWRITE               3
+#define TYPE_KIND_DOUBLE        10  /* UA_DATATYPEKIND_DOUBLE */
+
+enum {
+    MSG_TYPE_START_REGISTRATION = 0xFA,
+    MSG_TYPE_VARIABLE_REGISTRATION = 0xFB,
+    MSG_TYPE_END_REGISTRATION = 0xFC,
+    MSG_TYPE_WRITE_VARIABLE = 0xFD,
+    MSG_TYPE_SHUT_DOWN = 0xFE,
+};
+
+typedef struct {
+    uint32_t message_type;
+    uint32_t typeKind;
+    char name[MAX_NAME_LENGTH];
+    char description[MAX_DESCRIPTION_LENGTH];
+    uint8_t access_level;
+    uint8_t value[MAX_DATA_SIZE];
+    double deadbandValue;
+    uint16_t index;
+    uint16_t NumberAcceptedParameters;
+} variable_registration_t;
+
+typedef struct {
+    uint32_t message_type;
+    char name[MAX_NAME_LENGTH];
+    uint8_t value[MAX_DATA_SIZE];
+    uint16_t index;
+    uint32_t typeKind;
+} variable_write_t;
+
+static volatile sig_atomic_t plc_sim_running = 1;
+
+static void StopSignal(int signo) {
+    (void)signo;
+    plc_sim_running = 0;
+}
+
+static void PrintUsage(const char *name) {
+    fprintf(stderr, "Usage: %s [-t] [-p name] [-n tags] [-c cycle_us] [-u percent]\n", name);
+    fprintf(stderr, "  -t  produce on the shm transport of a gateway started with -t shm\n");
+    fprintf(stderr, "  -p  process image name (default: %s)\n", PLC_SIM_IMAGE_NAME);
+    fprintf(stderr, "  -n  tags, tag i is a double at offset i * 8 (default: %d)\n", PLC_SIM_TAGS);
+    fprintf(stderr, "  -c  PLC cycle in microseconds (default: %d)\n", PLC_SIM_CYCLE_US);
+    fprintf(stderr, "  -u  tags changed per cycle in percent (default: %d)\n", PLC_SIM_CHANGE_PERCENT);
+}
+
+static process_image_t *CreateProcessImage(const char *name, uint32_t size, size_t *mapped) {
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+    if (fd == -1) {
+        perror("[PLC_SIM] shm_open failed");
+        return NULL;
+    }
+
+    *mapped = sizeof(process_image_t) + size;
+    if (ftruncate(fd, *mapped) == -1) {
+        perror("[PLC_SIM] ftruncate failed");
+        close(fd);
+        return NULL;
+    }
+
+    void *memory = mmap(NULL, *mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (memory == MAP_FAILED) {
+        perror("[PLC_SIM] mmap failed");
+        return NULL;
+    }
+
+    process_image_t *image = (process_image_t*)memory;
+    memset(image, 0, *mapped);
+    image->size = size;
+    image->sequence = 0;
+    __atomic_store_n(&image->magic, PROCESS_IMAGE_MAGIC, __ATOMIC_RELEASE);
+    return image;
+}
+
+static void WaitNextCycle(struct timespec *wakeup, long cycle_us) {
+    wakeup->tv_nsec += cycle_us * 1000L;
+    while (wakeup->tv_nsec >= 1000000000L) {
+        wakeup->tv_nsec -= 1000000000L;
+        wakeup->tv_sec++;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, wakeup, NULL) == EINTR && plc_sim_running) {
+    }
+}
+
+static int RunProcessImage(const char *name, uint32_t tags, long cycle_us, uint32_t percent) {
+    size_t mapped = 0;
+    process_image_t *image = CreateProcessImage(name, tags * sizeof(double), &mapped);
+    if (image == NULL) {
+        return EXIT_FAILURE;
+    }
+
+    printf("[PLC_SIM] %s: %u doubles, cycle %ld us, %u%% changed per cycle\n", name, tags, cycle_us, percent);
+    fflush(stdout);
+
+    uint32_t changes = (uint32_t)((uint64_t)tags * percent / 100);
+    uint32_t next = 0;
+    uint64_t cycle = 0;
+    struct timespec wakeup;
+    clock_gettime(CLOCK_MONOTONIC, &wakeup);
+
+    while (plc_sim_running) {
+        /* A rolling window of tags changes, the rest keeps its value */
+        process_image_write_begin(image);
+        for (uint32_t i = 0; i < changes; i++) {
+            uint32_t tag = (next + i) % tags;
+            double value = sin((double)(cycle + tag) / 100.0) * 100.0;
+            memcpy(image->data + (size_t)tag * sizeof(double), &value, sizeof(double));
+        }
+        process_image_write_end(image);
+
+        next = (next + changes) % tags;
+        cycle++;
+        WaitNextCycle(&wakeup, cycle_us);
+    }
+
+    printf("[PLC_SIM] %llu cycles, sequence %u\n", (unsigned long long)cycle, image->sequence);
+    munmap(image, mapped);
+    shm_unlink(name);
+    return EXIT_SUCCESS;
+}
+
+/* Waits for room like CODESYS would, the gateway drains the ring every receive */
+static int SendFrame(shm_transport_t *shm, const void *frame, size_t length, uint64_t *full) {
+    struct timespec poll = {0, PLC_SIM_SEND_POLL_NS};
+
+    while (shm_ring_send(&shm->segment->codesys_to_opcua, frame, length) != 0) {
+        if (errno != EAGAIN || !plc_sim_running) {
+            return -1;
+        }
+        (*full)++;
+        nanosleep(&poll, NULL);
+    }
+    return 0;
+}
+
+static uint64_t DrainGateway(shm_transport_t *shm) {
+    uint8_t frame[MAX_MSG_SIZE];
+    uint64_t frames = 0;
+
+    while (shm_ring_receive(&shm->segment->opcua_to_codesys, frame, sizeof(frame)) >= 0) {
+        frames++;
+    }
+    return frames;
+}
+
+static int RunShmProducer(uint32_t tags, long cycle_us, uint32_t percent) {
+    shm_transport_t shm = { -1, 0, NULL };
+    uint64_t full = 0;
+    uint64_t received = 0;
+    uint64_t writes = 0;
+
+    /* The gateway creates the segment at startup */
+    if (shm_transport_open(&shm, SHM_NAME_CODESYS_OPCUA, 0, 0, 0) != 0) {
+        perror("[PLC_SIM] shm_transport_open failed");
+        return EXIT_FAILURE;
+    }
+
+    uint32_t header = MSG_TYPE_START_REGISTRATION;
+    if (SendFrame(&shm, &header, sizeof(header), &full) != 0) {
+        perror("[PLC_SIM] start registration failed");
+        shm_transport_close(&shm, NULL);
+        return EXIT_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < tags && plc_sim_running; i++) {
+        variable_registration_t message;
+        memset(&message, 0, sizeof(message));
+        message.message_type = MSG_TYPE_VARIABLE_REGISTRATION;
+        message.typeKind = TYPE_KIND_DOUBLE;
+        snprintf(message.name, sizeof(message.name), "Sim.T%05u", i);
+        message.access_level = READWRITE;
+        message.index = (uint16_t)i;
+        message.NumberAcceptedParameters = (uint16_t)tags;
+        if (SendFrame(&shm, &message, sizeof(message), &full) != 0) {
+            break;
+        }
+    }
+
+    header = MSG_TYPE_END_REGISTRATION;
+    SendFrame(&shm, &header, sizeof(header), &full);
+
+    printf("[PLC_SIM] %s: %u doubles registered, cycle %ld us, %u%% changed per cycle\n",
+           SHM_NAME_CODESYS_OPCUA, tags, cycle_us, percent);
+    fflush(stdout);
+
+    uint32_t changes = (uint32_t)((uint64_t)tags * percent / 100);
+    uint32_t next = 0;
+    uint64_t cycle = 0;
+    struct timespec wakeup;
+    clock_gettime(CLOCK_MONOTONIC, &wakeup);
+
+    while (plc_sim_running) {
+        for (uint32_t i = 0; i < changes && plc_sim_running; i++) {
+            variable_write_t message;
+            uint32_t tag = (next + i) % tags;
+            double value = sin((double)(cycle + tag) / 100.0) * 100.0;
+
+            memset(&message, 0, sizeof(message));
+            message.message_type = MSG_TYPE_WRITE_VARIABLE;
+            message.typeKind = TYPE_KIND_DOUBLE;
+            message.index = (uint16_t)tag;
+            memcpy(message.value, &value, sizeof(value));
+            if (SendFrame(&shm, &message, sizeof(message), &full) == 0) {
+                writes++;
+            }
+        }
+        received += DrainGateway(&shm);
+
+        next = (next + changes) % tags;
+        cycle++;
+        WaitNextCycle(&wakeup, cycle_us);
+    }
+
+    /* Bounded: a gateway that is gone never makes room */
+    header = MSG_TYPE_SHUT_DOWN;
+    for (int attempt = 0; attempt < 1000; attempt++) {
+        struct timespec poll = {0, PLC_SIM_SEND_POLL_NS};
+        if (shm_ring_send(&shm.segment->codesys_to_opcua, &header, sizeof(header)) == 0 || errno != EAGAIN) {
+            break;
+        }
+        nanosleep(&poll, NULL);
+    }
+
+    printf("[PLC_SIM] %llu cycles, %llu writes, %llu ring full, %llu frames from the gateway\n",
+           (unsigned long long)cycle, (unsigned long long)writes, (unsigned long long)full,
+           (unsigned long long)received);
+    shm_transport_close(&shm, NULL);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    const char *name = PLC_SIM_IMAGE_NAME;
+    uint32_t tags = PLC_SIM_TAGS;
+    long cycle_us = PLC_SIM_CYCLE_US;
+    uint32_t percent = PLC_SIM_CHANGE_PERCENT;
+    int shm_producer = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "tp:n:c:u:")) != -1) {
+        switch (opt) {
+            case 't':
+                shm_producer = 1;
+                break;
+            case 'p':
+                name = optarg;
+                break;
+            case 'n':
+                tags = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            case 'c':
+                cycle_us = strtol(optarg, NULL, 10);
+                break;
+            case 'u':
+                percent = (uint32_t)strtoul(optarg, NULL, 10);
+                break;
+            default:
+                PrintUsage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (tags == 0 || tags > UINT16_MAX || cycle_us <= 0 || percent > 100) {
+        PrintUsage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    struct sigaction stop;
+    memset(&stop, 0, sizeof(stop));
+    stop.sa_handler = StopSignal;
+    sigemptyset(&stop.sa_mask);
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+
+    return shm_producer ? RunShmProducer(tags, cycle_us, percent) : RunProcessImage(name, tags, cycle_us, percent);
+}
@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <shm_ring.h>
+
+#define SHM_RING_ALIGN(x, a)    (((x) + ((a) - 1)) & ~((size_t)(a) - 1))
+
+static uint8_t *RingSlot(shm_ring_t *ring, uint32_t position) {
+    return (uint8_t*)ring + ring->data_offset + (size_t)(position % ring->slots) * ring->slot_stride;
+}
+
+static void RingWakeConsumer(shm_ring_t *ring) {
+    /* Pairs with the fence in shm_ring_receive_timed: either the consumer sees
+     * the new head before sleeping, or we see its waiting flag here. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->consumer_waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&ring->consumer_waiting, 0, __ATOMIC_ACQ_REL)) {
+        sem_post(&ring->data_ready);
+    }
+}
+
+static int RingInit(shm_ring_t *ring, size_t data_offset, uint32_t slots, uint32_t slot_size) {
+    ring->head = 0;
+    ring->tail = 0;
+    ring->consumer_waiting = 0;
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+    ring->slot_stride = SHM_RING_ALIGN(sizeof(uint32_t) + slot_size, 8);
+    ring->data_offset = data_offset;
+
+    return sem_init(&ring->data_ready, 1, 0);
+}
+
+int shm_transport_open(shm_transport_t *transport, const char *name, uint32_t slots,
+                       uint32_t slot_size, int create) {
+    if (!transport || !name || (create && (slots == 0 || slot_size == 0))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    size_t stride = SHM_RING_ALIGN(sizeof(uint32_t) + slot_size, 8);
+    size_t header = SHM_RING_ALIGN(sizeof(shm_segment_t), SHM_RING_CACHE_LINE);
+    size_t ring_data = SHM_RING_ALIGN((size_t)slots * stride, SHM_RING_CACHE_LINE);
+    size_t size = header + 2 * ring_data;
+
+    int fd = shm_open(name, create ? (O_CREAT | O_RDWR) : O_RDWR, 0666);
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (create) {
+        if (ftruncate(fd, size) == -1) {
+            close(fd);
+            return -1;
+        }
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(shm_segment_t)) {
+            close(fd);
+            errno = EINVAL;
+            return -1;
+        }
+        size = st.st_size;
+    }
+
+    shm_segment_t *segment = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    if (create) {
+        memset(segment, 0, header);
+        segment->size = size;
+
+        /* Ring data offsets are relative to each ring so that both processes
+         * can map the segment at different addresses. */
+        size_t base_in = (uint8_t*)&segment->codesys_to_opcua - (uint8_t*)segment;
+        size_t base_out = (uint8_t*)&segment->opcua_to_codesys - (uint8_t*)segment;
+
+        if (RingInit(&segment->codesys_to_opcua, header - base_in, slots, slot_size) == -1 ||
+            RingInit(&segment->opcua_to_codesys, header + ring_data - base_out, slots, slot_size) == -1) {
+            munmap(segment, size);
+            close(fd);
+            return -1;
+        }
+
+        __atomic_store_n(&segment->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+    } else if (__atomic_load_n(&segment->magic, __ATOMIC_ACQUIRE) != SHM_RING_MAGIC || segment->size != size) {
+        munmap(segment, size);
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    transport->fd = fd;
+    transport->size = size;
+    transport->segment = segment;
+
+    return 0;
+}
+
+int shm_transport_close(shm_transport_t *transport, const char *name) {
+    int result = 0;
+
+    if (!transport || !transport->segment) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (name) {
+        sem_destroy(&transport->segment->codesys_to_opcua.data_ready);
+        sem_destroy(&transport->segment->opcua_to_codesys.data_ready);
+    }
+
+    if (munmap(transport->segment, transport->size) == -1) {
+        result = -1;
+    }
+    close(transport->fd);
+
+    if (name && shm_unlink(name) == -1) {
+        result = -1;
+    }
+
+    transport->segment = NULL;
+    transport->fd = -1;
+    transport->size = 0;
+
+    return result;
+}
+
+int shm_ring_send(shm_ring_t *ring, const void *msg, size_t len) {
+    if (!ring || !msg) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (len > ring->slot_size) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    uint32_t head = ring->head;
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail >= ring->slots) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    uint8_t *slot = RingSlot(ring, head);
+    *(uint32_t*)slot = (uint32_t)len;
+    memcpy(slot + sizeof(uint32_t), msg, len);
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    RingWakeConsumer(ring);
+
+    return 0;
+}
+
+ssize_t shm_ring_receive(shm_ring_t *ring, void *msg, size_t len) {
+    if (!ring || !msg) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    uint32_t tail = ring->tail;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+    if (head == tail) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    uint8_t *slot = RingSlot(ring, tail);
+    uint32_t size = *(uint32_t*)slot;
+
+    if (size > len) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    memcpy(msg, slot + sizeof(uint32_t), size);
+
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return size;
+}
+
+ssize_t shm_ring_receive_timed(shm_ring_t *ring, void *msg, size_t len,
+                               const struct timespec *timeout) {
+    for (;;) {
+        ssize_t received = shm_ring_receive(ring, msg, len);
+        if (received >= 0 || errno != EAGAIN) {
+            return received;
+        }
+
+        /* Announce that we are going idle, then re-check before sleeping */
+        __atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) != ring->tail) {
+            __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        int result;
+        do {
+            result = sem_timedwait(&ring->data_ready, timeout);
+        } while (result == -1 && errno == EINTR);
+
+        __atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+
+        if (result == -1) {
+            return -1;
+        }
+    }
+}
+
+uint32_t shm_ring_count(shm_ring_t *ring) {
+    return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}